@@ -0,0 +1,575 @@
+//
+//  asyncLog.cpp
+//
+//  Binary log ring behind LogObject::writeLog.
+//
+
+#include "asyncLog.h"
+#include "sftp.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+
+AsyncLog asyncLog;
+
+#define logFlushInterval 5 // ms between two passes of the log writer
+
+struct LogHeader
+{
+    uint32_t size;     // bytes of the record, arguments included, multiple of 8
+    int32_t inScreen;  // -1 for the padding before the ring wraps
+    struct timespec time;
+    LogObject *log;
+    const char *format;
+};
+
+// one printf conversion, the arguments it takes are stored in the record
+struct LogSpec
+{
+    const char *begin, *end; // '%' and the character after the conversion
+    int widthStar, precisionStar;
+    const char *flags, *width, *precision; // as written in the format, no copies on the logging thread
+    int flagsLength, widthLength, precisionLength;
+    char length[3];
+    char conversion;
+};
+
+// fills spec with the conversion starting at p ('%'), returns 0 at the end of the format
+static int nextSpec(const char *&p, LogSpec &spec)
+{
+    while ((*p != 0) && (*p != '%'))
+       p++;
+    if (*p == 0)
+       return 0;
+    spec.begin = p++;
+    spec.widthStar = spec.precisionStar = 0;
+    spec.flags = p;
+    while ((*p != 0) && (strchr("-+ #0'", *p) != NULL))
+       p++;
+    spec.flagsLength = p - spec.flags;
+    spec.width = p;
+    if (*p == '*')
+    {
+       spec.widthStar = 1;
+       p++;
+    }
+    else while ((*p >= '0') && (*p <= '9'))
+       p++;
+    spec.widthLength = spec.widthStar ? 0 : p - spec.width;
+    spec.precision = p;
+    if (*p == '.')
+    {
+       p++;
+       if (*p == '*')
+       {
+          spec.precisionStar = 1;
+          p++;
+       }
+       else while ((*p >= '0') && (*p <= '9'))
+          p++;
+    }
+    spec.precisionLength = spec.precisionStar ? 0 : p - spec.precision;
+    int n = 0;
+    while ((*p != 0) && (strchr("hlLqjzt", *p) != NULL) && (n < 2))
+       spec.length[n++] = *p++;
+    spec.length[n] = 0;
+    spec.conversion = *p;
+    if (*p != 0)
+       p++;
+    spec.end = p;
+    return 1;
+}
+
+static int isLength(const LogSpec &spec, const char *length)
+{
+    return !strcmp(spec.length, length);
+}
+
+// how each argument is read from the va_list, in the order of the format
+enum LogArgument { argInt, argUnsigned, argLong, argUnsignedLong, argLongLong, argUnsignedLongLong,
+                   argChar, argUnsignedChar, argShort, argUnsignedShort,
+                   argDouble, argLongDouble, argString, argPointer, argIgnored };
+
+#define logFormatArguments 24
+#define logFormatCache 64 // formats per thread, by address
+
+// the arguments a format takes, parsed once per thread and format
+struct LogFormat
+{
+    const char *format;
+    int count; // -1 if it has more than logFormatArguments
+    unsigned char arguments[logFormatArguments];
+};
+
+static thread_local LogFormat formatCache[logFormatCache];
+
+static int integerArgument(const LogSpec &spec, int isSigned)
+{
+    if (isLength(spec, "hh")) return isSigned ? argChar : argUnsignedChar;
+    if (isLength(spec, "h")) return isSigned ? argShort : argUnsignedShort;
+    if (isLength(spec, "ll") || isLength(spec, "q")) return isSigned ? argLongLong : argUnsignedLongLong;
+    if (spec.length[0] != 0) return isSigned ? argLong : argUnsignedLong; // l, j, z, t
+    return isSigned ? argInt : argUnsigned;
+}
+
+static const LogFormat &formatArguments(const char *format)
+{
+    LogFormat &f = formatCache[((uintptr_t) format >> 3) & (logFormatCache-1)];
+    if (f.format == format)
+       return f;
+    f.format = format;
+    f.count = 0;
+    LogSpec spec;
+    const char *p = format;
+    while (nextSpec(p, spec))
+    {
+       unsigned char kinds[3];
+       int n = 0;
+       if (spec.widthStar)
+          kinds[n++] = argInt;
+       if (spec.precisionStar)
+          kinds[n++] = argInt;
+       switch (spec.conversion)
+       {
+          case 'd': case 'i': kinds[n++] = integerArgument(spec, 1); break;
+          case 'u': case 'o': case 'x': case 'X': kinds[n++] = integerArgument(spec, 0); break;
+          case 'c': kinds[n++] = argInt; break;
+          case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+             kinds[n++] = isLength(spec, "L") ? argLongDouble : argDouble;
+             break;
+          case 's': kinds[n++] = argString; break;
+          case 'p': kinds[n++] = argPointer; break;
+          case 'n': kinds[n++] = argIgnored; break; // nothing to count into once the record is formatted
+          default: break;
+       }
+       if (f.count + n > logFormatArguments)
+       {
+          f.count = -1;
+          return f;
+       }
+       for (int k = 0; k < n; k++)
+          f.arguments[f.count++] = kinds[k];
+    }
+    return f;
+}
+
+// stores the arguments of the record, returns the bytes used
+static size_t encodeArguments(unsigned char *out, size_t room, const char *format, va_list args)
+{
+    const LogFormat &f = formatArguments(format);
+    int count = (f.count < 0) ? logFormatArguments : f.count; // the rest is left out
+    size_t used = 0;
+    for (int a = 0; a < count; a++)
+    {
+       if (used + 16 > room)
+          break;
+       int64_t value;
+       switch (f.arguments[a])
+       {
+          case argInt: value = va_arg(args, int); break;
+          case argUnsigned: value = va_arg(args, unsigned int); break;
+          case argLong: value = va_arg(args, long); break;
+          case argUnsignedLong: value = va_arg(args, unsigned long); break;
+          case argLongLong: value = va_arg(args, long long); break;
+          case argUnsignedLongLong: value = va_arg(args, unsigned long long); break;
+          case argChar: value = (signed char) va_arg(args, int); break;
+          case argUnsignedChar: value = (unsigned char) va_arg(args, unsigned int); break;
+          case argShort: value = (short) va_arg(args, int); break;
+          case argUnsignedShort: value = (unsigned short) va_arg(args, unsigned int); break;
+          case argDouble:
+          {
+             double d = va_arg(args, double);
+             memcpy(out+used, &d, 8);
+             used += 8;
+             continue;
+          }
+          case argLongDouble:
+          {
+             long double ld = va_arg(args, long double);
+             memcpy(out+used, &ld, sizeof(ld));
+             used += (sizeof(ld)+7) & ~7;
+             continue;
+          }
+          case argString:
+          {
+             const char *s = va_arg(args, const char *);
+             if (s == NULL)
+                s = "(null)";
+             size_t len = strlen(s);
+             if (len > room - used - 8)
+                len = room - used - 8;
+             uint32_t stored = len;
+             memcpy(out+used, &stored, 4);
+             memcpy(out+used+4, s, len);
+             used += (4 + len + 7) & ~7;
+             continue;
+          }
+          case argPointer:
+             value = (intptr_t) va_arg(args, void *);
+             break;
+          default:
+             va_arg(args, void *);
+             continue;
+       }
+       memcpy(out+used, &value, 8);
+       used += 8;
+    }
+    return used;
+}
+
+static void appendFormatted(string &out, const char *spec, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, spec);
+    int n = vsnprintf(text, sizeof(text), spec, args);
+    va_end(args);
+    if (n < 0)
+       return;
+    if (n < sizeof(text))
+    {
+       out.append(text, n);
+       return;
+    }
+    vector<char> longer(n+1);
+    va_start(args, spec);
+    vsnprintf(&longer[0], n+1, spec, args);
+    va_end(args);
+    out.append(&longer[0], n);
+}
+
+static void setLength(char *conversion, const char *length, char type)
+{
+    int n = strlen(length);
+    memcpy(conversion, length, n);
+    conversion[n] = type;
+    conversion[n+1] = 0;
+}
+
+// the printf text of the record, returns its size
+size_t AsyncLog::format(const unsigned char *record, string &out)
+{
+    LogHeader header;
+    memcpy(&header, record, sizeof(header));
+    const unsigned char *arg = record + sizeof(header);
+    const unsigned char *end = record + header.size;
+    out.clear();
+    LogSpec spec;
+    const char *p = header.format;
+    const char *literal = p;
+    while (nextSpec(p, spec))
+    {
+       out.append(literal, spec.begin - literal);
+       literal = spec.end;
+       if (spec.conversion == '%')
+       {
+          out += '%';
+          continue;
+       }
+       if (arg >= end)
+          continue; // truncated record
+       // rebuild the conversion with the star values in place and the length of the stored value
+       char conversion[64];
+       int n = 1;
+       conversion[0] = '%';
+       if (spec.flagsLength + spec.widthLength + spec.precisionLength < 40)
+       {
+          memcpy(conversion+n, spec.flags, spec.flagsLength);
+          n += spec.flagsLength;
+          memcpy(conversion+n, spec.width, spec.widthLength);
+          n += spec.widthLength;
+       }
+       int64_t value;
+       if (spec.widthStar)
+       {
+          memcpy(&value, arg, 8);
+          arg += 8;
+          n += snprintf(conversion+n, 24, "%lld", (long long) value);
+       }
+       long long precision = -1;
+       if (spec.precisionStar)
+       {
+          memcpy(&value, arg, 8);
+          arg += 8;
+          precision = value;
+          if ((precision >= 0) && (spec.conversion != 's'))
+             n += snprintf(conversion+n, 24, ".%lld", precision);
+       }
+       else if (spec.precisionLength > 0)
+       {
+          precision = atoll(spec.precision+1);
+          if ((spec.conversion != 's') && (spec.precisionLength < 20))
+          {
+             memcpy(conversion+n, spec.precision, spec.precisionLength);
+             n += spec.precisionLength;
+          }
+       }
+       switch (spec.conversion)
+       {
+          case 'd': case 'i': case 'c':
+             memcpy(&value, arg, 8);
+             arg += 8;
+             if (spec.conversion == 'c')
+             {
+                strcpy(conversion+n, "c");
+                appendFormatted(out, conversion, (int) value);
+             }
+             else
+             {
+                setLength(conversion+n, "ll", spec.conversion);
+                appendFormatted(out, conversion, (long long) value);
+             }
+             break;
+          case 'u': case 'o': case 'x': case 'X':
+          {
+             uint64_t u;
+             memcpy(&u, arg, 8);
+             arg += 8;
+             setLength(conversion+n, "ll", spec.conversion);
+             appendFormatted(out, conversion, (unsigned long long) u);
+             break;
+          }
+          case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+             if (isLength(spec, "L"))
+             {
+                long double ld;
+                memcpy(&ld, arg, sizeof(ld));
+                arg += (sizeof(ld)+7) & ~7;
+                setLength(conversion+n, "L", spec.conversion);
+                appendFormatted(out, conversion, ld);
+             }
+             else
+             {
+                double d;
+                memcpy(&d, arg, 8);
+                arg += 8;
+                setLength(conversion+n, "", spec.conversion);
+                appendFormatted(out, conversion, d);
+             }
+             break;
+          case 'p':
+          {
+             void *ptr;
+             memcpy(&ptr, arg, sizeof(ptr));
+             arg += 8;
+             strcpy(conversion+n, "p");
+             appendFormatted(out, conversion, ptr);
+             break;
+          }
+          case 's':
+          {
+             // the stored string has no terminating zero, its length goes in as the precision
+             uint32_t len;
+             memcpy(&len, arg, 4);
+             const char *text = (const char *) arg+4;
+             arg += (4 + len + 7) & ~7;
+             if ((precision >= 0) && (precision < len))
+                len = precision;
+             if (n == 1)
+                out.append(text, len);
+             else
+             {
+                strcpy(conversion+n, ".*s");
+                appendFormatted(out, conversion, (int) len, text);
+             }
+             break;
+          }
+          default:
+             break;
+       }
+    }
+    out.append(literal);
+    return header.size;
+}
+
+LogRing::LogRing() : head(0), tail(0), owned(1)
+{
+    bytes = new unsigned char[logRingBytes];
+}
+
+LogRing::~LogRing()
+{
+    delete [] bytes;
+}
+
+// gives the ring back when the thread ends (pipeline threads come and go with the series)
+struct ThreadRing
+{
+    LogRing *ring;
+    ThreadRing() : ring(NULL) {};
+    ~ThreadRing() { if (ring != NULL) asyncLog.release(ring); };
+};
+
+static thread_local ThreadRing threadRing;
+
+AsyncLog::AsyncLog() : running(0), stalls(0)
+{
+}
+
+AsyncLog::~AsyncLog()
+{
+    if (running)
+    {
+       {
+          std::lock_guard<std::mutex> guard(writeMutex);
+          running = 0;
+       }
+       wake.notify_one();
+       writer.join();
+    }
+}
+
+LogRing *AsyncLog::local()
+{
+    if (threadRing.ring != NULL)
+       return threadRing.ring;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    if (!running)
+    {
+       running = 1;
+       writer = std::thread(&AsyncLog::writerLoop, this);
+    }
+    for (int r = 0; r < rings.size(); r++)
+    {
+       LogRing *ring = rings[r];
+       if ((!ring->owned) && (ring->head == ring->tail))
+       {
+          ring->owned = 1;
+          threadRing.ring = ring;
+          return ring;
+       }
+    }
+    threadRing.ring = new LogRing();
+    rings.push_back(threadRing.ring);
+    return threadRing.ring;
+}
+
+void AsyncLog::record(LogObject *log, int inScreen, const char *format, va_list args)
+{
+    LogRing *ring = local();
+    size_t h = ring->head.load(std::memory_order_relaxed);
+    size_t offset = h & (logRingBytes-1);
+    size_t contiguous = logRingBytes - offset;
+    size_t needed = (contiguous < logRecordBytes) ? contiguous + logRecordBytes : logRecordBytes;
+    if (logRingBytes - (h - ring->tail.load(std::memory_order_acquire)) < needed)
+    {
+       // full, the writer has fallen behind by a whole ring: write it out here
+       stalls++;
+       std::lock_guard<std::mutex> guard(writeMutex);
+       drainLocked();
+    }
+    LogHeader header;
+    if (contiguous < logRecordBytes)
+    {
+       // a record never wraps, the rest of the ring is skipped
+       header.size = contiguous;
+       header.inScreen = -1;
+       memcpy(ring->bytes + offset, &header, 8);
+       h += contiguous;
+       offset = 0;
+    }
+    unsigned char *out = ring->bytes + offset;
+    clock_gettime(CLOCK_REALTIME, &header.time);
+    header.inScreen = inScreen;
+    header.log = log;
+    header.format = format;
+    header.size = sizeof(header) + encodeArguments(out + sizeof(header), logRecordBytes - sizeof(header), format, args);
+    header.size = (header.size + 7) & ~7;
+    memcpy(out, &header, sizeof(header));
+    ring->head.store(h + header.size, std::memory_order_release);
+    // the writer wakes up on its own every few ms, a burst that fills half the ring calls it once
+    size_t t = ring->tail.load(std::memory_order_relaxed);
+    if ((h - t <= logRingBytes/2) && (h + header.size - t > logRingBytes/2))
+       wake.notify_one();
+}
+
+void AsyncLog::drainLocked()
+{
+    vector<LogRing *> pending;
+    {
+       std::lock_guard<std::mutex> lock(ringsMutex);
+       pending = rings;
+    }
+    vector<size_t> heads(pending.size());
+    for (int r = 0; r < pending.size(); r++)
+       heads[r] = pending[r]->head.load(std::memory_order_acquire);
+    time_t lastSecond = -1;
+    char timestamp[100];
+    vector<LogObject *> written; // flushed once the pass is over
+    while (1)
+    {
+       // the oldest record first, the threads interleave as they logged
+       int oldest = -1;
+       struct timespec oldestTime;
+       for (int r = 0; r < pending.size(); r++)
+       {
+          LogRing *ring = pending[r];
+          size_t t = ring->tail.load(std::memory_order_relaxed);
+          LogHeader header;
+          while (t < heads[r])
+          {
+             memcpy(&header, ring->bytes + (t & (logRingBytes-1)), 8);
+             if (header.inScreen != -1)
+                break;
+             t += header.size;
+             ring->tail.store(t, std::memory_order_release);
+          }
+          if (t == heads[r])
+             continue;
+          memcpy(&header, ring->bytes + (t & (logRingBytes-1)), sizeof(header));
+          if ((oldest < 0) || (header.time.tv_sec < oldestTime.tv_sec) ||
+              ((header.time.tv_sec == oldestTime.tv_sec) && (header.time.tv_nsec < oldestTime.tv_nsec)))
+          {
+             oldest = r;
+             oldestTime = header.time;
+          }
+       }
+       if (oldest < 0)
+          break;
+       LogRing *ring = pending[oldest];
+       size_t t = ring->tail.load(std::memory_order_relaxed);
+       const unsigned char *record = ring->bytes + (t & (logRingBytes-1));
+       LogHeader header;
+       memcpy(&header, record, sizeof(header));
+       if (header.time.tv_sec != lastSecond)
+       {
+          struct tm timeinfo;
+          lastSecond = header.time.tv_sec;
+          localtime_r(&lastSecond, &timeinfo);
+          strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S : ", &timeinfo);
+       }
+       format(record, text);
+       header.log->output(timestamp, text, header.inScreen);
+       ring->tail.store(t + header.size, std::memory_order_release);
+       if (std::find(written.begin(), written.end(), header.log) == written.end())
+          written.push_back(header.log);
+    }
+    // a log is only closed or destroyed with writeMutex held, the pointers are still good
+    for (int w = 0; w < written.size(); w++)
+       written[w]->flushOutput();
+}
+
+void AsyncLog::writerLoop()
+{
+    std::unique_lock<std::mutex> lock(writeMutex);
+    while (running)
+    {
+       wake.wait_for(lock, std::chrono::milliseconds(logFlushInterval));
+       drainLocked();
+    }
+    drainLocked();
+}
+
+const char *logCtime(time_t t)
+{
+    static thread_local time_t last = -1;
+    static thread_local char text[32];
+    if (t != last)
+    {
+       ctime_r(&t, text);
+       last = t;
+    }
+    return text;
+}
@@ -0,0 +1,81 @@
+//
+//  asyncLog.h
+//
+//  Binary log ring behind LogObject::writeLog. The calling thread only
+//  stores the clock, the format pointer (always a string literal) and the
+//  raw printf arguments, strings copied, in its own single producer ring;
+//  a background thread formats the records, writes them to the log files
+//  and stderr and flushes the files it wrote. Opening and closing a log
+//  first drains the rings, so the files keep the order of the calls;
+//  flushing one only wakes the writer.
+//
+
+#ifndef asyncLog_h
+#define asyncLog_h
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <stdarg.h>
+#include <time.h>
+
+using namespace std;
+
+#define logRingBytes (1024*1024) // per thread, power of two
+#define logRecordBytes (64*1024) // largest record, longer strings are truncated
+
+class LogObject;
+
+class LogRing
+{
+public:
+    unsigned char *bytes;
+    std::atomic<size_t> head;  // next free byte, owner thread only
+    std::atomic<size_t> tail;  // first record not written yet, log writer only
+    std::atomic<int> owned;    // its thread is still running
+    LogRing();
+    ~LogRing();
+};
+
+class AsyncLog
+{
+    std::mutex ringsMutex;     // rings live until exit, reused once their thread ended and they were written
+    vector<LogRing *> rings;
+    std::mutex writeMutex;     // held while records are formatted and written
+    std::condition_variable wake;
+    std::thread writer;
+    int running;
+    string text;
+    LogRing *local();
+    void writerLoop();
+    size_t format(const unsigned char *record, string &out);
+public:
+    std::atomic<unsigned long> stalls; // records that waited for a full ring to be written
+    void release(LogRing *ring) { ring->owned = 0; };
+    void record(LogObject *log, int inScreen, const char *format, va_list args);
+    // the pending records reach the files without waiting for the next pass, the caller does not wait
+    void flush() { wake.notify_one(); };
+    // formats and writes every pending record, writeMutex must be held
+    void drainLocked();
+    std::mutex &lock() { return writeMutex; };
+    AsyncLog();
+    ~AsyncLog();
+};
+
+extern AsyncLog asyncLog;
+
+// holds the log writer with every record written so far in the files
+class LogSync
+{
+    std::lock_guard<std::mutex> guard;
+public:
+    LogSync() : guard(asyncLog.lock()) { asyncLog.drainLocked(); };
+};
+
+// ctime() of the calling thread, only recomputed when the second changes
+const char *logCtime(time_t t);
+
+#endif /* asyncLog_h */
@@ -6,16 +6,41 @@
 #  Created by Rede Dor on 05/09/18.
 #  
 
-g++ -std=c++0x -w -O3 -DHAVE_ARPA_INET_H -DUSE_JPEGLS=ON -DmyDisableOpenJPEG \
-     main.cpp sftp.cpp \
-     memoryDCM.cpp \
+# everything but main.cpp, shared with the benchmarks that link the converter
+CONVERTER="sftp.cpp \
+     memoryDCM.cpp niftiSeries.cpp niftiWriter.cpp \
+     volumePublisher.cpp volumeRing.cpp streamServer.cpp \
+     sliceStore.cpp storeSCP.cpp dicomNet.cpp pushReceiver.cpp seriesManager.cpp pollScheduler.cpp \
+     slicePipeline.cpp metrics.cpp latencyTrace.cpp traceEvents.cpp asyncLog.cpp deadlineMonitor.cpp metricsServer.cpp \
      ../dcm2niix/console/ujpeg.cpp \
      ../dcm2niix/console/nii_dicom.cpp \
      ../dcm2niix/console/nii_dicom_batch.cpp \
      ../dcm2niix/console/nii_ortho.cpp \
      ../dcm2niix/console/nii_foreign.cpp \
      ../dcm2niix/console/nifti1_io_core.cpp \
-     ../dcm2niix/console/jpg_0XC3.cpp \
-     -lssh2 -lssl -lz -lcrypto -o dicomFTP \
+     ../dcm2niix/console/jpg_0XC3.cpp"
+
+g++ -std=c++0x -w -O3 -DHAVE_ARPA_INET_H -DUSE_JPEGLS=ON -DmyDisableOpenJPEG \
+     main.cpp $CONVERTER \
+     -lssh2 -lssl -lz -lcrypto -lrt -pthread -o dicomFTP \
      -I../dcm2niix/console \
 
+# C-STORE sender replaying a recorded series into -scp
+g++ -std=c++0x -w -O3 storeSCU.cpp dicomNet.cpp -o storeSCU
+
+# runs on the console, streams new slices to dicomFTP -push
+g++ -std=c++0x -w -O3 pushAgent.cpp dicomNet.cpp -o pushAgent
+
+# replays a recorded series with scanner timing, the load generator for latency tests
+g++ -std=c++0x -w -O3 scannerReplay.cpp dicomNet.cpp -o scannerReplay
+
+# sweeps dicomFTP against scannerReplay, per volume latency and CPU as JSON
+g++ -std=c++0x -w -O3 latencyBench.cpp -o latencyBench
+
+# per function timings of the slice parser and pixel paths
+g++ -std=c++0x -w -O3 -DHAVE_ARPA_INET_H -DUSE_JPEGLS=ON -DmyDisableOpenJPEG \
+     parserBench.cpp $CONVERTER \
+     -lssh2 -lssl -lz -lcrypto -lrt -pthread -o parserBench \
+     -I../dcm2niix/console
+# synthetic GE series for load tests and benchmarks, -verify checks a converted volume
+g++ -std=c++0x -w -O3 dicomSynth.cpp -o dicomSynth
@@ -14,11 +14,11 @@ def sortFiles(fileList):
     for filename in fileList:
         tokens = filename.split('.');   
         if 'MRDC' in filename:
-           sortedFileList[int(tokens[-1])] = filename;
+           index = (0, int(tokens[-1]));
         else:
            # Flyview mode
-           index = '%s%.3d' % (tokens[-3], int(tokens[-2]));
-           auxDict[index] = filename;
+           index = (int(tokens[-3]), int(tokens[-2]));
+        auxDict[index] = filename;
     
     keys = list(auxDict.keys());
     sortedkeys = sorted(keys);
@@ -38,9 +38,14 @@ def copyFiles(fileList, dirInput, dirOutput):
        copyfile(filein, fileout);
        sleep(TR/nSlices);
 
+# copySlices.py dirInput dirOutput [TR] [nSlices], scannerReplay has the timing options
 if len(sys.argv) > 2:
    dirInput = sys.argv[1];
    dirOutput = sys.argv[2];
+   if len(sys.argv) > 3:
+      TR = float(sys.argv[3]);
+   if len(sys.argv) > 4:
+      nSlices = float(sys.argv[4]);
    fileList = os.listdir(dirInput);
    sortedFileList = sortFiles(fileList);
    copyFiles(sortedFileList, dirInput, dirOutput); 
@@ -0,0 +1,130 @@
+//
+//  deadlineMonitor.cpp
+//
+//  Latency budget of the series, checked for every volume.
+//
+
+#include "deadlineMonitor.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const char *deadlineStageName(DeadlineStage stage)
+{
+    switch (stage)
+    {
+       case deadlineFetch: return "fetch";
+       case deadlineParse: return "parse";
+       case deadlineAssemble: return "assemble";
+       case deadlineWait: return "wait";
+       case deadlineWrite: return "write";
+       default: return "?";
+    }
+}
+
+DeadlineMonitor::~DeadlineMonitor()
+{
+    if (sock >= 0)
+       close(sock);
+}
+
+void DeadlineMonitor::reset()
+{
+    budget = 0;
+    memset(window, 0, sizeof(window));
+    windowNext = windowFill = windowMisses = 0;
+    lateInARow = 0;
+    volumes = misses = 0;
+}
+
+void DeadlineMonitor::start(double tr)
+{
+    reset();
+    budget = ((fraction > 0) && (tr > 0)) ? fraction*tr : 0;
+}
+
+void DeadlineMonitor::send(const char *message)
+{
+    if (alertPath.size() == 0)
+       return;
+    if (sock < 0)
+       sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, alertPath.c_str(), sizeof(addr.sun_path)-1);
+    // nobody listening is not an error, the alert is in the series log as well
+    sendto(sock, message, strlen(message), MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+string DeadlineMonitor::volume(int series, int volumeIndex, double listed, double fetched, double parsed,
+                               double assembled, double writeStart, double published)
+{
+    if ((budget <= 0) || (listed <= 0))
+       return "";
+    double latency = published-listed;
+    int late = (latency > budget);
+    volumes++;
+    misses += late;
+    if (windowFill == deadlineWindow)
+       windowMisses -= window[windowNext];
+    else windowFill++;
+    window[windowNext] = late;
+    windowMisses += late;
+    windowNext = (windowNext+1) % deadlineWindow;
+
+    char line[1024], message[1024];
+    if (!late)
+    {
+       if (lateInARow == 0)
+          return "";
+       snprintf(line, sizeof(line), "Deadline met again by volume %d: %2.3f ms of %2.3f ms, after %d late volumes\n",
+                volumeIndex, latency*1000, budget*1000, lateInARow);
+       snprintf(message, sizeof(message), "{\"event\":\"deadline_recovered\",\"series\":%d,\"volume\":%d,\"latency_ms\":%.3f,\"budget_ms\":%.3f,"
+                "\"late_in_a_row\":%d,\"window_misses\":%d,\"window\":%d,\"series_misses\":%lu,\"series_volumes\":%lu}\n",
+                series, volumeIndex, latency*1000, budget*1000, lateInARow, windowMisses, windowFill, misses, volumes);
+       lateInARow = 0;
+       send(message);
+       return line;
+    }
+    lateInARow++;
+
+    // the checkpoints only move forward, each stage ends where the next one starts
+    double marks[deadlineStages+1] = { listed, fetched, parsed, assembled, writeStart, published };
+    double stages[deadlineStages];
+    int slowest = 0;
+    for (int s = 0; s < deadlineStages; s++)
+    {
+       if (marks[s+1] < marks[s])
+          marks[s+1] = marks[s];
+       stages[s] = (marks[s+1]-marks[s])*1000;
+       if (stages[s] > stages[slowest])
+          slowest = s;
+    }
+    int n = snprintf(line, sizeof(line), "Deadline missed by volume %d: %2.3f ms for a budget of %2.3f ms (", volumeIndex, latency*1000, budget*1000);
+    int m = snprintf(message, sizeof(message), "{\"event\":\"deadline_miss\",\"series\":%d,\"volume\":%d,\"latency_ms\":%.3f,\"budget_ms\":%.3f,\"over_ms\":%.3f,\"stages_ms\":{",
+                     series, volumeIndex, latency*1000, budget*1000, (latency-budget)*1000);
+    for (int s = 0; s < deadlineStages; s++)
+    {
+       n += snprintf(line+n, sizeof(line)-n, "%s%s %2.3f", (s > 0) ? ", " : "", deadlineStageName((DeadlineStage)s), stages[s]);
+       m += snprintf(message+m, sizeof(message)-m, "%s\"%s\":%.3f", (s > 0) ? "," : "", deadlineStageName((DeadlineStage)s), stages[s]);
+    }
+    snprintf(line+n, sizeof(line)-n, " ms, slowest %s), %d of the last %d volumes late, %lu of %lu in the series\n",
+             deadlineStageName((DeadlineStage)slowest), windowMisses, windowFill, misses, volumes);
+    snprintf(message+m, sizeof(message)-m, "},\"slowest\":\"%s\",\"late_in_a_row\":%d,\"window_misses\":%d,\"window\":%d,\"series_misses\":%lu,\"series_volumes\":%lu}\n",
+             deadlineStageName((DeadlineStage)slowest), lateInARow, windowMisses, windowFill, misses, volumes);
+    send(message);
+    return line;
+}
+
+string DeadlineMonitor::summary()
+{
+    if (budget <= 0)
+       return "";
+    char line[256];
+    snprintf(line, sizeof(line), "Deadline %2.3f ms: %lu of %lu volumes late, %d of the last %d\n",
+             budget*1000, misses, volumes, windowMisses, windowFill);
+    return line;
+}
@@ -0,0 +1,59 @@
+//
+//  deadlineMonitor.h
+//
+//  Latency budget of the series, a fraction of the TR, checked for every
+//  volume from the listing of its last slice to its publication. A late
+//  volume raises an alert with the time taken by each stage and the misses
+//  over the last volumes, in the series log and as a JSON datagram on a
+//  UNIX socket; the first volume back within the budget clears it.
+//
+
+#ifndef deadlineMonitor_h
+#define deadlineMonitor_h
+
+#include <string>
+
+using namespace std;
+
+#define deadlineWindow 20 // volumes in the rolling miss count
+
+enum DeadlineStage
+{
+    deadlineFetch,     // listed -> fetched
+    deadlineParse,     // fetched -> parsed
+    deadlineAssemble,  // parsed -> in its place in the volume
+    deadlineWait,      // assembled -> volume write started (slabs, the rest of the pass)
+    deadlineWrite,     // write started -> published
+    deadlineStages
+};
+
+class DeadlineMonitor
+{
+    int sock;
+    double budget; // seconds, 0 while the TR is not known
+    unsigned char window[deadlineWindow]; // 1 for the late volumes
+    int windowNext, windowFill, windowMisses;
+    int lateInARow;
+    void send(const char *message);
+public:
+    double fraction;  // of the TR, 0 disables the monitor
+    string alertPath; // UNIX datagram socket of the operator console, empty for the log only
+    unsigned long volumes, misses;
+
+    // budget of a series with this TR (seconds), the counts start over
+    void start(double tr);
+    void reset();
+    double budgetMs() { return budget*1000; };
+    // checks the volume (MonoTime of its last slice at each stage), returns the alert
+    // for the series log, empty if nothing changed
+    string volume(int series, int volumeIndex, double listed, double fetched, double parsed,
+                  double assembled, double writeStart, double published);
+    // budget and misses of the series, for the metrics report
+    string summary();
+    DeadlineMonitor() : sock(-1), budget(0), fraction(1.0) { reset(); };
+    ~DeadlineMonitor();
+};
+
+const char *deadlineStageName(DeadlineStage stage);
+
+#endif /* deadlineMonitor_h */
@@ -0,0 +1,302 @@
+//
+//  dicomNet.cpp
+//
+//  Minimal DICOM upper layer (PS3.8) and data element helpers shared by the
+//  C-STORE receiver and the bundled sender.
+//
+
+#include "dicomNet.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int readFully(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+       ssize_t n = read(fd, (char *)buf + done, len - done);
+       if (n < 0)
+       {
+          if (errno == EINTR) continue;
+          return -1;
+       }
+       if (n == 0)
+          return -1;
+       done += n;
+    }
+    return 0;
+}
+
+int writeFully(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+       ssize_t n = write(fd, (const char *)buf + done, len - done);
+       if (n < 0)
+       {
+          if (errno == EINTR) continue;
+          return -1;
+       }
+       done += n;
+    }
+    return 0;
+}
+
+int sendFully(int sock, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+       ssize_t n = send(sock, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+       if (n < 0)
+       {
+          if (errno == EINTR) continue;
+          return -1;
+       }
+       done += n;
+    }
+    return 0;
+}
+
+void putBE16(string &out, uint16_t v)
+{
+    out += (char)(v >> 8);
+    out += (char)(v & 0xFF);
+}
+
+void putBE32(string &out, uint32_t v)
+{
+    putBE16(out, v >> 16);
+    putBE16(out, v & 0xFFFF);
+}
+
+uint16_t getBE16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t getBE32(const unsigned char *p)
+{
+    return ((uint32_t)getBE16(p) << 16) | getBE16(p+2);
+}
+
+static void putLE16(string &out, uint16_t v)
+{
+    out += (char)(v & 0xFF);
+    out += (char)(v >> 8);
+}
+
+static void putLE32(string &out, uint32_t v)
+{
+    putLE16(out, v & 0xFFFF);
+    putLE16(out, v >> 16);
+}
+
+static uint16_t getLE16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t getLE32(const unsigned char *p)
+{
+    return getLE16(p) | ((uint32_t)getLE16(p+2) << 16);
+}
+
+int readPDU(int fd, unsigned char &type, string &body, size_t maxBody)
+{
+    unsigned char header[6];
+    if (readFully(fd, header, 6) != 0)
+       return -1;
+    type = header[0];
+    uint32_t len = getBE32(&header[2]);
+    if (len > maxBody)
+       return -2;
+    body.resize(len);
+    if ((len > 0) && (readFully(fd, &body[0], len) != 0))
+       return -1;
+    return 0;
+}
+
+int writePDU(int fd, unsigned char type, const string &body)
+{
+    string pdu;
+    pdu += (char)type;
+    pdu += (char)0;
+    putBE32(pdu, body.size());
+    pdu += body;
+    return sendFully(fd, pdu.data(), pdu.size());
+}
+
+static bool isLongVR(const char *vr)
+{
+    static const char *longVR[] = {"OB", "OW", "OF", "SQ", "UT", "UN", "OD", "OL", "UC", "UR", "OV", "SV", "UV"};
+    for (int i = 0; i < 13; i++)
+       if ((vr[0] == longVR[i][0]) && (vr[1] == longVR[i][1]))
+          return true;
+    return false;
+}
+
+void putElement(string &out, uint32_t tag, const char *vr, const string &value, bool explicitVR)
+{
+    string v = value;
+    if (v.size() & 1)
+       v += ((vr[0] == 'U') && (vr[1] == 'I')) ? '\0' : ' ';
+    putLE16(out, tag >> 16);
+    putLE16(out, tag & 0xFFFF);
+    if (!explicitVR)
+       putLE32(out, v.size());
+    else if (isLongVR(vr))
+    {
+       out += vr[0];
+       out += vr[1];
+       putLE16(out, 0);
+       putLE32(out, v.size());
+    }
+    else
+    {
+       out += vr[0];
+       out += vr[1];
+       putLE16(out, v.size());
+    }
+    out += v;
+}
+
+void putElementUS(string &out, uint32_t tag, uint16_t value, bool explicitVR)
+{
+    string v;
+    putLE16(v, value);
+    putElement(out, tag, "US", v, explicitVR);
+}
+
+void putElementUL(string &out, uint32_t tag, uint32_t value, bool explicitVR)
+{
+    string v;
+    putLE32(v, value);
+    putElement(out, tag, "UL", v, explicitVR);
+}
+
+static int findElementRaw(const unsigned char *data, size_t len, bool explicitVR, uint32_t tag, string &value)
+{
+    size_t pos = 0;
+    int depth = 0; // inside undefined length sequences
+    while (pos + 8 <= len)
+    {
+       uint16_t group = getLE16(&data[pos]);
+       uint16_t element = getLE16(&data[pos+2]);
+       uint32_t current = dcmTag(group, element);
+       uint32_t vlen;
+       if (group == 0xFFFE)
+       {
+          // item and delimiters never carry a VR
+          vlen = getLE32(&data[pos+4]);
+          pos += 8;
+          if (element == 0xE0DD)
+             depth--;
+          else if ((element == 0xE000) && (vlen != 0xFFFFFFFF))
+             pos += vlen; // item of known size, nothing at depth 0 inside
+          continue;
+       }
+       if (explicitVR)
+       {
+          char vr[3] = {(char)data[pos+4], (char)data[pos+5], 0};
+          if (isLongVR(vr))
+          {
+             if (pos + 12 > len) break;
+             vlen = getLE32(&data[pos+8]);
+             pos += 12;
+          }
+          else
+          {
+             vlen = getLE16(&data[pos+6]);
+             pos += 8;
+          }
+       }
+       else
+       {
+          vlen = getLE32(&data[pos+4]);
+          pos += 8;
+       }
+
+       if (vlen == 0xFFFFFFFF)
+       {
+          // undefined length sequence (or encapsulated pixel data), walk into it
+          depth++;
+          continue;
+       }
+       if ((depth == 0) && (current == tag))
+       {
+          if (pos + vlen > len) return 1;
+          value.assign((const char *)&data[pos], vlen);
+          return 0;
+       }
+       if ((depth == 0) && (current > tag) && (group != 0x0002))
+          return 1; // elements are sorted
+       pos += vlen;
+    }
+    return 1;
+}
+
+int findElement(const unsigned char *data, size_t len, bool explicitVR, uint32_t tag, string &value)
+{
+    if (findElementRaw(data, len, explicitVR, tag, value) != 0)
+       return 1;
+    while ((value.size() > 0) && ((value[value.size()-1] == ' ') || (value[value.size()-1] == '\0')))
+       value.erase(value.size()-1);
+    return 0;
+}
+
+int findElementUS(const unsigned char *data, size_t len, bool explicitVR, uint32_t tag, uint16_t &value)
+{
+    string v;
+    if ((findElementRaw(data, len, explicitVR, tag, v) != 0) || (v.size() < 2))
+       return 1;
+    value = getLE16((const unsigned char *)v.data());
+    return 0;
+}
+
+void buildPart10(const string &sopClass, const string &sopInstance, const string &transferSyntax, const string &dataset, string &file)
+{
+    string meta;
+    putElement(meta, dcmTag(0x0002, 0x0001), "OB", string("\0\1", 2), true);
+    putElement(meta, dcmTag(0x0002, 0x0002), "UI", sopClass, true);
+    putElement(meta, dcmTag(0x0002, 0x0003), "UI", sopInstance, true);
+    putElement(meta, dcmTag(0x0002, 0x0010), "UI", transferSyntax, true);
+    putElement(meta, dcmTag(0x0002, 0x0012), "UI", implementationUID, true);
+
+    file.reserve(132 + 12 + meta.size() + dataset.size());
+    file.assign(128, '\0');
+    file += "DICM";
+    putElementUL(file, dcmTag(0x0002, 0x0000), meta.size(), true);
+    file += meta;
+    file += dataset;
+}
+
+int splitPart10(const string &file, string &sopClass, string &sopInstance, string &transferSyntax, size_t &datasetStart)
+{
+    if ((file.size() < 144) || (file.compare(128, 4, "DICM") != 0))
+       return 1;
+    const unsigned char *data = (const unsigned char *)file.data();
+    string groupLength;
+    if ((findElementRaw(&data[132], file.size()-132, true, dcmTag(0x0002, 0x0000), groupLength) != 0) || (groupLength.size() != 4))
+       return 2;
+    size_t metaEnd = 132 + 12 + getLE32((const unsigned char *)groupLength.data());
+    if (metaEnd > file.size())
+       return 3;
+    findElement(&data[132], metaEnd-132, true, dcmTag(0x0002, 0x0002), sopClass);
+    findElement(&data[132], metaEnd-132, true, dcmTag(0x0002, 0x0003), sopInstance);
+    if (findElement(&data[132], metaEnd-132, true, dcmTag(0x0002, 0x0010), transferSyntax) != 0)
+       return 4;
+    datasetStart = metaEnd;
+    return 0;
+}
+
+void putPDV(string &body, unsigned char contextID, bool isCommand, bool isLast, const char *data, size_t len)
+{
+    putBE32(body, len + 2);
+    body += (char)contextID;
+    body += (char)((isCommand ? 1 : 0) | (isLast ? 2 : 0));
+    body.append(data, len);
+}
@@ -0,0 +1,73 @@
+//
+//  dicomNet.h
+//
+//  Minimal DICOM upper layer (PS3.8) and data element helpers shared by the
+//  C-STORE receiver and the bundled sender. Only little-endian transfer
+//  syntaxes are handled, which is what the scanner's real-time export uses.
+//
+
+#ifndef dicomNet_h
+#define dicomNet_h
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+#define pduAssociateRQ 0x01
+#define pduAssociateAC 0x02
+#define pduAssociateRJ 0x03
+#define pduData 0x04
+#define pduReleaseRQ 0x05
+#define pduReleaseRP 0x06
+#define pduAbort 0x07
+
+#define cStoreRQ 0x0001
+#define cStoreRSP 0x8001
+#define cEchoRQ 0x0030
+#define cEchoRSP 0x8030
+#define noDataSet 0x0101
+
+#define implicitLittleUID "1.2.840.10008.1.2"
+#define explicitLittleUID "1.2.840.10008.1.2.1"
+#define verificationUID "1.2.840.10008.1.1"
+#define applicationContextUID "1.2.840.10008.3.1.1.1"
+#define implementationUID "1.2.826.0.1.3680043.9.7261.1"
+#define maxPDULength (1024*1024)
+
+#define dcmTag(g, e) ((uint32_t)(g) << 16 | (uint32_t)(e))
+
+int readFully(int fd, void *buf, size_t len);
+int writeFully(int fd, const void *buf, size_t len);
+// writeFully for sockets, a peer that went away is an error instead of SIGPIPE
+int sendFully(int sock, const void *buf, size_t len);
+
+// one PDU: type and body without the 6 byte header
+int readPDU(int fd, unsigned char &type, string &body, size_t maxBody);
+int writePDU(int fd, unsigned char type, const string &body);
+
+// big-endian fields used by the upper layer
+void putBE16(string &out, uint16_t v);
+void putBE32(string &out, uint32_t v);
+uint16_t getBE16(const unsigned char *p);
+uint32_t getBE32(const unsigned char *p);
+
+// appends an element in little-endian, implicit or explicit VR, padding odd values
+void putElement(string &out, uint32_t tag, const char *vr, const string &value, bool explicitVR);
+void putElementUS(string &out, uint32_t tag, uint16_t value, bool explicitVR);
+void putElementUL(string &out, uint32_t tag, uint32_t value, bool explicitVR);
+
+// value of a top-level element (sequences are skipped), trailing padding removed
+int findElement(const unsigned char *data, size_t len, bool explicitVR, uint32_t tag, string &value);
+int findElementUS(const unsigned char *data, size_t len, bool explicitVR, uint32_t tag, uint16_t &value);
+
+// wraps a data set in a Part 10 file (preamble, DICM and group 0002) that readDICOMv accepts
+void buildPart10(const string &sopClass, const string &sopInstance, const string &transferSyntax, const string &dataset, string &file);
+
+// data set and meta information of a Part 10 file, 0 on success
+int splitPart10(const string &file, string &sopClass, string &sopInstance, string &transferSyntax, size_t &datasetStart);
+
+// PDV item of a P-DATA-TF PDU
+void putPDV(string &body, unsigned char contextID, bool isCommand, bool isLast, const char *data, size_t len);
+
+#endif /* dicomNet_h */
@@ -0,0 +1,473 @@
+//
+//  dicomSynth.cpp
+//
+//  Synthetic GE fMRI series for load tests and benchmarks, no patient data.
+//  Every slice is a single frame MR image in explicit little-endian (or RLE
+//  lossless) with the tags readDICOMv relies on: images and locations in
+//  acquisition, temporal positions, position and orientation, the RTIA timer
+//  and a GE UserDefineData block marking the series as EPI. Voxels follow a
+//  pattern of (x, y, slice, volume), so -verify can check a converted NIfTI.
+//  The header is built once per series and patched per slice, which keeps
+//  generation at memory speed; -live writes on the acquisition schedule and
+//  makes it a live source (each slice written above the series folder and
+//  renamed into place when complete).
+//
+//  dicomSynth [options] outputSeriesDir
+//     -matrix CxR       columns x rows (64x64)
+//     -slices n         slices per volume (36)
+//     -volumes n        (10)
+//     -tr s             repetition time (2.0)
+//     -voxel mm         in plane voxel size (3.0), -thickness mm slice thickness (3.5)
+//     -order seq|int    slice acquisition order, sequential or interleaved (seq)
+//     -series n         series number (1)
+//     -rle              RLE lossless pixel data (parser benchmarks, the converter copies raw pixels)
+//     -live             write each slice when the scanner would, -rate n slices per second instead
+//  dicomSynth -verify file.nii [volume]   checks the pattern, volume from vol_XXXXX.nii if not given
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define mrImageStorageUID "1.2.840.10008.5.1.4.1.1.4"
+#define explicitLittleUID "1.2.840.10008.1.2.1"
+#define rleLosslessUID "1.2.840.10008.1.2.5"
+#define synthUIDRoot "1.2.826.0.1.3680043.9.7261.2"
+#define userDefineBytes 1024
+#define uidField 64 // instance UIDs are padded to this length, so slices only patch bytes in place
+
+// voxel value of the pattern, 12 bits like a scanner magnitude image
+static inline uint16_t patternValue(int x, int y, int slice, int volume)
+{
+    return (uint16_t)((x*7 + y*13 + slice*31 + volume*17) & 0x0FFF);
+}
+
+static void put16(string &out, uint16_t v)
+{
+    out += (char)(v & 0xFF);
+    out += (char)(v >> 8);
+}
+
+static void put32(string &out, uint32_t v)
+{
+    put16(out, v & 0xFFFF);
+    put16(out, v >> 16);
+}
+
+static int longVR(const char *vr)
+{
+    return (!strcmp(vr, "OB")) || (!strcmp(vr, "OW")) || (!strcmp(vr, "UN")) || (!strcmp(vr, "SQ")) || (!strcmp(vr, "UT"));
+}
+
+// explicit VR little-endian element, values padded to even length as the standard asks
+static size_t putElement(string &out, uint16_t group, uint16_t element, const char *vr, const string &value)
+{
+    string v = value;
+    if (v.size() & 1)
+       v += ((!strcmp(vr, "UI")) || longVR(vr)) ? '\0' : ' ';
+    put16(out, group);
+    put16(out, element);
+    out += vr[0];
+    out += vr[1];
+    if (longVR(vr))
+    {
+       put16(out, 0);
+       put32(out, v.size());
+    }
+    else put16(out, v.size());
+    size_t at = out.size();
+    out += v;
+    return at;
+}
+
+static void putUS(string &out, uint16_t group, uint16_t element, uint16_t value)
+{
+    string v;
+    put16(v, value);
+    putElement(out, group, element, "US", v);
+}
+
+// fixed width text field, patched per slice
+static string field(const char *format, double value, int width)
+{
+    char text[64];
+    snprintf(text, sizeof(text), format, value);
+    string s = text;
+    s.resize(width, ' ');
+    return s;
+}
+
+// PackBits run length coding of one byte plane (PS3.5 Annex G)
+static void packBits(const unsigned char *p, size_t n, string &out)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+       size_t run = 1;
+       while ((i+run < n) && (run < 128) && (p[i+run] == p[i]))
+          run++;
+       if (run >= 2)
+       {
+          out += (char)(257-run);
+          out += (char)p[i];
+          i += run;
+          continue;
+       }
+       size_t literal = 1;
+       while ((i+literal < n) && (literal < 128) && !((i+literal+1 < n) && (p[i+literal] == p[i+literal+1])))
+          literal++;
+       out += (char)(literal-1);
+       out.append((const char *)p+i, literal);
+       i += literal;
+    }
+    if (out.size() & 1)
+       out += (char)0;
+}
+
+static string rleFrame(const vector<uint16_t> &pixels)
+{
+    vector<unsigned char> high(pixels.size()), low(pixels.size());
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+       high[i] = pixels[i] >> 8;
+       low[i] = pixels[i] & 0xFF;
+    }
+    string first, second;
+    packBits(&high[0], high.size(), first);
+    packBits(&low[0], low.size(), second);
+    string frame;
+    put32(frame, 2);
+    put32(frame, 64);
+    put32(frame, 64+first.size());
+    for (int i = 3; i < 16; i++)
+       put32(frame, 0);
+    return frame + first + second;
+}
+
+static int writeAll(int fd, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+       ssize_t w = write(fd, p, n);
+       if (w < 0)
+       {
+          if (errno == EINTR) continue;
+          return 1;
+       }
+       p += w;
+       n -= w;
+    }
+    return 0;
+}
+
+static double monoNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void sleepUntil(double when)
+{
+    struct timespec at;
+    at.tv_sec = (time_t)when;
+    at.tv_nsec = (long)((when - at.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+       ;
+}
+
+static int verify(const char *path, int volume)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+       fprintf(stderr, "Error opening %s\n", path);
+       return 2;
+    }
+    char hdr[348];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+    {
+       fclose(fp);
+       return 2;
+    }
+    short dim[8], datatype;
+    float voxOffset;
+    memcpy(dim, hdr+40, sizeof(dim));
+    memcpy(&datatype, hdr+70, sizeof(datatype));
+    memcpy(&voxOffset, hdr+108, sizeof(voxOffset));
+    if ((datatype != 4) && (datatype != 512))
+    {
+       fprintf(stderr, "%s is not 16 bit\n", path);
+       fclose(fp);
+       return 2;
+    }
+    int columns = dim[1], rows = dim[2], slices = dim[3];
+    int volumes = ((dim[0] > 3) && (dim[4] > 1)) ? dim[4] : 1;
+    if (volume <= 0)
+    {
+       const char *name = strstr(path, "vol_");
+       volume = (name != NULL) ? atoi(name+4) : 1;
+    }
+    fseek(fp, (long)voxOffset, SEEK_SET);
+    vector<uint16_t> voxels((size_t)columns*rows*slices);
+    long mismatches = 0, checked = 0;
+    for (int t = 0; t < volumes; t++)
+    {
+       if (fread(&voxels[0], sizeof(uint16_t), voxels.size(), fp) != voxels.size())
+          break;
+       size_t nonzero = 0;
+       while ((nonzero < voxels.size()) && (voxels[nonzero] == 0))
+          nonzero++;
+       if (nonzero == voxels.size())
+          break; // a mapped 4D file is preallocated, volumes after the last published one are empty
+       // the converter stores the last acquired location first
+       for (int z = 0; z < slices; z++)
+          for (int y = 0; y < rows; y++)
+             for (int x = 0; x < columns; x++)
+             {
+                uint16_t v = voxels[((size_t)z*rows + y)*columns + x];
+                if (v != patternValue(x, y, slices-1-z, volume+t))
+                   mismatches++;
+                checked++;
+             }
+    }
+    fclose(fp);
+    printf("%s: %ld voxels checked, %ld mismatches\n", path, checked, mismatches);
+    return (mismatches > 0) || (checked == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    int columns = 64, rows = 64, nSlices = 36, nVolumes = 10, seriesNumber = 1, interleaved = 0, rle = 0, live = 0;
+    double TR = 2.0, voxel = 3.0, thickness = 3.5, rate = 0;
+    string outputDir;
+    for (int a = 1; a < argc; a++)
+    {
+       if ((!strcmp(argv[a], "-verify")) && (a+1 < argc))
+          return verify(argv[a+1], (a+2 < argc) ? atoi(argv[a+2]) : 0);
+       else if ((!strcmp(argv[a], "-matrix")) && (a+1 < argc))
+          sscanf(argv[++a], "%dx%d", &columns, &rows);
+       else if ((!strcmp(argv[a], "-slices")) && (a+1 < argc))
+          nSlices = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-volumes")) && (a+1 < argc))
+          nVolumes = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-tr")) && (a+1 < argc))
+          TR = atof(argv[++a]);
+       else if ((!strcmp(argv[a], "-voxel")) && (a+1 < argc))
+          voxel = atof(argv[++a]);
+       else if ((!strcmp(argv[a], "-thickness")) && (a+1 < argc))
+          thickness = atof(argv[++a]);
+       else if ((!strcmp(argv[a], "-order")) && (a+1 < argc))
+          interleaved = !strcmp(argv[++a], "int");
+       else if ((!strcmp(argv[a], "-series")) && (a+1 < argc))
+          seriesNumber = atoi(argv[++a]);
+       else if (!strcmp(argv[a], "-rle"))
+          rle = 1;
+       else if (!strcmp(argv[a], "-live"))
+          live = 1;
+       else if ((!strcmp(argv[a], "-rate")) && (a+1 < argc))
+          rate = atof(argv[++a]);
+       else outputDir = argv[a];
+    }
+    if ((outputDir == "") || (columns < 1) || (rows < 1) || (nSlices < 1) || (nVolumes < 1) || (TR <= 0))
+    {
+       fprintf(stderr, "usage: %s [-matrix CxR] [-slices n] [-volumes n] [-tr s] [-voxel mm] [-thickness mm] [-order seq|int]\n"
+                       "       [-series n] [-rle] [-live | -rate n] outputSeriesDir\n"
+                       "       %s -verify file.nii [volume]\n", argv[0], argv[0]);
+       return 1;
+    }
+    mkdir(outputDir.c_str(), 0777);
+    // slices are written in the folder above the series and renamed in, so a converter
+    // polling the series folder never lists a partial file (same filesystem for the rename)
+    size_t end = outputDir.find_last_not_of('/');
+    size_t slash = (end == string::npos) ? string::npos : outputDir.rfind('/', end);
+    string stagingDir = (slash == string::npos) ? string(".") : (slash == 0) ? string("/") : outputDir.substr(0, slash);
+
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    char date[16];
+    strftime(date, sizeof(date), "%Y%m%d", &local);
+    double startOfDay = local.tm_hour*3600.0 + local.tm_min*60.0 + local.tm_sec;
+    char studyUID[64], seriesUID[64];
+    snprintf(studyUID, sizeof(studyUID), "%s.%ld", synthUIDRoot, (long)now);
+    snprintf(seriesUID, sizeof(seriesUID), "%s.%ld.%d", synthUIDRoot, (long)now, seriesNumber);
+    string instanceUID(uidField, '1');
+    string transferSyntax = rle ? rleLosslessUID : explicitLittleUID;
+
+    // slice position in the acquisition of a volume
+    vector<int> acquiredAs(nSlices);
+    int k = 0;
+    for (int s = 0; s < nSlices; s += (interleaved ? 2 : 1))
+       acquiredAs[s] = k++;
+    for (int s = 1; interleaved && (s < nSlices); s += 2)
+       acquiredAs[s] = k++;
+
+    string userDefine(userDefineBytes, '\0');
+    float version = 26.0f; // >= 25.002, the fields start 0x4c further
+    memcpy(&userDefine[0], &version, sizeof(version));
+    userDefine[0x4c + 0x3a + 1] = 0x08; // 0x800, EPI
+
+    // header of the series, per slice fields patched at the offsets kept here
+    string meta;
+    putElement(meta, 0x0002, 0x0001, "OB", string("\0\1", 2));
+    putElement(meta, 0x0002, 0x0002, "UI", mrImageStorageUID);
+    size_t metaInstance = putElement(meta, 0x0002, 0x0003, "UI", instanceUID);
+    putElement(meta, 0x0002, 0x0010, "UI", transferSyntax);
+    putElement(meta, 0x0002, 0x0012, "UI", "1.2.826.0.1.3680043.9.7261.1");
+    string header(128, '\0');
+    header += "DICM";
+    string groupLength;
+    put32(groupLength, meta.size());
+    putElement(header, 0x0002, 0x0000, "UL", groupLength);
+    metaInstance += header.size();
+    header += meta;
+
+    char number[64];
+    putElement(header, 0x0008, 0x0008, "CS", "ORIGINAL\\PRIMARY\\EPI\\NONE");
+    putElement(header, 0x0008, 0x0016, "UI", mrImageStorageUID);
+    size_t sopInstance = putElement(header, 0x0008, 0x0018, "UI", instanceUID);
+    putElement(header, 0x0008, 0x0020, "DA", date);
+    putElement(header, 0x0008, 0x0022, "DA", date);
+    putElement(header, 0x0008, 0x0030, "TM", field("%013.6f", 0, 14));
+    size_t acquisitionTime = putElement(header, 0x0008, 0x0032, "TM", field("%013.6f", 0, 14));
+    size_t contentTime = putElement(header, 0x0008, 0x0033, "TM", field("%013.6f", 0, 14));
+    putElement(header, 0x0008, 0x0060, "CS", "MR");
+    putElement(header, 0x0008, 0x0070, "LO", "GE MEDICAL SYSTEMS");
+    putElement(header, 0x0008, 0x103E, "LO", "synthetic fMRI");
+    putElement(header, 0x0010, 0x0010, "PN", "SYNTHETIC^PHANTOM");
+    putElement(header, 0x0010, 0x0020, "LO", "SYNTH0001");
+    putElement(header, 0x0018, 0x0020, "CS", "EP\\GR");
+    putElement(header, 0x0018, 0x0023, "CS", "2D");
+    snprintf(number, sizeof(number), "%g", thickness);
+    putElement(header, 0x0018, 0x0050, "DS", number);
+    snprintf(number, sizeof(number), "%g", TR*1000);
+    putElement(header, 0x0018, 0x0080, "DS", number);
+    putElement(header, 0x0018, 0x0081, "DS", "30");
+    snprintf(number, sizeof(number), "%g", thickness);
+    putElement(header, 0x0018, 0x0088, "DS", number);
+    putElement(header, 0x0018, 0x1030, "LO", "synthetic fMRI");
+    putElement(header, 0x0018, 0x1314, "DS", "77");
+    putElement(header, 0x0018, 0x5100, "CS", "HFS");
+    putElement(header, 0x0020, 0x000D, "UI", studyUID);
+    putElement(header, 0x0020, 0x000E, "UI", seriesUID);
+    snprintf(number, sizeof(number), "%d", seriesNumber);
+    putElement(header, 0x0020, 0x0011, "IS", number);
+    putElement(header, 0x0020, 0x0012, "IS", "1");
+    size_t instanceNumber = putElement(header, 0x0020, 0x0013, "IS", field("%.0f", 0, 8));
+    size_t position = putElement(header, 0x0020, 0x0032, "DS", field("%.0f", 0, 48));
+    putElement(header, 0x0020, 0x0037, "DS", "1\\0\\0\\0\\1\\0");
+    snprintf(number, sizeof(number), "%d", nVolumes);
+    putElement(header, 0x0020, 0x0105, "IS", number);
+    snprintf(number, sizeof(number), "%d", nSlices*nVolumes);
+    putElement(header, 0x0020, 0x1002, "IS", number);
+    size_t sliceLocation = putElement(header, 0x0020, 0x1041, "DS", field("%.0f", 0, 16));
+    putElement(header, 0x0021, 0x0010, "LO", "GEMS_RELA_01");
+    string locations;
+    put16(locations, nSlices);
+    putElement(header, 0x0021, 0x104F, "SS", locations);
+    size_t rtia = putElement(header, 0x0021, 0x105E, "DS", field("%.0f", 0, 16));
+    putUS(header, 0x0028, 0x0002, 1);
+    putElement(header, 0x0028, 0x0004, "CS", "MONOCHROME2");
+    putUS(header, 0x0028, 0x0010, rows);
+    putUS(header, 0x0028, 0x0011, columns);
+    snprintf(number, sizeof(number), "%g\\%g", voxel, voxel);
+    putElement(header, 0x0028, 0x0030, "DS", number);
+    putUS(header, 0x0028, 0x0100, 16);
+    putUS(header, 0x0028, 0x0101, 16);
+    putUS(header, 0x0028, 0x0102, 15);
+    putUS(header, 0x0028, 0x0103, 1);
+    putElement(header, 0x0043, 0x0010, "LO", "GEMS_PARM_01");
+    putElement(header, 0x0043, 0x102A, "OB", userDefine);
+
+    size_t pixelBytes = (size_t)columns*rows*2;
+    vector<uint16_t> pixels((size_t)columns*rows);
+    string slice;
+    double origin = monoNow() + 0.05;
+    double sliceTime = TR / nSlices;
+    for (int v = 0; v < nVolumes; v++)
+    {
+       for (int s = 0; s < nSlices; s++)
+       {
+          int index = v*nSlices + s; // file order, the converter reads them back in this order
+          double acquired = v*TR + acquiredAs[s]*sliceTime;
+          string h = header;
+          // last component 1 followed by the zero padded index, every instance UID has the same length
+          char uid[2*uidField];
+          snprintf(uid, sizeof(uid), "%s.1%0*d", seriesUID, (int)(uidField - strlen(seriesUID) - 2), index+1);
+          string u(uid);
+          h.replace(metaInstance, uidField, u);
+          h.replace(sopInstance, uidField, u);
+          double tod = startOfDay + acquired;
+          int hh = ((int)tod / 3600) % 24, mm = ((int)tod / 60) % 60;
+          double ss = tod - floor(tod/60)*60;
+          double hhmmss = hh*10000 + mm*100 + ss;
+          h.replace(acquisitionTime, 14, field("%013.6f", hhmmss, 14));
+          h.replace(contentTime, 14, field("%013.6f", hhmmss, 14));
+          h.replace(instanceNumber, 8, field("%.0f", index+1, 8));
+          char pos[64];
+          snprintf(pos, sizeof(pos), "%g\\%g\\%g", -voxel*columns/2, -voxel*rows/2, s*thickness - nSlices*thickness/2);
+          string p(pos);
+          p.resize(48, ' ');
+          h.replace(position, 48, p);
+          h.replace(sliceLocation, 16, field("%g", s*thickness - nSlices*thickness/2, 16));
+          h.replace(rtia, 16, field("%.0f", acquired*10000, 16)); // 0.1 ms units
+
+          for (int y = 0; y < rows; y++)
+             for (int x = 0; x < columns; x++)
+                pixels[(size_t)y*columns + x] = patternValue(x, y, s, v+1);
+          slice = h;
+          if (rle)
+          {
+             string frame = rleFrame(pixels);
+             put16(slice, 0x7FE0); put16(slice, 0x0010);
+             slice += "OB";
+             put16(slice, 0);
+             put32(slice, 0xFFFFFFFF);
+             put16(slice, 0xFFFE); put16(slice, 0xE000); put32(slice, 0); // empty offset table
+             put16(slice, 0xFFFE); put16(slice, 0xE000); put32(slice, frame.size());
+             slice += frame;
+             put16(slice, 0xFFFE); put16(slice, 0xE0DD); put32(slice, 0);
+          }
+          else
+          {
+             put16(slice, 0x7FE0); put16(slice, 0x0010);
+             slice += "OW";
+             put16(slice, 0);
+             put32(slice, pixelBytes);
+             slice.append((const char *)&pixels[0], pixelBytes);
+          }
+
+          if (live || (rate > 0))
+             sleepUntil(origin + ((rate > 0) ? index/rate : acquired + sliceTime));
+          char name[64];
+          snprintf(name, sizeof(name), "i%ld.MRDC.%d", (long)now, index+1);
+          string path = outputDir + "/" + name;
+          string tmp = stagingDir + "/." + name + ".tmp";
+          int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+          if ((fd < 0) || (writeAll(fd, slice.data(), slice.size()) != 0))
+          {
+             fprintf(stderr, "Error writing %s\n", tmp.c_str());
+             return 2;
+          }
+          close(fd);
+          if (rename(tmp.c_str(), path.c_str()) != 0)
+          {
+             fprintf(stderr, "Error renaming %s\n", tmp.c_str());
+             return 2;
+          }
+       }
+    }
+    return 0;
+}
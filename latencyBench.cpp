@@ -0,0 +1,487 @@
+//
+//  latencyBench.cpp
+//
+//  End to end latency benchmark: runs dicomFTP and scannerReplay on this
+//  machine for every combination of the sweep and writes the results as
+//  JSON. The latency of a volume goes from the write of its last slice
+//  (CLOCK_MONOTONIC, from the replay log) to the datagram dicomFTP sends on
+//  -notify when the volume is published, stamped on the same clock. CPU is
+//  the user + system time of the converter over the run. A converter that
+//  exits before it is stopped fails the run ("failed": true).
+//
+//  latencyBench [options] -input recordedSeriesDir:slicesPerVolume [-input ...]
+//     -tr list          repetition times in s (2.0), e.g. 0.5,1,2
+//     -ingest list      dir (mode 1, folder polling) and/or push (mode 4, -push) (dir)
+//     -output list      0 volume files, 1 appendable 4D, 2 mapped 4D (0)
+//     -volumes n        volumes replayed per run (all)
+//     -converter path   dicomFTP (./dicomFTP)
+//     -replay path      scannerReplay (./scannerReplay)
+//     -args "options"   more dicomFTP options, e.g. "-pipeline 4 -async"
+//     -replayargs "options" more scannerReplay options, e.g. "-burst 4 -jitter exp:5"
+//     -work dir         scratch folder, one subfolder per run (bench_work)
+//     -port n           first push port, one per run (17000)
+//     -out file         JSON results (latency_bench.json)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <dirent.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+struct BenchInput
+{
+    string dir;
+    int slices;
+};
+
+struct BenchRun
+{
+    BenchInput input;
+    double TR;
+    string ingest;
+    int output;
+    // results
+    int expected, published, matrix[3];
+    vector<double> latencyMs; // per volume, index 0 is volume 1, NAN if never published
+    double cpuSeconds, wallSeconds;
+    int converterExit; // -1 if the converter ran until stopped, else its wait status (the run failed)
+};
+
+static double monoNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static vector<string> splitList(const string &text, char separator)
+{
+    vector<string> items;
+    stringstream in(text);
+    string item;
+    while (getline(in, item, separator))
+       if (item.size() > 0)
+          items.push_back(item);
+    return items;
+}
+
+static string absolutePath(const string &path)
+{
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) == NULL)
+       return path;
+    return resolved;
+}
+
+static pid_t launch(const string &dir, const vector<string> &args)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+       if (chdir(dir.c_str()) != 0)
+          _exit(126);
+       int devnull = open("/dev/null", O_WRONLY);
+       dup2(devnull, 1);
+       dup2(devnull, 2);
+       vector<char *> argv;
+       for (int i = 0; i < args.size(); i++)
+          argv.push_back((char *)args[i].c_str());
+       argv.push_back(NULL);
+       execv(argv[0], &argv[0]);
+       _exit(127);
+    }
+    return pid;
+}
+
+static int countSlices(const string &dir)
+{
+    int n = 0;
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL)
+       return 0;
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL)
+       if (dirp->d_name[0] != '.')
+          n++;
+    closedir(dp);
+    return n;
+}
+
+// dim[1..3] of a published NIfTI file
+static void readMatrix(const string &path, int *matrix)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+       return;
+    short dim[8];
+    if ((fseek(fp, 40, SEEK_SET) == 0) && (fread(dim, sizeof(short), 8, fp) == 8))
+    {
+       matrix[0] = dim[1];
+       matrix[1] = dim[2];
+       matrix[2] = dim[3];
+    }
+    fclose(fp);
+}
+
+// last slice of every volume, from the replay log (mono_s is the last column)
+static map<int, double> lastSliceWritten(const string &logName)
+{
+    map<int, double> written;
+    FILE *fp = fopen(logName.c_str(), "r");
+    if (fp == NULL)
+       return written;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+       int index, volume;
+       if (sscanf(line, "%d\t%d", &index, &volume) != 2)
+          continue; // header
+       const char *last = strrchr(line, '\t');
+       double mono = (last != NULL) ? atof(last+1) : 0;
+       if (mono > written[volume])
+          written[volume] = mono;
+    }
+    fclose(fp);
+    return written;
+}
+
+static int runOnce(BenchRun &run, int number, const string &work, const string &converter, const string &replay,
+                   const string &converterArgs, const string &replayArgs, int maxVolumes, int port)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/run%.3d", number);
+    string dir = work + name;
+    string base = dir + "/images";
+    string command = "rm -rf '" + dir + "'";
+    if (system(command.c_str()) != 0)
+       return 1;
+    mkdir(dir.c_str(), 0777);
+    mkdir(base.c_str(), 0777);
+    mkdir((base + "/exam1").c_str(), 0777);
+
+    string notifyPath = dir + "/notify.sock";
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, notifyPath.c_str(), sizeof(addr.sun_path)-1);
+    if ((sock < 0) || (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0))
+    {
+       fprintf(stderr, "Unable to bind %s\n", notifyPath.c_str());
+       return 2;
+    }
+
+    int slices = countSlices(run.input.dir);
+    run.expected = slices / run.input.slices;
+    if ((maxVolumes > 0) && (run.expected > maxVolumes))
+       run.expected = maxVolumes;
+    run.published = 0;
+    run.matrix[0] = run.matrix[1] = run.matrix[2] = 0;
+    run.latencyMs.assign(run.expected, NAN);
+
+    char trText[32], slicesText[16], volumesText[16], portText[16];
+    snprintf(trText, sizeof(trText), "%g", run.TR);
+    snprintf(slicesText, sizeof(slicesText), "%d", run.input.slices);
+    snprintf(volumesText, sizeof(volumesText), "%d", run.expected);
+    snprintf(portText, sizeof(portText), "%d", port);
+
+    vector<string> args;
+    args.push_back(converter);
+    args.push_back(base);
+    args.push_back("-notify");
+    args.push_back(notifyPath);
+    if (run.output == 1)
+       args.push_back("-4d");
+    if (run.output == 2)
+    {
+       args.push_back("-mmap");
+       args.push_back("-volumes");
+       args.push_back(volumesText);
+    }
+    if (run.ingest == "push")
+    {
+       args.push_back("-push");
+       args.push_back(portText);
+    }
+    vector<string> extra = splitList(converterArgs, ' ');
+    args.insert(args.end(), extra.begin(), extra.end());
+    double start = monoNow();
+    pid_t converterPid = launch(dir, args);
+    usleep(500000); // listing the base folder, listening for the push agent
+
+    args.clear();
+    args.push_back(replay);
+    args.push_back("-tr");
+    args.push_back(trText);
+    args.push_back("-slices");
+    args.push_back(slicesText);
+    args.push_back("-volumes");
+    args.push_back(volumesText);
+    args.push_back("-log");
+    args.push_back(dir + "/replay.tsv");
+    if (run.ingest == "push")
+    {
+       args.push_back("-push");
+       args.push_back("127.0.0.1");
+       args.push_back(portText);
+    }
+    else
+    {
+       // whole slices only, staged above the watched series folder
+       args.push_back("-write");
+       args.push_back("atomic");
+    }
+    extra = splitList(replayArgs, ' ');
+    args.insert(args.end(), extra.begin(), extra.end());
+    args.push_back(run.input.dir);
+    args.push_back((run.ingest == "push") ? string("exam1/series1") : base + "/exam1/series1");
+    pid_t replayPid = launch(dir, args);
+
+    // volumes are stamped as they are published, until the replay is done and the converter idle
+    // (a converter that exits on its own has failed, whatever it published)
+    map<int, double> publishedAt;
+    int replayRunning = 1, status;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    run.converterExit = -1;
+    double idleLimit = fmax(3.0, 3*run.TR), lastEvent = monoNow();
+    while (replayRunning || ((run.published < run.expected) && (monoNow()-lastEvent < idleLimit)))
+    {
+       struct pollfd pfd;
+       pfd.fd = sock;
+       pfd.events = POLLIN;
+       if (poll(&pfd, 1, 50) > 0)
+       {
+          char line[2300];
+          ssize_t n = recv(sock, line, sizeof(line)-1, 0);
+          if (n > 0)
+          {
+             double now = monoNow();
+             line[n] = 0;
+             unsigned long seq;
+             int volume;
+             char file[2200];
+             // slabs are published before their volume, only whole volumes count
+             if ((sscanf(line, "%lu %d %2199s", &seq, &volume, file) == 3) && (strstr(file, "_slab_") == NULL))
+             {
+                if (publishedAt.find(volume) == publishedAt.end())
+                   run.published++;
+                publishedAt[volume] = now;
+                if (run.matrix[0] == 0)
+                   readMatrix(dir + "/output_scans/serie01/" + file, run.matrix);
+             }
+             lastEvent = now;
+          }
+       }
+       if (replayRunning && (waitpid(replayPid, NULL, WNOHANG) == replayPid))
+       {
+          replayRunning = 0;
+          lastEvent = monoNow();
+       }
+       if (wait4(converterPid, &status, WNOHANG, &usage) == converterPid)
+       {
+          run.converterExit = status;
+          break;
+       }
+    }
+    run.wallSeconds = monoNow()-start;
+    if (run.converterExit == -1)
+    {
+       kill(converterPid, SIGTERM);
+       wait4(converterPid, &status, 0, &usage);
+    }
+    if (replayRunning)
+    {
+       kill(replayPid, SIGTERM);
+       waitpid(replayPid, NULL, 0);
+    }
+    run.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec*1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec*1e-6;
+    close(sock);
+    unlink(notifyPath.c_str());
+
+    map<int, double> written = lastSliceWritten(dir + "/replay.tsv");
+    for (map<int, double>::iterator v = publishedAt.begin(); v != publishedAt.end(); v++)
+    {
+       if ((v->first >= 1) && (v->first <= run.expected) && (written.find(v->first) != written.end()))
+          run.latencyMs[v->first-1] = (v->second - written[v->first])*1000;
+    }
+    return 0;
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+    if (sorted.size() == 0)
+       return NAN;
+    size_t i = (size_t)ceil(p * sorted.size());
+    return sorted[(i > 0) ? i-1 : 0];
+}
+
+static void writeNumber(FILE *fp, double value)
+{
+    if (isnan(value))
+       fprintf(fp, "null");
+    else
+       fprintf(fp, "%.3f", value);
+}
+
+static void writeRun(FILE *fp, BenchRun &run)
+{
+    vector<double> sorted;
+    double sum = 0;
+    for (int i = 0; i < run.latencyMs.size(); i++)
+       if (!isnan(run.latencyMs[i]))
+       {
+          sorted.push_back(run.latencyMs[i]);
+          sum += run.latencyMs[i];
+       }
+    sort(sorted.begin(), sorted.end());
+    fprintf(fp, "    {\"input\": \"%s\", \"slices\": %d, \"matrix\": [%d, %d, %d], \"tr\": %g, \"ingest\": \"%s\", \"output\": %d,\n",
+            run.input.dir.c_str(), run.input.slices, run.matrix[0], run.matrix[1], run.matrix[2], run.TR, run.ingest.c_str(), run.output);
+    fprintf(fp, "     \"volumes\": %d, \"published\": %d, \"failed\": %s, \"latency_ms\": {\"p50\": ", run.expected, run.published,
+            (run.converterExit != -1) ? "true" : "false");
+    writeNumber(fp, percentile(sorted, 0.5));
+    fprintf(fp, ", \"p90\": ");
+    writeNumber(fp, percentile(sorted, 0.9));
+    fprintf(fp, ", \"p99\": ");
+    writeNumber(fp, percentile(sorted, 0.99));
+    fprintf(fp, ", \"max\": ");
+    writeNumber(fp, sorted.size() ? sorted.back() : NAN);
+    fprintf(fp, ", \"mean\": ");
+    writeNumber(fp, sorted.size() ? sum/sorted.size() : NAN);
+    fprintf(fp, "},\n     \"converter_cpu_s\": %.3f, \"converter_cpu_percent\": %.1f, \"wall_s\": %.3f,\n     \"per_volume_ms\": [",
+            run.cpuSeconds, (run.wallSeconds > 0) ? 100*run.cpuSeconds/run.wallSeconds : 0, run.wallSeconds);
+    for (int i = 0; i < run.latencyMs.size(); i++)
+    {
+       if (i > 0)
+          fprintf(fp, ", ");
+       writeNumber(fp, run.latencyMs[i]);
+    }
+    fprintf(fp, "]}");
+}
+
+int main(int argc, char *argv[])
+{
+    vector<BenchInput> inputs;
+    vector<string> trs(1, "2.0"), ingests(1, "dir"), outputs(1, "0");
+    string converter = "./dicomFTP", replay = "./scannerReplay", work = "bench_work", outName = "latency_bench.json";
+    string converterArgs, replayArgs;
+    int maxVolumes = 0, port = 17000;
+    for (int a = 1; a < argc; a++)
+    {
+       if ((!strcmp(argv[a], "-input")) && (a+1 < argc))
+       {
+          string spec = argv[++a];
+          size_t colon = spec.find_last_of(':');
+          BenchInput input;
+          input.dir = absolutePath(spec.substr(0, colon));
+          input.slices = (colon != string::npos) ? atoi(spec.c_str()+colon+1) : 0;
+          inputs.push_back(input);
+       }
+       else if ((!strcmp(argv[a], "-tr")) && (a+1 < argc))
+          trs = splitList(argv[++a], ',');
+       else if ((!strcmp(argv[a], "-ingest")) && (a+1 < argc))
+          ingests = splitList(argv[++a], ',');
+       else if ((!strcmp(argv[a], "-output")) && (a+1 < argc))
+          outputs = splitList(argv[++a], ',');
+       else if ((!strcmp(argv[a], "-volumes")) && (a+1 < argc))
+          maxVolumes = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-converter")) && (a+1 < argc))
+          converter = argv[++a];
+       else if ((!strcmp(argv[a], "-replay")) && (a+1 < argc))
+          replay = argv[++a];
+       else if ((!strcmp(argv[a], "-args")) && (a+1 < argc))
+          converterArgs = argv[++a];
+       else if ((!strcmp(argv[a], "-replayargs")) && (a+1 < argc))
+          replayArgs = argv[++a];
+       else if ((!strcmp(argv[a], "-work")) && (a+1 < argc))
+          work = argv[++a];
+       else if ((!strcmp(argv[a], "-port")) && (a+1 < argc))
+          port = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-out")) && (a+1 < argc))
+          outName = argv[++a];
+    }
+    if ((inputs.size() == 0) || (inputs[0].slices < 1))
+    {
+       fprintf(stderr, "usage: %s [-tr list] [-ingest dir,push] [-output 0,1,2] [-volumes n] [-converter path] [-replay path]\n"
+                       "       [-args \"dicomFTP options\"] [-replayargs \"scannerReplay options\"] [-work dir] [-port n] [-out file]\n"
+                       "       -input recordedSeriesDir:slicesPerVolume [-input ...]\n", argv[0]);
+       return 1;
+    }
+    mkdir(work.c_str(), 0777);
+    work = absolutePath(work);
+    converter = absolutePath(converter);
+    replay = absolutePath(replay);
+
+    vector<BenchRun> runs;
+    for (int i = 0; i < inputs.size(); i++)
+       for (int t = 0; t < trs.size(); t++)
+          for (int g = 0; g < ingests.size(); g++)
+             for (int o = 0; o < outputs.size(); o++)
+             {
+                BenchRun run;
+                run.input = inputs[i];
+                run.TR = atof(trs[t].c_str());
+                run.ingest = ingests[g];
+                run.output = atoi(outputs[o].c_str());
+                runs.push_back(run);
+             }
+
+    FILE *fp = fopen(outName.c_str(), "w");
+    if (fp == NULL)
+    {
+       fprintf(stderr, "Error opening %s\n", outName.c_str());
+       return 2;
+    }
+    time_t now = time(NULL);
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(fp, "{\"date\": \"%s\", \"host\": \"%s\", \"cpus\": %ld, \"converter_args\": \"%s\", \"replay_args\": \"%s\",\n  \"runs\": [\n",
+            date, host, sysconf(_SC_NPROCESSORS_ONLN), converterArgs.c_str(), replayArgs.c_str());
+    const char *separator = "";
+    for (int r = 0; r < runs.size(); r++)
+    {
+       BenchRun &run = runs[r];
+       fprintf(stderr, "run %d/%d: %s, %d slices, TR %g s, %s ingest, output mode %d\n", r+1, (int)runs.size(),
+               run.input.dir.c_str(), run.input.slices, run.TR, run.ingest.c_str(), run.output);
+       if (runOnce(run, r+1, work, converter, replay, converterArgs, replayArgs, maxVolumes, port+r) != 0)
+          continue;
+       vector<double> sorted;
+       for (int i = 0; i < run.latencyMs.size(); i++)
+          if (!isnan(run.latencyMs[i]))
+             sorted.push_back(run.latencyMs[i]);
+       sort(sorted.begin(), sorted.end());
+       if (run.converterExit != -1)
+          fprintf(stderr, "   converter died (%s %d), run failed\n", WIFSIGNALED(run.converterExit) ? "signal" : "exit status",
+                  WIFSIGNALED(run.converterExit) ? WTERMSIG(run.converterExit) : WEXITSTATUS(run.converterExit));
+       fprintf(stderr, "   %d/%d volumes, latency p50 %.1f ms p99 %.1f ms, converter CPU %.1f%%\n", run.published, run.expected,
+               percentile(sorted, 0.5), percentile(sorted, 0.99), (run.wallSeconds > 0) ? 100*run.cpuSeconds/run.wallSeconds : 0);
+       fprintf(fp, "%s", separator);
+       writeRun(fp, run);
+       separator = ",\n";
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
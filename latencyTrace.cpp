@@ -0,0 +1,212 @@
+//
+//  latencyTrace.cpp
+//
+//  Scanner to output latency of every slice and volume.
+//
+
+#include "latencyTrace.h"
+#include "metrics.h"
+#include <math.h>
+#include <sys/time.h>
+
+#define secondsPerDay 86400.0
+
+// differences of times of day across midnight
+static double wrapDay(double seconds)
+{
+    while (seconds >= secondsPerDay/2) seconds -= secondsPerDay;
+    while (seconds < -secondsPerDay/2) seconds += secondsPerDay;
+    return seconds;
+}
+
+static double localTimeOfDay(time_t t)
+{
+    struct tm parts;
+    localtime_r(&t, &parts);
+    return parts.tm_hour*3600.0 + parts.tm_min*60.0 + parts.tm_sec;
+}
+
+double dicomTimeOfDay(double hhmmss)
+{
+    int hms = (int)hhmmss;
+    return (hms / 10000)*3600.0 + ((hms / 100) % 100)*60.0 + (hms % 100) + (hhmmss-hms);
+}
+
+void ClockSync::reset()
+{
+    windowStart = -1;
+    windowMin = 0;
+    windowHost = 0;
+    hosts.clear();
+    minima.clear();
+    origin = a = b = 0;
+    fitted = 0;
+    samples = 0;
+}
+
+void ClockSync::sample(double host, double console)
+{
+    double delay = wrapDay(host - console);
+    samples++;
+    if ((windowStart >= 0) && (host-windowStart < clockWindowSeconds))
+    {
+       if (delay < windowMin)
+       {
+          windowMin = delay;
+          windowHost = host;
+       }
+       return;
+    }
+    if (windowStart >= 0)
+    {
+       hosts.push_back(windowHost);
+       minima.push_back(windowMin);
+       if (hosts.size() > clockWindows)
+       {
+          hosts.erase(hosts.begin());
+          minima.erase(minima.begin());
+       }
+       fit();
+    }
+    windowStart = host;
+    windowMin = delay;
+    windowHost = host;
+}
+
+// least squares line through the window minima, lowered to stay under all of them
+void ClockSync::fit()
+{
+    size_t n = hosts.size();
+    fitted = 0;
+    if (n < 2)
+       return;
+    origin = hosts[0];
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+       double x = hosts[i]-origin;
+       sx += x;
+       sy += minima[i];
+       sxx += x*x;
+       sxy += x*minima[i];
+    }
+    double var = n*sxx - sx*sx;
+    if (var < 1e-9)
+       return;
+    b = (n*sxy - sx*sy) / var;
+    a = (sy - b*sx) / n;
+    double above = 0;
+    for (size_t i = 0; i < n; i++)
+       above = fmax(above, a + b*(hosts[i]-origin) - minima[i]);
+    a -= above;
+    fitted = 1;
+}
+
+double ClockSync::offset(double host)
+{
+    if (windowStart < 0)
+       return 0;
+    double estimate = windowMin;
+    if (fitted)
+       estimate = fmin(estimate, a + b*(host-origin));
+    else if (minima.size() > 0)
+       estimate = fmin(estimate, minima[0]);
+    return estimate;
+}
+
+int LatencyTrace::start(const char *path)
+{
+    stop();
+    out = fopen(path, "w");
+    if (out == NULL)
+       return 1;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    monoToDay = localTimeOfDay(now.tv_sec) + now.tv_usec*1e-6 - MonoTime();
+    rtiaBase = -1;
+    acqBase = -1;
+    pending.clear();
+    clock.reset();
+    fprintf(out, "record\tindex\tvolume\tslice\tacquisition_s\trtia_s\twritten_s\tscanner_ms\tdelivery_ms\traw_ms\tfetch_ms\tparse_ms\tpublish_ms\ttotal_ms\toffset_ms\tdrift_ppm\n");
+    return 0;
+}
+
+void LatencyTrace::stop()
+{
+    if (out != NULL)
+       fclose(out);
+    out = NULL;
+    pending.clear();
+}
+
+void LatencyTrace::slice(int index, int volume, int slice, struct TDICOMdata &d, time_t written, double listed, double fetched, double parsed)
+{
+    if (out == NULL)
+       return;
+    SliceRecord r;
+    r.index = index;
+    r.volume = volume;
+    r.slice = slice;
+    r.rtia = (d.rtia_timerGE >= 0) ? d.rtia_timerGE / rtiaTicksPerSecond : -1;
+    double acq = (d.acquisitionTime > 0) ? dicomTimeOfDay(d.acquisitionTime) : -1;
+    if ((rtiaBase < 0) && (r.rtia >= 0) && (acq >= 0))
+    {
+       rtiaBase = r.rtia;
+       acqBase = acq;
+    }
+    // AcquisitionTime is often per volume, RTIA tells the slices apart
+    r.console = ((rtiaBase >= 0) && (r.rtia >= 0)) ? acqBase + (r.rtia-rtiaBase) : acq;
+    r.written = (written > 0) ? localTimeOfDay(written) : -1;
+    r.listed = (listed > 0) ? listed : fetched;
+    r.fetched = fetched;
+    r.parsed = parsed;
+    if (r.console >= 0)
+       clock.sample(hostDay(r.listed), r.console);
+    pending.push_back(r);
+}
+
+string LatencyTrace::volume(int volume, double published)
+{
+    if ((out == NULL) || pending.empty())
+       return "";
+    double offset = clock.offset(hostDay(published));
+    double drift = clock.driftPpm();
+    double firstTotal = NAN, lastTotal = NAN, deliverySum = 0, scannerMax = NAN;
+    int delivered = 0;
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+       SliceRecord &r = pending[i];
+       double scanner = NAN, delivery = NAN, raw = NAN, total = NAN;
+       if (r.console >= 0)
+       {
+          raw = wrapDay(hostDay(r.listed)-r.console)*1000;
+          delivery = raw - offset*1000;
+          total = delivery + (published-r.listed)*1000;
+          deliverySum += delivery;
+          delivered++;
+          if (r.written >= 0)
+             scanner = wrapDay(r.written-r.console)*1000;
+       }
+       if (!isnan(scanner) && (isnan(scannerMax) || (scanner > scannerMax)))
+          scannerMax = scanner;
+       if (i == 0)
+          firstTotal = total;
+       lastTotal = total;
+       fprintf(out, "slice\t%d\t%d\t%d\t%.4f\t%.4f\t%.0f\t%.0f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n", r.index+1, r.volume, r.slice+1,
+               r.console, r.rtia, r.written, scanner, delivery, raw,
+               (r.fetched-r.listed)*1000, (r.parsed-r.fetched)*1000, (published-r.parsed)*1000, total, offset*1000, drift);
+    }
+    SliceRecord &first = pending.front();
+    SliceRecord &last = pending.back();
+    double converter = (published-last.listed)*1000;
+    fprintf(out, "volume\t%d\t%d\t%d\t%.4f\t%.4f\t%.0f\t%.0f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n", last.index+1, volume, (int)pending.size(),
+            first.console, first.rtia, last.written, scannerMax, (delivered > 0) ? deliverySum/delivered : NAN, NAN,
+            (last.fetched-last.listed)*1000, (last.parsed-last.fetched)*1000, (published-last.parsed)*1000, lastTotal, offset*1000, drift);
+    fflush(out);
+    pending.clear();
+
+    char line[512];
+    snprintf(line, sizeof(line), "Latency volume %d: acquisition to published %2.3f ms (last slice) %2.3f ms (first slice), console write <= %.0f ms, delivery %2.3f ms over best, converter %2.3f ms, clock offset %2.3f ms drift %.1f ppm\n",
+             volume, lastTotal, firstTotal, scannerMax, (delivered > 0) ? deliverySum/delivered : NAN, converter, offset*1000, drift);
+    return line;
+}
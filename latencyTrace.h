@@ -0,0 +1,78 @@
+//
+//  latencyTrace.h
+//
+//  Scanner to output latency of every slice and volume. The console side is
+//  the acquisition time of the slice (AcquisitionTime of the first slice plus
+//  the GE RTIA timer, which counts from the series start in 0.1 ms) and the
+//  modification time of the slice file; the host side is when the listing
+//  found it, when it was fetched, parsed and when its volume was published.
+//  Console and host clocks are not synchronized, so ClockSync follows the
+//  offset and drift between them online from the lower envelope of the
+//  observed delays: the latencies it gives are over the fastest delivery
+//  seen in the series, the raw ones are only right with NTP on both sides.
+//
+
+#ifndef latencyTrace_h
+#define latencyTrace_h
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "memoryDCM.hpp"
+
+using namespace std;
+
+#define rtiaTicksPerSecond 10000.0
+#define clockWindowSeconds 5.0 // host time covered by each minimum of the lower envelope
+#define clockWindows 32        // minima kept for the drift fit
+
+// host minus console time, fitted as a line over the minimum delay of each window
+class ClockSync
+{
+    double windowStart, windowMin, windowHost;
+    vector<double> hosts, minima;
+    double origin, a, b; // offset = a + b*(host-origin)
+    int fitted;
+    void fit();
+public:
+    unsigned long samples;
+    void reset();
+    void sample(double host, double console);
+    double offset(double host);
+    double driftPpm() { return fitted ? b*1e6 : 0; };
+    ClockSync() { reset(); };
+};
+
+class LatencyTrace
+{
+    struct SliceRecord
+    {
+       int index, volume, slice;
+       double console;  // acquisition, console seconds of day
+       double rtia;     // seconds from the series start, -1 if not given
+       double written;  // file modification, console seconds of day (1 s resolution)
+       double listed, fetched, parsed; // MonoTime
+    };
+    FILE *out;
+    double monoToDay; // host seconds of day minus MonoTime
+    double rtiaBase, acqBase; // first slice with both, the acquisition times of the others follow RTIA
+    vector<SliceRecord> pending; // slices of the volume being assembled
+    double hostDay(double mono) { return mono + monoToDay; };
+public:
+    ClockSync clock;
+    int isOpen() { return out != NULL; };
+    // writes the records to path (tab separated), one line per slice and per volume
+    int start(const char *path);
+    void stop();
+    void slice(int index, int volume, int slice, struct TDICOMdata &d, time_t written, double listed, double fetched, double parsed);
+    // flushes the slices of the volume, returns a summary line for the series log
+    string volume(int volume, double published);
+    LatencyTrace() : out(NULL) {};
+    ~LatencyTrace() { stop(); };
+};
+
+// seconds of day of a DICOM HHMMSS.FFFFFF time
+double dicomTimeOfDay(double hhmmss);
+
+#endif /* latencyTrace_h */
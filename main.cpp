@@ -8,15 +8,83 @@
  */
 
 #include "sftp.h"
+#include "seriesManager.h"
 #include "dirent.h"
 
 int main(int argc, char *argv[])
 {
     char *inputpath = NULL;
-    if (argc > 1) {
+    if ((argc > 1) && (argv[1][0] != '-')) {
         inputpath = argv[1];
     } 
     sFTPGE ge(inputpath);
+
+    // options following the input path
+    for (int a = 1; a < argc; a++)
+    {
+        if ((!strcmp(argv[a], "-slab")) && (a+1 < argc))
+           ge.slabSize = atoi(argv[++a]); // publish slabs of this many slices as soon as they are complete
+        else if (!strcmp(argv[a], "-4d"))
+           ge.outputMode = 1; // one appendable 4D file per series
+        else if (!strcmp(argv[a], "-mmap"))
+           ge.outputMode = 2; // preallocated 4D file, slices placed directly in the mapping
+        else if ((!strcmp(argv[a], "-volumes")) && (a+1 < argc))
+           ge.expectedVolumes = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "-async"))
+           ge.asyncWriter = 1; // volumes are written on a separate thread
+        else if ((!strcmp(argv[a], "-batch")) && (a+1 < argc))
+           ge.writer.maxBatch = atoi(argv[++a]); // 4D volumes per writev on the writer thread
+        else if ((!strcmp(argv[a], "-notify")) && (a+1 < argc))
+           ge.publisher.notifyPath = argv[++a]; // UNIX datagram socket pinged for every published file
+        else if ((!strcmp(argv[a], "-shm")) && (a+1 < argc))
+           ge.ring.name = argv[++a]; // shared memory ring with the last volumes, e.g. /dicomFTP_volumes
+        else if ((!strcmp(argv[a], "-shmslots")) && (a+1 < argc))
+           ge.ring.slots = atoi(argv[++a]);
+        else if ((!strcmp(argv[a], "-stream")) && (a+1 < argc))
+           ge.streamer.path = argv[++a]; // UNIX socket serving volumes to subscribers
+        else if ((!strcmp(argv[a], "-scp")) && (a+1 < argc))
+        {
+           ge.setMode(3); // slices pushed by the scanner's DICOM export
+           ge.scp.port = atoi(argv[++a]);
+        }
+        else if ((!strcmp(argv[a], "-scpthreads")) && (a+1 < argc))
+           ge.scp.threads = atoi(argv[++a]);
+        else if ((!strcmp(argv[a], "-push")) && (a+1 < argc))
+        {
+           ge.setMode(4); // slices streamed by pushAgent running on the console
+           ge.pushRx.port = atoi(argv[++a]);
+        }
+        else if ((!strcmp(argv[a], "-series")) && (a+1 < argc))
+           ge.maxSeries = atoi(argv[++a]); // overlapping series converted at the same time
+        else if ((!strcmp(argv[a], "-seriesthreads")) && (a+1 < argc))
+           ge.seriesThreads = atoi(argv[++a]);
+        else if ((!strcmp(argv[a], "-pollmin")) && (a+1 < argc))
+           ge.poller.minInterval = atof(argv[++a]) / 1000.0; // ms between polls around an expected slice
+        else if ((!strcmp(argv[a], "-pollmax")) && (a+1 < argc))
+           ge.poller.maxInterval = atof(argv[++a]) / 1000.0; // ms, longest idle sleep
+        else if ((!strcmp(argv[a], "-pipeline")) && (a+1 < argc))
+           ge.slices.depth = atoi(argv[++a]); // slices fetched and parsed ahead of the assembler
+        else if ((!strcmp(argv[a], "-fetchthreads")) && (a+1 < argc))
+           ge.slices.fetchThreads = atoi(argv[++a]);
+        else if ((!strcmp(argv[a], "-parsethreads")) && (a+1 < argc))
+           ge.slices.parseThreads = atoi(argv[++a]);
+        else if ((!strcmp(argv[a], "-fetchcpu")) && (a+1 < argc))
+           ge.slices.fetchCpu = atoi(argv[++a]); // first CPU of the fetch pool
+        else if ((!strcmp(argv[a], "-parsecpu")) && (a+1 < argc))
+           ge.slices.parseCpu = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "-feed"))
+           ge.changeFeed = 1; // SFTP mode: inotifywait/find on the console reports new files
+        else if (!strcmp(argv[a], "-trace"))
+           tracer.enabled = 1; // trace.json in each series output, open in ui.perfetto.dev
+        else if (!strcmp(argv[a], "-latency"))
+           ge.traceLatency = 1; // latency.tsv in each series output, acquisition to published per slice
+        else if ((!strcmp(argv[a], "-deadline")) && (a+1 < argc))
+           ge.deadline.fraction = atof(argv[++a]); // budget per volume as a fraction of the TR, 0 disables
+        else if ((!strcmp(argv[a], "-metrics")) && (a+1 < argc))
+           ge.metricsServer.address = argv[++a]; // Prometheus endpoint: a localhost TCP port, or the path of a UNIX socket
+        else if ((!strcmp(argv[a], "-alerts")) && (a+1 < argc))
+           ge.deadline.alertPath = argv[++a]; // UNIX datagram socket receiving the deadline alerts as JSON
+    }
     
     if (0)
     {
@@ -47,7 +115,18 @@ int main(int argc, char *argv[])
     }
 
     int numSeries = 0;    
+    signal(SIGUSR1, requestMetricsReport); // latency percentiles of the running series on demand
+    tracer.nameThread("main");
     ge.connectSession();
+    if (ge.asyncWriter)
+       ge.writer.start();
+    if (ge.slices.depth > 0)
+       ge.startPipeline();
+    if (ge.streamer.start() != 0)
+       fprintf(stderr, "Unable to listen on %s\n", ge.streamer.path.c_str());
+    ge.metricsServer.collect = [&ge]() { return ge.metricsExposition(); };
+    if (ge.metricsServer.start() != 0)
+       fprintf(stderr, "Unable to serve the metrics on %s\n", ge.metricsServer.address.c_str());
 
     // create parent output folder
     char logDir[1024];
@@ -97,6 +176,11 @@ int main(int argc, char *argv[])
     timeStampString = string(logDir) + "/" + timeStampString + ".txt";
     ge.logMain.initializeLogFile((char *)timeStampString.c_str());
     ge.logMain.writeLog(1, "Last series folder count = %d\n", numSeries);
+    if (ge.maxSeries > 1)
+    {
+       SeriesManager manager(&ge, outputDir, numSeries);
+       manager.run();
+    }
     while (1)
     { 
        if (ge.findInputDir()) // search for new directory in the base folder
@@ -113,6 +197,7 @@ int main(int argc, char *argv[])
              mkdir(outputdir, 0777);
 
              ge.logSeries.initializeLogFile(logName);    
+             ge.seriesActive(numSeries);
              // just converting char to string
              string outputDir = outputdir;
              ge.setStartTime();
@@ -120,9 +205,18 @@ int main(int argc, char *argv[])
              {
                 ge.copyStep(outputDir);
              }
+             string report = ge.metricsReport();
+             ge.logSeries.writeLog(1, "%s", report.c_str());
+             ge.writeTrace();
+             ge.metrics.gauge(gaugeSeriesActive, 0);
+             ge.logSeries.flushLog();
           }
        }  
     }
+    ge.slices.stop();
+    ge.writer.stop();
+    ge.streamer.stop();
+    ge.metricsServer.stop();
     ge.closeSession();
     return 0;
 }
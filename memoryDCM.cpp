@@ -27,8 +27,10 @@ int isDICOMfile(stringstream &filemem) { //0=NotDICOM, 1=DICOM, 2=Maybe(not Part
     return 0;
 } //isDICOMfile()
 
-struct TDICOMdata readDICOMv(stringstream &filemem, int isVerbose, int compressFlag, struct TDTI4D *dti4D) {
+struct TDICOMdata readDICOMv(stringstream &filemem, int isVerbose, int compressFlag, struct TDTI4D *dti4D, struct TAcqCounts *counts) {
     struct TDICOMdata d = clear_dicom_data();
+    if (counts != NULL)
+        memset(counts, 0, sizeof(*counts)); //not a complete header: no counts
     d.imageNum = 0; //not set
     strcpy(d.protocolName, ""); //erase dummy with empty
     strcpy(d.protocolName, ""); //erase dummy with empty
@@ -174,6 +176,7 @@ const uint32_t kEffectiveTE  = 0x0018+ (0x9082 << 16);
 #define  kImagePositionPatient 0x0020+(0x0032 << 16 )   // Actually !
 #define  kOrientationACR 0x0020+(0x0035 << 16 )
 //#define  kTemporalPositionIdentifier 0x0020+(0x0100 << 16 ) //IS
+#define  kNumberOfTemporalPositions 0x0020+(0x0105 << 16 ) //IS
 #define  kOrientation 0x0020+(0x0037 << 16 )
 #define  kImagesInAcquisition 0x0020+(0x1002 << 16 ) //IS
 #define  kImageComments 0x0020+(0x4000<< 16 )// '0020' '4000' 'LT' 'ImageComments'
@@ -264,6 +267,7 @@ double TE = 0.0; //most recent echo time recorded
     //int temporalPositionIdentifier = 0;
     int locationsInAcquisitionPhilips = 0;
     int imagesInAcquisition = 0;
+    int numberOfTemporalPositions = 0;
     //int sumSliceNumberMrPhilips = 0;
     int sliceNumberMrPhilips = 0;
     int numberOfFrames = 0;
@@ -1615,6 +1619,9 @@ double TE = 0.0; //most recent echo time recorded
             case kImagesInAcquisition :
                 imagesInAcquisition =  dcmStrInt(lLength, &buffer[lPos]);
                 break;
+            case kNumberOfTemporalPositions :
+                numberOfTemporalPositions =  dcmStrInt(lLength, &buffer[lPos]);
+                break;
             case kImageStart:
                 //if ((!geiisBug) && (!isIconImageSequence)) //do not exit for proprietary thumbnails
                 if (isIconImageSequence) {
@@ -1992,6 +1999,11 @@ if (d.isHasPhase)
         d.CSA.multiBandFactor = multiBandFactor; //SMS reported in 0051,1011 but not CSA header
     //printf("%g\t\t%g\t%g\t%g\n", d.CSA.dtiV[0], d.CSA.dtiV[1], d.CSA.dtiV[2], d.CSA.dtiV[3]);
     //printMessage("buffer usage %d  %d  %d\n",d.imageStart, lPos+lFileOffset, MaxBufferSz);
+    if (counts != NULL) {
+        counts->imagesInAcquisition = imagesInAcquisition;
+        counts->temporalPositions = numberOfTemporalPositions;
+        counts->locationsGE = locationsInAcquisitionGE;
+    }
     return d;
 } // readDICOM()
 
@@ -34,6 +34,13 @@ struct TDCMdim { //DimensionIndexValues
     bool isImaginary;
 };
 
+// counts that tell how long the acquisition runs, for ending a series on its last volume
+struct TAcqCounts {
+    int imagesInAcquisition; // 0020,1002
+    int temporalPositions;   // 0020,0105
+    int locationsGE;         // 0021,104F
+};
+
 struct TVolumeDiffusion {
     struct TDICOMdata* pdd;  // The multivolume
     struct TDTI4D* pdti4D;   // permanent records.
@@ -99,7 +106,7 @@ void set_bVal(struct TVolumeDiffusion* ptvd, float b);
 void set_orientation0018_9089(struct TVolumeDiffusion* ptvd, int lLength, unsigned char* inbuf, bool isLittleEndian);
 void set_isAtFirstPatientPosition_tvd(struct TVolumeDiffusion* ptvd, const bool iafpp);
 uint32_t mz_crc32(unsigned char *ptr, uint32_t buf_len);
-struct TDICOMdata readDICOMv(stringstream &filemem, int isVerbose, int compressFlag, struct TDTI4D *dti4D);
+struct TDICOMdata readDICOMv(stringstream &filemem, int isVerbose, int compressFlag, struct TDTI4D *dti4D, struct TAcqCounts *counts = NULL);
 int headerDcm2Nii(struct TDICOMdata d, struct nifti_1_header *h, bool isComputeSForm);
 int nii_saveNII3D(char * niiFilename, struct nifti_1_header hdr, unsigned char* im, struct TDCMopts opts);
 
@@ -0,0 +1,210 @@
+//
+//  metrics.cpp
+//
+//  Latency histograms per pipeline stage.
+//
+
+#include "metrics.h"
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+
+volatile sig_atomic_t metricsReportRequested = 0;
+
+void requestMetricsReport(int sig)
+{
+    metricsReportRequested++;
+}
+
+double MonoTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static int bucketOf(uint64_t us)
+{
+    const uint64_t sub = 1 << histogramSubBits;
+    if (us < sub)
+       return (int)us;
+    int e = 63 - __builtin_clzll(us); // >= histogramSubBits
+    int b = (e-histogramSubBits+1)*sub + (int)((us >> (e-histogramSubBits)) & (sub-1));
+    return (b < histogramBuckets) ? b : histogramBuckets-1;
+}
+
+static uint64_t bucketTop(int b)
+{
+    const uint64_t sub = 1 << histogramSubBits;
+    if (b < sub)
+       return b;
+    int e = b/sub + histogramSubBits - 1;
+    return ((sub + b%sub + 1) << (e-histogramSubBits)) - 1;
+}
+
+void Histogram::record(double seconds)
+{
+    uint64_t us = (seconds > 0) ? (uint64_t)(seconds*1e6 + 0.5) : 0;
+    buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sumUs.fetch_add(us, std::memory_order_relaxed);
+    uint64_t seen = maxUs.load(std::memory_order_relaxed);
+    while ((us > seen) && (!maxUs.compare_exchange_weak(seen, us, std::memory_order_relaxed)));
+}
+
+void Histogram::reset()
+{
+    for (int i = 0; i < histogramBuckets; i++)
+       buckets[i] = 0;
+    total = 0;
+    sumUs = 0;
+    maxUs = 0;
+}
+
+double Histogram::percentileMs(double p)
+{
+    uint64_t n = total;
+    if (n == 0)
+       return 0;
+    uint64_t rank = (uint64_t)(p*n + 0.5);
+    if (rank < 1)
+       rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < histogramBuckets; i++)
+    {
+       seen += buckets[i].load(std::memory_order_relaxed);
+       if (seen >= rank)
+       {
+          uint64_t top = bucketTop(i);
+          return ((top < maxUs) ? top : (uint64_t)maxUs) / 1000.0;
+       }
+    }
+    return maxMs();
+}
+
+uint64_t Histogram::countAtMost(uint64_t us)
+{
+    uint64_t n = 0;
+    for (int i = 0; (i < histogramBuckets) && (bucketTop(i) <= us); i++)
+       n += buckets[i].load(std::memory_order_relaxed);
+    return n;
+}
+
+MetricsRegistry::MetricsRegistry() : total(NULL)
+{
+    for (int i = 0; i < metricCounters; i++)
+       counters[i] = 0;
+    for (int i = 0; i < metricGauges; i++)
+       gauges[i] = 0;
+    latestSeries = 0;
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    for (int i = 0; i < metricGauges; i++)
+       gauge((MetricGauge)i, 0);
+}
+
+void MetricsRegistry::reset()
+{
+    for (int i = 0; i < metricStages; i++)
+       stages[i].reset();
+    for (int i = 0; i < metricCounters; i++)
+       counters[i] = 0;
+    for (int i = 0; i < metricGauges; i++)
+       gauge((MetricGauge)i, 0);
+}
+
+const char *metricName(MetricStage stage)
+{
+    static const char *names[metricStages] = { "list", "fetch", "parse", "pixel copy", "assemble", "write",
+                                               "writer queue", "last slice->volume", "first slice->volume" };
+    return names[stage];
+}
+
+const char *metricLabel(MetricStage stage)
+{
+    static const char *labels[metricStages] = { "list", "fetch", "parse", "copy", "assemble", "write",
+                                                "writer_queue", "last_slice_to_volume", "first_slice_to_volume" };
+    return labels[stage];
+}
+
+const char *metricCounterName(MetricCounter counter)
+{
+    static const char *names[metricCounters] = { "slices_seen_total", "slices_fetched_total", "slices_parsed_total",
+                                                 "slices_retried_total", "slices_parked_total", "volumes_published_total",
+                                                 "listings_total", "deadline_misses_total", "ingest_bytes_total{mode=\"directory\"}",
+                                                 "ingest_bytes_total{mode=\"sftp\"}", "ingest_bytes_total{mode=\"scp\"}",
+                                                 "ingest_bytes_total{mode=\"push\"}" };
+    return names[counter];
+}
+
+const char *metricGaugeName(MetricGauge g)
+{
+    static const char *names[metricGauges] = { "slices_pending", "pipeline_queue", "writer_backlog", "idle_polls", "series_active" };
+    return names[g];
+}
+
+// upper bounds of the exposed histogram buckets, seconds
+static const double exposedBuckets[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                                         0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+string MetricsRegistry::exposition(const char *prefix)
+{
+    string out;
+    char line[512];
+    for (int i = 0; i < metricCounters; i++)
+    {
+       const char *name = metricCounterName((MetricCounter)i);
+       // one TYPE line per metric family, the byte counters share theirs
+       if (i <= counterBytesDirectory)
+       {
+          snprintf(line, sizeof(line), "# TYPE %s%.*s counter\n", prefix, (int)strcspn(name, "{"), name);
+          out += line;
+       }
+       snprintf(line, sizeof(line), "%s%s %lu\n", prefix, name, (unsigned long)counters[i].load());
+       out += line;
+    }
+    for (int i = 0; i < metricGauges; i++)
+    {
+       snprintf(line, sizeof(line), "# TYPE %s%s gauge\n%s%s %ld\n", prefix, metricGaugeName((MetricGauge)i), prefix, metricGaugeName((MetricGauge)i), gauges[i].load());
+       out += line;
+    }
+    snprintf(line, sizeof(line), "# TYPE %sseries_current gauge\n%sseries_current %d\n", prefix, prefix, (int)latestSeries);
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE %sstage_seconds histogram\n", prefix);
+    out += line;
+    for (int s = 0; s < metricStages; s++)
+    {
+       Histogram &h = stages[s];
+       const char *stage = metricLabel((MetricStage)s);
+       for (int b = 0; b < sizeof(exposedBuckets)/sizeof(exposedBuckets[0]); b++)
+       {
+          snprintf(line, sizeof(line), "%sstage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", prefix, stage, exposedBuckets[b],
+                   (unsigned long)h.countAtMost((uint64_t)(exposedBuckets[b]*1e6 + 0.5)));
+          out += line;
+       }
+       snprintf(line, sizeof(line), "%sstage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n%sstage_seconds_sum{stage=\"%s\"} %.6f\n%sstage_seconds_count{stage=\"%s\"} %lu\n",
+                prefix, stage, (unsigned long)h.count(), prefix, stage, h.sumSeconds(), prefix, stage, (unsigned long)h.count());
+       out += line;
+    }
+    return out;
+}
+
+string MetricsRegistry::report()
+{
+    string out;
+    char line[256];
+    snprintf(line, sizeof(line), "%-20s %8s %10s %10s %10s %10s %10s\n", "stage (ms)", "count", "p50", "p90", "p99", "max", "mean");
+    out += line;
+    for (int i = 0; i < metricStages; i++)
+    {
+       Histogram &h = stages[i];
+       if (h.count() == 0)
+          continue;
+       snprintf(line, sizeof(line), "%-20s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", metricName((MetricStage)i), (unsigned long)h.count(),
+                h.percentileMs(0.5), h.percentileMs(0.9), h.percentileMs(0.99), h.maxMs(), h.meanMs());
+       out += line;
+    }
+    return out;
+}
@@ -0,0 +1,118 @@
+//
+//  metrics.h
+//
+//  Latency histograms per pipeline stage, timed with CLOCK_MONOTONIC.
+//  Buckets are logarithmic with 16 sub-buckets per power of two (values in
+//  microseconds, about 6% resolution from 1 us to days), so p50/p99/max
+//  come out of a fixed array that any thread can record into without locks.
+//
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <atomic>
+#include <string>
+#include <signal.h>
+#include <stdint.h>
+
+using namespace std;
+
+#define histogramSubBits 4
+#define histogramBuckets 960
+
+// seconds on CLOCK_MONOTONIC, never jumps with NTP
+double MonoTime();
+
+class Histogram
+{
+    std::atomic<uint64_t> buckets[histogramBuckets];
+    std::atomic<uint64_t> total, sumUs, maxUs;
+public:
+    void record(double seconds);
+    void reset();
+    uint64_t count() { return total; };
+    // upper bound of the bucket holding the p-th fraction of the values, in ms
+    double percentileMs(double p);
+    double maxMs() { return maxUs / 1000.0; };
+    double sumSeconds() { return sumUs / 1e6; };
+    // values of at most us microseconds (to the bucket resolution)
+    uint64_t countAtMost(uint64_t us);
+    double meanMs() { return (total > 0) ? (sumUs / 1000.0) / total : 0; };
+    Histogram() { reset(); };
+};
+
+enum MetricStage
+{
+    metricList,           // getFileList
+    metricFetch,          // getFile, local file, SFTP or slice store
+    metricParse,          // readDICOMv
+    metricCopy,           // slice pixels into the volume
+    metricAssemble,       // slice taken up to its place in the volume
+    metricWrite,          // saveVolume, ring, stream and file
+    metricWriter,         // queued to on disk, writer thread
+    metricSliceToVolume,  // last slice of a volume listed -> volume published
+    metricFirstToVolume,  // first slice of a volume listed -> volume published
+    metricStages
+};
+
+enum MetricCounter
+{
+    counterSlicesSeen,       // new slice files in the listings
+    counterSlicesFetched,
+    counterSlicesParsed,
+    counterSlicesRetried,    // pass stopped on it, read again by the next one: missing from the listing, unreadable or of invalid size
+    counterSlicesParked,     // still being written, retried on a later listing
+    counterVolumesPublished,
+    counterListings,
+    counterDeadlineMisses,
+    counterBytesDirectory,   // bytes fetched per ingest mode, in the order of sFTPGE::mode
+    counterBytesSFTP,
+    counterBytesSCP,
+    counterBytesPush,
+    metricCounters
+};
+
+enum MetricGauge
+{
+    gaugeSlicesPending,      // listed and not assembled yet
+    gaugePipelineQueue,      // slices requested from the fetch/parse pools
+    gaugeWriterBacklog,      // volumes queued to the writer thread
+    gaugeIdlePolls,          // listings in a row without new slices
+    gaugeSeriesActive,
+    metricGauges
+};
+
+class MetricsRegistry
+{
+public:
+    Histogram stages[metricStages];
+    std::atomic<uint64_t> counters[metricCounters];
+    std::atomic<long> gauges[metricGauges];
+    std::atomic<int> latestSeries; // set on the totals only
+    MetricsRegistry *total; // process totals this series adds to, never reset; NULL in the totals
+
+    void record(MetricStage stage, double seconds) { stages[stage].record(seconds); if (total != NULL) total->record(stage, seconds); };
+    void count(MetricCounter counter, uint64_t n = 1) { counters[counter].fetch_add(n, std::memory_order_relaxed); if (total != NULL) total->count(counter, n); };
+    // the totals hold the sum of the gauges of every series being converted
+    void gauge(MetricGauge g, long value) { long old = gauges[g].exchange(value); if (total != NULL) total->gauges[g] += value-old; };
+    // histograms and counters; the gauges go back to 0 in the totals as well
+    void reset();
+    // one line per stage with samples: count, p50, p90, p99, max and mean in ms
+    string report();
+    // Prometheus text format, names starting with prefix
+    string exposition(const char *prefix);
+    MetricsRegistry();
+    ~MetricsRegistry();
+};
+
+const char *metricName(MetricStage stage);
+// names in the exposition: label values and metric names
+const char *metricLabel(MetricStage stage);
+const char *metricCounterName(MetricCounter counter);
+const char *metricGaugeName(MetricGauge g);
+
+// counts SIGUSR1, every series writes a report when it moved since its last one
+extern volatile sig_atomic_t metricsReportRequested;
+void requestMetricsReport(int sig);
+
+#endif /* metrics_h */
@@ -0,0 +1,149 @@
+//
+//  metricsServer.cpp
+//
+//  Prometheus text endpoint of the converter.
+//
+
+#include "metricsServer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <poll.h>
+#include <new>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+std::atomic<unsigned long> heapAllocations(0);
+
+// counted C++ allocations, new[] comes through here as well
+void *operator new(size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc((size > 0) ? size : 1);
+    if (p == NULL)
+       throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+static int isPort(const string &address)
+{
+    for (int i = 0; i < address.size(); i++)
+       if (!isdigit(address[i]))
+          return 0;
+    return 1;
+}
+
+int MetricsServer::start()
+{
+    if (running || !isEnabled())
+       return 0;
+    int tcp = isPort(address);
+    listenFd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+       return 1;
+
+    int bound;
+    if (tcp)
+    {
+       // localhost only, the counters are not meant to leave the console room
+       int on = 1;
+       setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+       struct sockaddr_in addr;
+       memset(&addr, 0, sizeof(addr));
+       addr.sin_family = AF_INET;
+       addr.sin_port = htons(atoi(address.c_str()));
+       addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+       bound = bind(listenFd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    else
+    {
+       struct sockaddr_un addr;
+       memset(&addr, 0, sizeof(addr));
+       addr.sun_family = AF_UNIX;
+       strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path)-1);
+       unlink(address.c_str());
+       bound = bind(listenFd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if ((bound != 0) || (listen(listenFd, 8) != 0))
+    {
+       close(listenFd);
+       listenFd = -1;
+       return 2;
+    }
+    running = true;
+    worker = std::thread(&MetricsServer::run, this);
+    return 0;
+}
+
+void MetricsServer::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    worker.join();
+    close(listenFd);
+    listenFd = -1;
+    if (!isPort(address))
+       unlink(address.c_str());
+}
+
+void MetricsServer::run()
+{
+    while (running)
+    {
+       struct pollfd p;
+       p.fd = listenFd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 200) <= 0)
+          continue;
+       int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+       if (fd < 0)
+          continue;
+       serve(fd);
+       close(fd);
+    }
+}
+
+// one scrape per connection: the request is read up to its blank line, the answer closes it
+void MetricsServer::serve(int fd)
+{
+    char request[4096];
+    size_t n = 0;
+    while (n < sizeof(request)-1)
+    {
+       struct pollfd p;
+       p.fd = fd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 1000) <= 0)
+          return; // a scraper that does not send its request is dropped
+       ssize_t r = recv(fd, request+n, sizeof(request)-1-n, 0);
+       if (r <= 0)
+          return;
+       n += r;
+       request[n] = 0;
+       if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+          break;
+    }
+    string body = collect ? collect() : string();
+    char header[256];
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+             (unsigned long)body.size());
+    string response = string(header) + body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+       ssize_t w = send(fd, response.data()+sent, response.size()-sent, MSG_NOSIGNAL);
+       if (w <= 0)
+          return;
+       sent += w;
+    }
+}
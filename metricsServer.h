@@ -0,0 +1,42 @@
+//
+//  metricsServer.h
+//
+//  Pipeline counters, gauges and latency histograms in the Prometheus text
+//  format, served over HTTP on a localhost TCP port or on a UNIX socket
+//  (curl --unix-socket) so monitoring can scrape the converter during a
+//  session. Every request gets the current text, whatever its path.
+//
+
+#ifndef metricsServer_h
+#define metricsServer_h
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+class MetricsServer
+{
+    int listenFd;
+    std::thread worker;
+    std::atomic<bool> running;
+    void run();
+    void serve(int fd);
+public:
+    string address; // TCP port on 127.0.0.1, or the path of a UNIX socket; empty disables
+    std::function<string()> collect; // exposition text, called on the server thread
+
+    int start();
+    void stop();
+    int isEnabled() { return address.size() > 0; };
+
+    MetricsServer() { listenFd = -1; running = false; };
+    ~MetricsServer() { stop(); };
+};
+
+// operator new calls of the process
+extern std::atomic<unsigned long> heapAllocations;
+
+#endif /* metricsServer_h */
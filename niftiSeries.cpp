@@ -0,0 +1,215 @@
+//
+//  niftiSeries.cpp
+//
+//  One 4D NIfTI file per series, volumes appended as they are converted.
+//  In mapped mode the whole file is preallocated and mmap'd so slices are
+//  read straight into their final place in the file.
+//
+
+#include "niftiSeries.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+int NiftiSeries::openSeries(const char *niiFilename, struct nifti_1_header hdr)
+{
+    closeSeries();
+    volumeBytes = nii_ImgBytes(hdr);
+    if (volumeBytes < 1)
+       return 1;
+
+    fileName = niiFilename;
+    fileName += ".nii";
+    fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+       return 2;
+
+    if (ftruncate(fd, niftiVoxOffset) != 0)
+    {
+       closeSeries();
+       return 3;
+    }
+    // only the header page is mapped, voxels go through pwrite
+    void *mem = mmap(NULL, niftiVoxOffset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+       closeSeries();
+       return 4;
+    }
+    mappedHdr = (struct nifti_1_header *)mem;
+
+    hdr.vox_offset = niftiVoxOffset;
+    hdr.dim[0] = 4;
+    hdr.dim[4] = 0;
+    memcpy(mappedHdr, &hdr, sizeof(hdr));
+    numVolumes = 0;
+    return 0;
+}
+
+int NiftiSeries::appendVolume(unsigned char *im, int volumeIndex)
+{
+    if ((fd < 0) || (volumeIndex < 1))
+       return 1;
+
+    off_t offset = niftiVoxOffset + (off_t)(volumeIndex-1) * volumeBytes;
+    size_t written = 0;
+    while (written < volumeBytes)
+    {
+       ssize_t rc = pwrite(fd, im + written, volumeBytes - written, offset + written);
+       if (rc < 0)
+       {
+          if (errno == EINTR) continue;
+          return 2;
+       }
+       written += rc;
+    }
+
+    // dim[4] is only raised after the voxels are in the file, readers never see a partial volume
+    if (volumeIndex > numVolumes)
+    {
+       numVolumes = volumeIndex;
+       mappedHdr->dim[4] = numVolumes;
+    }
+    return 0;
+}
+
+int NiftiSeries::appendVolumes(const struct iovec *iov, int n, int firstVolume)
+{
+    if ((fd < 0) || (firstVolume < 1) || (n < 1))
+       return 1;
+
+    off_t offset = niftiVoxOffset + (off_t)(firstVolume-1) * volumeBytes;
+    ssize_t rc = pwritev(fd, iov, n, offset);
+    if (rc != (ssize_t)(n * volumeBytes))
+    {
+       // short or interrupted write, finish volume by volume
+       for (int i = 0; i < n; i++)
+       {
+          if (appendVolume((unsigned char *)iov[i].iov_base, firstVolume+i) != 0)
+             return 2;
+       }
+       return 0;
+    }
+    if (firstVolume+n-1 > numVolumes)
+    {
+       numVolumes = firstVolume+n-1;
+       mappedHdr->dim[4] = numVolumes;
+    }
+    return 0;
+}
+
+static int reserveFile(int fd, size_t bytes)
+{
+    // no sparse fallback: a full disk behind the mapping is a SIGBUS in the middle of the series,
+    // the caller writes one file per volume instead
+    return fallocate(fd, 0, 0, bytes);
+}
+
+int NiftiSeries::openMapped(const char *niiFilename, struct nifti_1_header hdr, int expectedVolumes)
+{
+    closeSeries();
+    volumeBytes = nii_ImgBytes(hdr);
+    if (volumeBytes < 1)
+       return 1;
+    if (expectedVolumes < 1)
+       expectedVolumes = mappedGrowVolumes;
+
+    fileName = niiFilename;
+    fileName += ".nii";
+    fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+       return 2;
+
+    mapBytes = niftiVoxOffset + (size_t)expectedVolumes * volumeBytes;
+    if (reserveFile(fd, mapBytes) != 0)
+    {
+       mapBytes = 0;
+       closeSeries();
+       unlink(fileName.c_str());
+       return 3;
+    }
+    void *mem = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+       mapBytes = 0;
+       closeSeries();
+       return 4;
+    }
+    mapBase = (unsigned char *)mem;
+    mappedHdr = (struct nifti_1_header *)mem;
+
+    hdr.vox_offset = niftiVoxOffset;
+    hdr.dim[0] = 4;
+    hdr.dim[4] = 0;
+    memcpy(mappedHdr, &hdr, sizeof(hdr));
+    numVolumes = 0;
+    return 0;
+}
+
+unsigned char *NiftiSeries::volumeData(int volumeIndex)
+{
+    if ((mapBase == NULL) || (volumeIndex < 1))
+       return NULL;
+
+    size_t end = niftiVoxOffset + (size_t)volumeIndex * volumeBytes;
+    if (end > mapBytes)
+    {
+       // the previous volumes are complete at this point, so moving the mapping is safe
+       size_t newBytes = end + (size_t)mappedGrowVolumes * volumeBytes;
+       if (reserveFile(fd, newBytes) != 0)
+          return NULL;
+       void *mem = mremap(mapBase, mapBytes, newBytes, MREMAP_MAYMOVE);
+       if (mem == MAP_FAILED)
+          return NULL;
+       mapBase = (unsigned char *)mem;
+       mappedHdr = (struct nifti_1_header *)mem;
+       mapBytes = newBytes;
+    }
+    return mapBase + niftiVoxOffset + (size_t)(volumeIndex-1) * volumeBytes;
+}
+
+int NiftiSeries::publishVolume(int volumeIndex)
+{
+    unsigned char *data = volumeData(volumeIndex);
+    if (data == NULL)
+       return 1;
+
+    // msync needs a page aligned start
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)(data - mapBase) & ~((size_t)page - 1);
+    msync(mapBase + start, (data - mapBase) + volumeBytes - start, MS_ASYNC);
+    if (volumeIndex > numVolumes)
+    {
+       numVolumes = volumeIndex;
+       mappedHdr->dim[4] = numVolumes;
+    }
+    return 0;
+}
+
+int NiftiSeries::closeSeries()
+{
+    if (mapBase)
+    {
+       msync(mapBase, mapBytes, MS_SYNC);
+       munmap(mapBase, mapBytes);
+       mapBase = NULL;
+       mappedHdr = NULL;
+       // drop the preallocated tail that was never used
+       ftruncate(fd, niftiVoxOffset + (size_t)numVolumes * volumeBytes);
+       mapBytes = 0;
+    }
+    if (mappedHdr)
+    {
+       msync(mappedHdr, niftiVoxOffset, MS_SYNC);
+       munmap(mappedHdr, niftiVoxOffset);
+       mappedHdr = NULL;
+    }
+    if (fd >= 0)
+    {
+       close(fd);
+       fd = -1;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+//
+//  niftiSeries.h
+//
+//  One 4D NIfTI file per series, volumes appended as they are converted.
+//  In mapped mode the whole file is preallocated and mmap'd so slices are
+//  read straight into their final place in the file.
+//
+
+#ifndef niftiSeries_h
+#define niftiSeries_h
+
+#include <string>
+#include <sys/uio.h>
+#include "memoryDCM.hpp"
+
+using namespace std;
+
+#define niftiVoxOffset 352
+#define mappedGrowVolumes 64 // preallocation step when the volume count is unknown
+
+class NiftiSeries
+{
+    int fd;
+    struct nifti_1_header *mappedHdr; // header region of the file, updated in place
+    unsigned char *mapBase;           // whole file in mapped mode, NULL otherwise
+    size_t mapBytes;
+    size_t volumeBytes;
+    int numVolumes;
+    string fileName;
+public:
+    // creates the file and writes the header of a 3D volume, dim[4] starts at 0
+    int openSeries(const char *niiFilename, struct nifti_1_header hdr);
+
+    // writes the voxels of volume volumeIndex (1-based) at its offset and updates dim[4]
+    int appendVolume(unsigned char *im, int volumeIndex);
+
+    // writes n consecutive volumes starting at firstVolume with a single pwritev
+    int appendVolumes(const struct iovec *iov, int n, int firstVolume);
+
+    // preallocates room for expectedVolumes (grown on demand) and maps the whole file
+    int openMapped(const char *niiFilename, struct nifti_1_header hdr, int expectedVolumes);
+
+    // location of volume volumeIndex (1-based) inside the mapping, NULL on failure
+    unsigned char *volumeData(int volumeIndex);
+
+    // flushes the volume range and raises dim[4], the mapped counterpart of appendVolume
+    int publishVolume(int volumeIndex);
+
+    int closeSeries();
+    int isOpen() { return fd >= 0; };
+    int volumes() { return numVolumes; };
+    const char *name() { return fileName.c_str(); };
+
+    NiftiSeries() { fd = -1; mappedHdr = NULL; mapBase = NULL; mapBytes = 0; volumeBytes = 0; numVolumes = 0; };
+    ~NiftiSeries() { closeSeries(); };
+};
+
+#endif /* niftiSeries_h */
@@ -0,0 +1,338 @@
+//
+//  niftiWriter.cpp
+//
+//  Writes finished volumes on a separate thread so the polling loop never
+//  waits on the output filesystem.
+//
+
+#include "niftiWriter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <chrono>
+
+int JobQueue::push(VolumeJob *job)
+{
+    unsigned int t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= writerQueueSize)
+       return 1; // full
+    slots[t & (writerQueueSize-1)] = job;
+    tail.store(t+1, std::memory_order_release);
+    return 0;
+}
+
+VolumeJob *JobQueue::pop()
+{
+    unsigned int h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+       return NULL;
+    VolumeJob *job = slots[h & (writerQueueSize-1)];
+    head.store(h+1, std::memory_order_release);
+    return job;
+}
+
+NiftiWriter::NiftiWriter()
+{
+    running = false;
+    submitted = 0;
+    written = 0;
+    failures = 0;
+    stalls = 0;
+    lastLatency = 0;
+    maxLatency = 0;
+    totalLatency = 0;
+    maxBatch = 4;
+    publisher = NULL;
+    metrics = NULL;
+}
+
+NiftiWriter::~NiftiWriter()
+{
+    stop();
+    VolumeJob *job;
+    while ((job = done.pop()) != NULL)
+       spare.push_back(job);
+    for (int i = 0; i < spare.size(); i++)
+    {
+       free(spare[i]->buffer);
+       delete spare[i];
+    }
+}
+
+int NiftiWriter::start()
+{
+    if (running)
+       return 0;
+    running = true;
+    worker = std::thread(&NiftiWriter::run, this);
+    return 0;
+}
+
+int NiftiWriter::stop()
+{
+    if (!running)
+       return 0;
+    flush();
+    running = false;
+    wake.notify_one();
+    worker.join();
+    return 0;
+}
+
+int NiftiWriter::flush()
+{
+    while (running && (backlog() > 0))
+    {
+       drainOverflow();
+       wake.notify_one();
+       std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return 0;
+}
+
+VolumeJob *NiftiWriter::getJob(size_t bytes)
+{
+    VolumeJob *job;
+    drainOverflow();
+    while ((job = done.pop()) != NULL)
+       spare.push_back(job);
+
+    if (spare.size() > 0)
+    {
+       job = spare.back();
+       spare.pop_back();
+    }
+    else
+    {
+       // pool exhausted means the writer is behind: grow instead of waiting for it
+       job = new VolumeJob;
+       job->buffer = NULL;
+       job->capacity = 0;
+       job->slabsQueued = 0;
+    }
+    if (job->capacity < bytes)
+    {
+       free(job->buffer);
+       job->buffer = (unsigned char *)malloc(bytes);
+       job->capacity = bytes;
+    }
+    job->data = job->buffer;
+    job->bytes = bytes;
+    job->series = NULL;
+    job->owner = NULL;
+    job->filename[0] = 0;
+    return job;
+}
+
+VolumeJob *NiftiWriter::getSlabJob(VolumeJob *owner)
+{
+    VolumeJob *job = getJob(0);
+    job->owner = owner;
+    owner->slabsQueued++;
+    return job;
+}
+
+void NiftiWriter::recycle(VolumeJob *job)
+{
+    // a series that ends mid volume may still have slabs of it queued
+    while ((job->slabsQueued > 0) && running)
+    {
+       drainOverflow();
+       wake.notify_one();
+       std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    spare.push_back(job);
+}
+
+int NiftiWriter::submit(VolumeJob *job)
+{
+    job->queuedTime = MonoTime()*1000;
+    job->traceSeries = tracer.series();
+    overflow.push_back(job);
+    if (drainOverflow() <= writerMaxOverflow)
+       return 0;
+    // the disk is stalled: waiting here bounds the memory held by queued volumes
+    stalls++;
+    while ((drainOverflow() > writerMaxOverflow) && running)
+    {
+       wake.notify_one();
+       std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return 0;
+}
+
+int NiftiWriter::drainOverflow()
+{
+    int queued = 0;
+    while ((overflow.size() > 0) && (pending.push(overflow.front()) == 0))
+    {
+       overflow.pop_front();
+       submitted++;
+       queued++;
+    }
+    if (queued > 0)
+    {
+       {
+          std::lock_guard<std::mutex> lock(wakeMutex);
+       }
+       wake.notify_one();
+    }
+    return overflow.size();
+}
+
+int NiftiWriter::writeFile(VolumeJob *job)
+{
+    // same layout as sFTPGE::saveNifti, header, pad and voxels in a single writev
+    char fname[2048], tmpname[2048];
+    snprintf(fname, sizeof(fname), "%s.nii", job->filename);
+    tempName(fname, tmpname, sizeof(tmpname));
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+       return 1;
+
+    job->hdr.vox_offset = niftiVoxOffset;
+    uint32_t pad = 0;
+    struct iovec iov[3];
+    iov[0].iov_base = &job->hdr;
+    iov[0].iov_len = sizeof(job->hdr);
+    iov[1].iov_base = &pad;
+    iov[1].iov_len = sizeof(pad);
+    iov[2].iov_base = job->data;
+    iov[2].iov_len = job->bytes;
+    // large volumes may go out in several calls, continue where the last one stopped
+    struct iovec *next = iov;
+    int left = 3;
+    int rc = 0;
+    while (left > 0)
+    {
+       ssize_t n = writev(fd, next, left);
+       if (n < 0)
+       {
+          if (errno == EINTR) continue;
+          rc = 1;
+          break;
+       }
+       if (n == 0)
+       {
+          rc = 1;
+          break;
+       }
+       while ((left > 0) && ((size_t)n >= next->iov_len))
+       {
+          n -= next->iov_len;
+          next++;
+          left--;
+       }
+       if (left > 0)
+       {
+          next->iov_base = (char *)next->iov_base + n;
+          next->iov_len -= n;
+       }
+    }
+    close(fd);
+    if (rc != 0)
+    {
+       unlink(tmpname);
+       return 1;
+    }
+    return (rename(tmpname, fname) != 0);
+}
+
+int NiftiWriter::writeBatch(VolumeJob **jobs, int n)
+{
+    if (jobs[0]->series == NULL)
+       return writeFile(jobs[0]);
+
+    NiftiSeries *series = jobs[0]->series;
+    if (!series->isOpen())
+    {
+       if (series->openSeries(jobs[0]->filename, jobs[0]->hdr) != 0)
+          return 1;
+    }
+    if (n == 1)
+       return series->appendVolume(jobs[0]->data, jobs[0]->volumeIndex);
+
+    struct iovec iov[writerQueueSize];
+    for (int i = 0; i < n; i++)
+    {
+       iov[i].iov_base = jobs[i]->data;
+       iov[i].iov_len = jobs[i]->bytes;
+    }
+    return series->appendVolumes(iov, n, jobs[0]->volumeIndex);
+}
+
+void NiftiWriter::run()
+{
+    VolumeJob *batch[writerQueueSize];
+    VolumeJob *carry = NULL; // popped but not part of the previous batch
+    tracer.nameThread("writer");
+    while (running || (pending.size() > 0) || (carry != NULL))
+    {
+       VolumeJob *job = carry;
+       carry = NULL;
+       if (job == NULL)
+          job = pending.pop();
+       if (job == NULL)
+       {
+          std::unique_lock<std::mutex> lock(wakeMutex);
+          if (running && (pending.size() == 0))
+             wake.wait_for(lock, std::chrono::milliseconds(10));
+          continue;
+       }
+
+       // consecutive volumes of the same 4D file go out in one call
+       int n = 1;
+       batch[0] = job;
+       while ((job->series != NULL) && (n < maxBatch))
+       {
+          VolumeJob *next = pending.pop();
+          if (next == NULL)
+             break;
+          if ((next->series != job->series) || (next->volumeIndex != batch[n-1]->volumeIndex+1))
+          {
+             carry = next;
+             break;
+          }
+          batch[n++] = next;
+       }
+
+       tracer.setSeries(batch[0]->traceSeries);
+       double writeStart = MonoTime();
+       int rc = writeBatch(batch, n);
+       tracer.span("writeNifti", writeStart, MonoTime(), 0, batch[0]->volumeIndex);
+       if (rc != 0)
+          failures += n;
+
+       double now = MonoTime()*1000;
+       for (int i = 0; i < n; i++)
+       {
+          double latency = now - batch[i]->queuedTime;
+          if (metrics != NULL)
+             metrics->record(metricWriter, latency/1000);
+          lastLatency = latency;
+          totalLatency = totalLatency + latency;
+          if (latency > maxLatency)
+             maxLatency = latency;
+          if ((rc == 0) && (publisher != NULL))
+          {
+             char fname[2048];
+             snprintf(fname, sizeof(fname), "%s.nii", batch[i]->filename);
+             publisher->published(fname, batch[i]->volumeIndex);
+          }
+          if (batch[i]->owner != NULL)
+          {
+             batch[i]->owner->slabsQueued--;
+             batch[i]->owner = NULL;
+          }
+          if (done.push(batch[i]) != 0)
+          {
+             free(batch[i]->buffer);
+             delete batch[i];
+          }
+          written++;
+       }
+    }
+}
@@ -0,0 +1,108 @@
+//
+//  niftiWriter.h
+//
+//  Writes finished volumes on a separate thread so the polling loop never
+//  waits on the output filesystem.
+//
+
+#ifndef niftiWriter_h
+#define niftiWriter_h
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include "niftiSeries.h"
+#include "volumePublisher.h"
+#include "metrics.h"
+#include "traceEvents.h"
+
+#define writerQueueSize 64 // power of two
+#define writerMaxOverflow 64 // volumes kept aside past a full queue before submit waits for the disk
+
+struct VolumeJob
+{
+    char filename[1024];          // without .nii
+    struct nifti_1_header hdr;
+    unsigned char *data;          // voxels to write, usually buffer
+    size_t bytes;
+    int volumeIndex;
+    NiftiSeries *series;          // append to this 4D file instead of writing filename
+    double queuedTime;            // MonoTime() at submit, in ms
+    int traceSeries;              // series of the submitting thread, for the writer spans
+    unsigned char *buffer;        // owned volume buffer, returned to the pool with the job
+    size_t capacity;
+    VolumeJob *owner;             // volume a slab job points into, NULL for whole volumes
+    std::atomic<int> slabsQueued; // slab jobs still pointing into buffer
+};
+
+// bounded single producer / single consumer ring of job pointers
+class JobQueue
+{
+    VolumeJob *slots[writerQueueSize];
+    std::atomic<unsigned int> head; // next slot to pop
+    std::atomic<unsigned int> tail; // next slot to push
+public:
+    int push(VolumeJob *job);
+    VolumeJob *pop();
+    unsigned int size() { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); };
+    JobQueue() { head = 0; tail = 0; };
+};
+
+class NiftiWriter
+{
+    std::thread worker;
+    std::atomic<bool> running;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    JobQueue pending;            // ingest -> writer
+    JobQueue done;               // writer -> ingest, jobs back to the pool
+    vector<VolumeJob *> spare;   // ingest side only
+    deque<VolumeJob *> overflow; // ingest side only, jobs waiting for room in the queue
+
+    std::atomic<unsigned int> submitted, written;
+    std::atomic<long> failures;
+    unsigned long stalls;        // ingest side only, submits that waited for the writer
+    std::atomic<double> lastLatency, maxLatency, totalLatency;
+
+    void run();
+    int writeBatch(VolumeJob **jobs, int n);
+    int writeFile(VolumeJob *job);
+public:
+    int maxBatch; // volumes gathered into one writev when appending to a 4D file
+    VolumePublisher *publisher; // notified after each job is on disk, may be NULL
+    MetricsRegistry *metrics;   // queue + write time per volume, may be NULL
+
+    int start();
+    int stop();  // drains the queue and joins the thread
+    int flush(); // waits until every submitted job is written
+    int isRunning() { return running; };
+
+    // a job with a buffer of at least bytes, never blocks
+    VolumeJob *getJob(size_t bytes);
+    // a job that points into the buffer of owner, which is kept until the slab is written
+    VolumeJob *getSlabJob(VolumeJob *owner);
+    // back to the pool once the slabs pointing into its buffer are written
+    void recycle(VolumeJob *job);
+
+    // hands the job to the writer thread, keeping it aside if the queue is full;
+    // waits for the writer once writerMaxOverflow volumes are kept aside
+    int submit(VolumeJob *job);
+    int drainOverflow();
+
+    // metrics
+    unsigned int backlog() { return submitted - written + overflow.size(); };
+    unsigned int volumesWritten() { return written; };
+    long writeFailures() { return failures; };
+    unsigned long submitStalls() { return stalls; };
+    double lastLatencyMs() { return lastLatency; };
+    double maxLatencyMs() { return maxLatency; };
+    double meanLatencyMs() { return (written > 0) ? totalLatency / written : 0; };
+
+    NiftiWriter();
+    ~NiftiWriter();
+};
+
+#endif /* niftiWriter_h */
@@ -0,0 +1,203 @@
+//
+//  parserBench.cpp
+//
+//  Microbenchmark of the per slice work: isDICOMfile, readDICOMv,
+//  headerDcm2Nii, the copy of the slice pixels into the volume and
+//  sFTPGE::saveNifti, each timed alone on every file of a corpus (GE,
+//  Siemens mosaic, Philips enhanced, compressed, ...). Cold runs evict the
+//  CPU caches before every call, warm runs repeat the call on hot caches.
+//  Reports ns/op, MB/s and allocations (malloc/calloc/realloc) per call.
+//
+//  parserBench [-n iterations] [-cold n] [-out results.tsv] file|folder ...
+//
+
+#include "sftp.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+int isDICOMfile(stringstream &filemem);
+
+// every allocation of the process goes through here, libstdc++ included
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+static unsigned long allocations = 0;
+extern "C" void *malloc(size_t size) { allocations++; return __libc_malloc(size); }
+extern "C" void *calloc(size_t n, size_t size) { allocations++; return __libc_calloc(n, size); }
+extern "C" void *realloc(void *p, size_t size) { allocations++; return __libc_realloc(p, size); }
+
+#define evictBytes (64*1024*1024)
+
+static unsigned char *evictBuffer = NULL;
+
+// larger than the last level cache, the next call starts cold
+static void evictCaches()
+{
+    if (evictBuffer == NULL)
+       evictBuffer = (unsigned char *)__libc_malloc(evictBytes);
+    for (size_t i = 0; i < evictBytes; i += 64)
+       evictBuffer[i]++;
+}
+
+struct BenchResult
+{
+    double ns;      // per call
+    double bytes;   // per call, for MB/s
+    double allocs;  // per call
+};
+
+// op runs once per call, cold evicts the caches before each one (outside the timing)
+template <class Op> static BenchResult measure(Op op, int calls, int cold, double bytes)
+{
+    BenchResult r;
+    double total = 0;
+    unsigned long allocated = 0;
+    if (!cold)
+       op(); // warm up
+    for (int i = 0; i < calls; i++)
+    {
+       if (cold)
+          evictCaches();
+       unsigned long before = allocations;
+       double start = MonoTime();
+       op();
+       total += MonoTime()-start;
+       allocated += allocations-before;
+    }
+    r.ns = total*1e9/calls;
+    r.bytes = bytes;
+    r.allocs = (double)allocated/calls;
+    return r;
+}
+
+static const char *manufacturerName(int manufacturer)
+{
+    switch (manufacturer)
+    {
+       case kMANUFACTURER_GE: return "GE";
+       case kMANUFACTURER_SIEMENS: return "Siemens";
+       case kMANUFACTURER_PHILIPS: return "Philips";
+       default: return "other";
+    }
+}
+
+static void addFiles(const string &path, vector<string> &files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+       return;
+    if (!S_ISDIR(st.st_mode))
+    {
+       files.push_back(path);
+       return;
+    }
+    DIR *dp = opendir(path.c_str());
+    if (dp == NULL)
+       return;
+    struct dirent *dirp;
+    vector<string> names;
+    while ((dirp = readdir(dp)) != NULL)
+       if (dirp->d_name[0] != '.')
+          names.push_back(path + "/" + dirp->d_name);
+    closedir(dp);
+    sort(names.begin(), names.end());
+    for (int i = 0; i < names.size(); i++)
+       addFiles(names[i], files);
+}
+
+static void report(FILE *out, const string &file, const string &kind, const char *function, const char *mode, BenchResult r)
+{
+    double mbs = (r.ns > 0) ? r.bytes / r.ns * 1e9 / (1024*1024) : 0;
+    printf("%-40s %-22s %-13s %-5s %12.0f %10.1f %8.1f\n", file.substr((file.size() > 40) ? file.size()-40 : 0).c_str(), kind.c_str(), function, mode, r.ns, mbs, r.allocs);
+    if (out != NULL)
+       fprintf(out, "%s\t%s\t%s\t%s\t%.0f\t%.3f\t%.2f\n", file.c_str(), kind.c_str(), function, mode, r.ns, mbs, r.allocs);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 200, coldCalls = 10;
+    string outName;
+    vector<string> files;
+    for (int a = 1; a < argc; a++)
+    {
+       if ((!strcmp(argv[a], "-n")) && (a+1 < argc))
+          iterations = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-cold")) && (a+1 < argc))
+          coldCalls = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-out")) && (a+1 < argc))
+          outName = argv[++a];
+       else addFiles(argv[a], files);
+    }
+    if ((files.size() == 0) || (iterations < 1))
+    {
+       fprintf(stderr, "usage: %s [-n iterations] [-cold n] [-out results.tsv] file|folder ...\n", argv[0]);
+       return 1;
+    }
+    FILE *out = NULL;
+    if ((outName != "") && ((out = fopen(outName.c_str(), "w")) != NULL))
+       fprintf(out, "file\tkind\tfunction\tmode\tns_per_op\tMB_per_s\tallocs_per_call\n");
+
+    char tmpDir[] = "/tmp/parserBenchXXXXXX";
+    if (mkdtemp(tmpDir) == NULL)
+       return 2;
+    sFTPGE ge(NULL);
+    struct TDCMopts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.isOnlySingleFile = true;
+
+    printf("%-40s %-22s %-13s %-5s %12s %10s %8s\n", "file", "kind", "function", "mode", "ns/op", "MB/s", "allocs");
+    for (int f = 0; f < files.size(); f++)
+    {
+       stringstream filemem;
+       if (ge._getFile(files[f], filemem) != 0)
+          continue;
+       filemem.seekg(0, filemem.end);
+       double fileBytes = filemem.tellg();
+       filemem.seekg(0);
+       if (isDICOMfile(filemem) == 0)
+          continue;
+
+       TDTI4D dti4D;
+       filemem.clear();
+       filemem.seekg(0);
+       struct TDICOMdata d = readDICOMv(filemem, 0, 0, &dti4D);
+       struct nifti_1_header hdr;
+       int haveHeader = (headerDcm2Nii(d, &hdr, false) != EXIT_FAILURE);
+       size_t imgsz = haveHeader ? nii_ImgBytes(hdr) : 0;
+       string kind = manufacturerName(d.manufacturer);
+       if (d.CSA.mosaicSlices > 1)
+          kind += " mosaic";
+       if (d.xyzDim[3] > 1)
+          kind += " multiframe";
+       if (d.compressionScheme != 0)
+          kind += " compressed";
+       int pixelsInFile = (d.compressionScheme == 0) && (imgsz > 0) && (d.imageStart > 0) && (d.imageStart+imgsz <= fileBytes);
+
+       for (int cold = 0; cold < 2; cold++)
+       {
+          int calls = cold ? coldCalls : iterations;
+          const char *mode = cold ? "cold" : "warm";
+          if (calls < 1)
+             continue;
+          report(out, files[f], kind, "isDICOMfile", mode, measure([&]() { filemem.clear(); filemem.seekg(0); isDICOMfile(filemem); }, calls, cold, fileBytes));
+          report(out, files[f], kind, "readDICOMv", mode, measure([&]() { filemem.clear(); filemem.seekg(0); readDICOMv(filemem, 0, 0, &dti4D); }, calls, cold, fileBytes));
+          if (!haveHeader)
+             continue;
+          report(out, files[f], kind, "headerDcm2Nii", mode, measure([&]() { struct nifti_1_header h; headerDcm2Nii(d, &h, false); }, calls, cold, 0));
+          if (!pixelsInFile)
+             continue;
+          // the same copy downloadFileList does into the last slice of the volume
+          vector<unsigned char> volume(imgsz);
+          report(out, files[f], kind, "sliceCopy", mode, measure([&]() { filemem.clear(); filemem.seekg(d.imageStart); filemem.read((char *)&volume[0], imgsz); }, calls, cold, imgsz));
+          char niiName[1024];
+          snprintf(niiName, sizeof(niiName), "%s/bench", tmpDir);
+          report(out, files[f], kind, "saveNifti", mode, measure([&]() { ge.saveNifti(niiName, hdr, &volume[0], opts); }, calls, cold, imgsz+352));
+       }
+    }
+    string cleanup = string("rm -rf ") + tmpDir;
+    if (system(cleanup.c_str()) != 0)
+       fprintf(stderr, "Could not remove %s\n", tmpDir);
+    if (out != NULL)
+       fclose(out);
+    return 0;
+}
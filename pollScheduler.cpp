@@ -0,0 +1,110 @@
+//
+//  pollScheduler.cpp
+//
+//  TR-adaptive polling of the series folder.
+//
+
+#include "pollScheduler.h"
+
+#define arrivalWeight 0.25 // weight of a new observation in the arrival interval
+#define idlePolls 8        // polls at the base interval before backing off, series unknown
+
+void PollScheduler::reset(double baseInterval)
+{
+    base = baseInterval;
+    TR = 0;
+    arrivalInterval = 0;
+    lastArrival = 0;
+    lastPoll = 0;
+    idleSince = 0;
+    emptyPolls = 0;
+    polls = 0;
+}
+
+void PollScheduler::setAcquisition(double seriesTR, int slices)
+{
+    if ((seriesTR > 0) && (slices > 0) && (TR == 0))
+    {
+       TR = seriesTR;
+       if (arrivalInterval == 0)
+          arrivalInterval = TR / slices;
+    }
+}
+
+void PollScheduler::observed(int newSlices, double now)
+{
+    polls++;
+    if (newSlices <= 0)
+    {
+       if (emptyPolls == 0)
+          idleSince = now;
+       emptyPolls++;
+       lastPoll = now;
+       return;
+    }
+    // the slice landed between the previous poll and this one; only a tight pair dates it
+    double arrival = now;
+    if ((emptyPolls > 0) && (now-lastPoll > 2*minInterval))
+       arrival = (now+lastPoll)/2;
+    else if ((emptyPolls == 0) && (lastArrival > 0))
+    {
+       // found on the first try, the prediction is late: move it earlier until a poll misses
+       double lead = arrivalInterval*0.1;
+       if (lead < minInterval)
+          lead = minInterval;
+       arrival = now-lead;
+       if (arrival < lastPoll)
+          arrival = lastPoll;
+    }
+    if (lastArrival > 0)
+    {
+       double gap = arrival-lastArrival;
+       double longest = 4*arrivalInterval;
+       if (longest < 1.5*TR)
+          longest = 1.5*TR;
+       // gaps between runs or after a stall say nothing about the acquisition
+       if ((arrivalInterval == 0) || ((gap > 2*arrivalInterval) && (gap < longest)))
+          arrivalInterval = gap; // slices come in bursts (whole volumes), not one by one
+       else if (gap < longest)
+          arrivalInterval += arrivalWeight*(gap-arrivalInterval);
+    }
+    lastArrival = arrival;
+    lastPoll = now;
+    emptyPolls = 0;
+}
+
+double PollScheduler::nextPoll()
+{
+    double idle, shortest;
+    if ((arrivalInterval > 0) && (lastArrival > 0))
+    {
+       double expected = lastArrival + arrivalInterval;
+       double lead = arrivalInterval*0.1;
+       if (lead < minInterval)
+          lead = minInterval;
+       // asleep until the next arrival is about to land
+       if (lastPoll < expected-lead)
+          return expected-lead;
+       // tight polling around it
+       double step = lead/4;
+       if (step < minInterval)
+          step = minInterval;
+       if (lastPoll < expected+lead)
+          return lastPoll+step;
+       idle = lastPoll-(expected+lead);
+       shortest = minInterval;
+    }
+    else
+    {
+       if (emptyPolls < idlePolls)
+          return lastPoll+base;
+       idle = lastPoll-idleSince;
+       shortest = base;
+    }
+    // idle: waiting as long again as the silence so far doubles the interval each poll
+    if (idle < shortest)
+       idle = shortest;
+    if (idle > maxInterval)
+       idle = maxInterval;
+    return lastPoll+idle;
+}
@@ -0,0 +1,40 @@
+//
+//  pollScheduler.h
+//
+//  When to list the series folder next. The time between arrivals starts as
+//  TR over the slices per volume and follows what the listings see (one
+//  slice at a time, or whole volumes at once); the scheduler sleeps until
+//  just before the next expected arrival, polls tightly around it, and
+//  backs off exponentially once slices stop coming.
+//
+
+#ifndef pollScheduler_h
+#define pollScheduler_h
+
+class PollScheduler
+{
+    double base;            // interval while nothing is known about the series
+    double TR;              // seconds, 0 if unknown
+    double arrivalInterval; // seconds between listings that find new slices, 0 if unknown
+    double lastArrival;     // when new slices were last seen
+    double lastPoll;
+    double idleSince;       // first empty poll after the last arrival
+    int emptyPolls;         // since the last arrival
+public:
+    double minInterval; // polling around an expected arrival
+    double maxInterval; // longest sleep while idle
+    unsigned long polls;
+
+    void reset(double baseInterval);
+    // TR in seconds and slices per volume, from the first slice header
+    void setAcquisition(double seriesTR, int slices);
+    // result of a listing made at now
+    void observed(int newSlices, double now);
+    // absolute time (GetWallTime) of the next listing
+    double nextPoll();
+    double interval() { return arrivalInterval; };
+
+    PollScheduler() { minInterval = 0.005; maxInterval = 1.0; reset(0.1); };
+};
+
+#endif /* pollScheduler_h */
@@ -0,0 +1,209 @@
+//
+//  pushAgent.cpp
+//
+//  Runs on the console. Watches the image folder with inotify and streams
+//  every completed slice over one persistent TCP connection to the
+//  converter started with -push, instead of the converter polling it.
+//
+//  pushAgent host port watchedFolder
+//
+
+#include "pushReceiver.h"
+#include "dicomNet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define catchUpSettle 50 // ms a caught up file must keep its size and mtime before it is sent
+
+static map<int, string> watches; // watch descriptor -> folder relative to the root
+static string rootDir;
+
+// catchUp collects the files written in a new folder before its watch was in place
+static void addWatch(int inotifyFd, const string &relative, vector<string> *catchUp)
+{
+    string path = (relative.size() > 0) ? rootDir + "/" + relative : rootDir;
+    int wd = inotify_add_watch(inotifyFd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0)
+       return;
+    watches[wd] = relative;
+
+    DIR *dp = opendir(path.c_str());
+    if (dp == NULL)
+       return;
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL)
+    {
+       if (dirp->d_name[0] == '.')
+          continue;
+       string child = (relative.size() > 0) ? relative + "/" + dirp->d_name : string(dirp->d_name);
+       if (dirp->d_type == DT_DIR)
+          addWatch(inotifyFd, child, catchUp);
+       else if (catchUp != NULL)
+          catchUp->push_back(child);
+    }
+    closedir(dp);
+}
+
+static int connectTo(const char *host, int port)
+{
+    while (1)
+    {
+       int sock = socket(AF_INET, SOCK_STREAM, 0);
+       struct sockaddr_in addr;
+       memset(&addr, 0, sizeof(addr));
+       addr.sin_family = AF_INET;
+       addr.sin_port = htons(port);
+       addr.sin_addr.s_addr = inet_addr(host);
+       if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+       {
+          int on = 1;
+          setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+          int sndbuf = 4*1024*1024;
+          setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+          fprintf(stderr, "connected to %s:%d\n", host, port);
+          return sock;
+       }
+       close(sock);
+       sleep(1);
+    }
+}
+
+static int sendSlice(int sock, const string &relative)
+{
+    string path = rootDir + "/" + relative;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+       return 0; // gone already, not a connection problem
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode))
+    {
+       close(fd);
+       return 0;
+    }
+
+    PushFrame frame;
+    frame.magic = pushMagic;
+    frame.nameBytes = relative.size();
+    frame.mtime = st.st_mtime;
+    frame.dataBytes = st.st_size;
+    string header((const char *)&frame, sizeof(frame));
+    header += relative;
+    int rc = sendFully(sock, header.data(), header.size());
+
+    // file contents go from the page cache to the socket without a user space copy
+    off_t offset = 0;
+    while ((rc == 0) && (offset < st.st_size))
+    {
+       ssize_t n = sendfile(sock, fd, &offset, st.st_size - offset);
+       if (n < 0)
+       {
+          if (errno == EINTR) continue;
+          rc = -1;
+       }
+       else if (n == 0)
+          rc = -1; // truncated while sending, the frame is broken
+    }
+    close(fd);
+    return rc;
+}
+
+// drops the caught up files the console may still be writing: their IN_CLOSE_WRITE comes
+// later, since the watch was in place before the folder was read
+static void settled(vector<string> &files)
+{
+    if (files.size() == 0)
+       return;
+    vector<struct stat> before(files.size());
+    for (int i = 0; i < files.size(); i++)
+       if (stat((rootDir + "/" + files[i]).c_str(), &before[i]) != 0)
+          before[i].st_size = -1;
+    struct timespec wait = { 0, catchUpSettle*1000000L };
+    nanosleep(&wait, NULL);
+    vector<string> kept;
+    for (int i = 0; i < files.size(); i++)
+    {
+       struct stat after;
+       if ((before[i].st_size < 0) || (stat((rootDir + "/" + files[i]).c_str(), &after) != 0))
+          continue;
+       if ((after.st_size == before[i].st_size) && (after.st_mtim.tv_sec == before[i].st_mtim.tv_sec) &&
+           (after.st_mtim.tv_nsec == before[i].st_mtim.tv_nsec))
+          kept.push_back(files[i]);
+    }
+    files.swap(kept);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+       fprintf(stderr, "usage: %s host port watchedFolder\n", argv[0]);
+       return 1;
+    }
+    rootDir = argv[3];
+    // a converter that closes the connection must not end the agent, the send fails and it reconnects
+    signal(SIGPIPE, SIG_IGN);
+    int inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0)
+    {
+       fprintf(stderr, "inotify unavailable\n");
+       return 2;
+    }
+    addWatch(inotifyFd, "", NULL); // slices already on disk are not sent
+    int sock = connectTo(argv[1], atoi(argv[2]));
+
+    char events[64*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (1)
+    {
+       ssize_t len = read(inotifyFd, events, sizeof(events));
+       if (len <= 0)
+       {
+          if ((len < 0) && (errno == EINTR)) continue;
+          break;
+       }
+       for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+       {
+          struct inotify_event *event = (struct inotify_event *)p;
+          if ((event->len == 0) || (event->name[0] == '.') || (watches.find(event->wd) == watches.end()))
+             continue;
+          string relative = (watches[event->wd].size() > 0) ? watches[event->wd] + "/" + event->name : string(event->name);
+          vector<string> slices;
+          if (event->mask & IN_ISDIR)
+          {
+             if (event->mask & (IN_CREATE | IN_MOVED_TO))
+             {
+                addWatch(inotifyFd, relative, &slices);
+                settled(slices);
+             }
+          }
+          // IN_CLOSE_WRITE: the writer is done with the slice, IN_MOVED_TO: renamed into place
+          else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+             slices.push_back(relative);
+          for (int i = 0; i < slices.size(); i++)
+          {
+             while (sendSlice(sock, slices[i]) != 0)
+             {
+                close(sock);
+                sock = connectTo(argv[1], atoi(argv[2]));
+             }
+          }
+       }
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,104 @@
+//
+//  pushReceiver.cpp
+//
+//  Receiving end of pushAgent.
+//
+
+#include "pushReceiver.h"
+#include "dicomNet.h"
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+int PushReceiver::start()
+{
+    if (running || (store == NULL) || (port <= 0))
+       return 1;
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+       return 2;
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listenFd, 4) != 0))
+    {
+       close(listenFd);
+       listenFd = -1;
+       return 3;
+    }
+    running = true;
+    worker = std::thread(&PushReceiver::run, this);
+    return 0;
+}
+
+void PushReceiver::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    worker.join();
+    close(listenFd);
+    listenFd = -1;
+}
+
+int PushReceiver::readFrames(int fd)
+{
+    while (running)
+    {
+       // wait for the next frame without blocking stop() on an idle connection
+       struct pollfd p;
+       p.fd = fd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 200) == 0)
+          continue;
+       PushFrame frame;
+       if (readFully(fd, &frame, sizeof(frame)) != 0)
+          return 0; // agent went away, it reconnects
+       if ((frame.magic != pushMagic) || (frame.nameBytes == 0) || (frame.nameBytes > pushMaxName) ||
+           (frame.dataBytes > pushMaxData))
+          return 1; // the connection is dropped, nothing is allocated for it
+       string name(frame.nameBytes, '\0');
+       string data(frame.dataBytes, '\0');
+       if ((readFully(fd, &name[0], frame.nameBytes) != 0) ||
+           ((frame.dataBytes > 0) && (readFully(fd, &data[0], frame.dataBytes) != 0)))
+          return 2;
+       if (name.find("..") != string::npos)
+          continue;
+
+       size_t slash = name.rfind('/');
+       string dir = root;
+       if (slash != string::npos)
+          dir += "/" + name.substr(0, slash);
+       store->addFile(dir, name.substr((slash == string::npos) ? 0 : slash+1), data, (time_t)frame.mtime);
+       framesReceived++;
+    }
+    return 0;
+}
+
+void PushReceiver::run()
+{
+    // a single agent per console, connections are served one after the other
+    while (running)
+    {
+       struct pollfd p;
+       p.fd = listenFd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 200) <= 0)
+          continue;
+       int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+       if (fd < 0)
+          continue;
+       int rcvbuf = 4*1024*1024;
+       setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+       connections++;
+       readFrames(fd);
+       close(fd);
+    }
+}
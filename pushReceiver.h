@@ -0,0 +1,56 @@
+//
+//  pushReceiver.h
+//
+//  Receiving end of pushAgent: one persistent TCP connection from the
+//  console carrying every completed slice as a length-prefixed frame,
+//
+//     PushFrame | relative path (nameBytes) | file contents (dataBytes)
+//
+//  Slices are kept in a SliceStore under root/<relative folder>, the same
+//  layout the agent sees below its watched folder.
+//
+
+#ifndef pushReceiver_h
+#define pushReceiver_h
+
+#include <thread>
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include "sliceStore.h"
+
+using namespace std;
+
+#define pushMagic 0x48535550 // "PUSH" little-endian
+#define pushMaxName 4096
+#define pushMaxData (256ULL*1024*1024) // larger frames are taken for a broken or hostile sender
+
+struct PushFrame
+{
+    uint32_t magic;
+    uint32_t nameBytes;
+    int64_t mtime;      // seconds, mtime of the file on the console
+    uint64_t dataBytes;
+};
+
+class PushReceiver
+{
+    int listenFd;
+    std::thread worker;
+    std::atomic<bool> running;
+    void run();
+    int readFrames(int fd);
+public:
+    SliceStore *store;
+    string root;
+    int port;
+    std::atomic<unsigned long> framesReceived, connections;
+
+    int start();
+    void stop();
+
+    PushReceiver() { listenFd = -1; running = false; store = NULL; port = 0; framesReceived = 0; connections = 0; };
+    ~PushReceiver() { stop(); };
+};
+
+#endif /* pushReceiver_h */
@@ -0,0 +1,376 @@
+//
+//  scannerReplay.cpp
+//
+//  Load generator for the converter: replays a recorded series the way the
+//  console writes it, on an absolute CLOCK_MONOTONIC schedule so delays do
+//  not accumulate. Slices are acquired in multiband groups every TR/(slices/mb),
+//  delivered in bursts after a reconstruction delay plus jitter, and written
+//  in place, through a rename, or in slow chunks. The target is a folder (the
+//  converter in mode 1, or in mode 2 when sshd serves it) or a dicomFTP -push
+//  receiver. Every slice is reported with its scheduled and written times.
+//
+//  scannerReplay [options] recordedSeriesDir targetSeriesDir
+//     -tr s             repetition time (2.0)
+//     -slices n         slices per volume (40)
+//     -mb n             slices acquired together (1)
+//     -burst n          slices delivered together, n = slices for whole volumes (1)
+//     -recon ms         acquisition to file write (0)
+//     -jitter kind:ms   none, uniform:max, normal:sd (half normal), exp:mean
+//     -write mode       atomic (temporary name above the series folder and rename), direct, chunked:bytes:ms
+//     -volumes n        stop after n volumes (all)
+//     -push host port   send frames to dicomFTP -push, targetSeriesDir is the folder below its root (exam/series)
+//     -seed n           jitter random seed
+//     -log file         tab separated slice timings (stdout)
+//
+
+#include "pushReceiver.h"
+#include "dicomNet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <random>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+struct RecordedSlice
+{
+    string name;
+    int volume, slice; // order key, MRDC number or Flyview volume/slice
+};
+
+static bool sliceOrder(const RecordedSlice &a, const RecordedSlice &b)
+{
+    if (a.volume != b.volume)
+       return a.volume < b.volume;
+    return a.slice < b.slice;
+}
+
+// i<ms>.MRDC.<n> sorts by n, Flyview <...>.<volume>.<slice>.<ext> by volume then slice
+static int sliceKey(const char *name, RecordedSlice &slice)
+{
+    vector<string> tokens;
+    string token;
+    for (const char *p = name; ; p++)
+    {
+       if ((*p == '.') || (*p == 0))
+       {
+          tokens.push_back(token);
+          token = "";
+          if (*p == 0) break;
+       }
+       else token += *p;
+    }
+    slice.name = name;
+    if (strstr(name, "MRDC") != NULL)
+    {
+       slice.volume = 0;
+       slice.slice = atoi(tokens.back().c_str());
+       return 0;
+    }
+    if (tokens.size() < 3)
+       return 1;
+    slice.volume = atoi(tokens[tokens.size()-3].c_str());
+    slice.slice = atoi(tokens[tokens.size()-2].c_str());
+    return 0;
+}
+
+static double monoNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void sleepUntil(double when)
+{
+    struct timespec at;
+    at.tv_sec = (time_t)when;
+    at.tv_nsec = (long)((when - at.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+       ;
+}
+
+static long long wallMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+static int readFile(const string &path, string &bytes)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+       return 1;
+    char buf[65536];
+    size_t n;
+    bytes.clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+       bytes.append(buf, n);
+    fclose(fp);
+    return 0;
+}
+
+// end of the multiband group of slice s, seconds from the series start
+static double acquiredAt(size_t s, int nSlices, int mb, double TR)
+{
+    double groupTime = TR / (nSlices / mb);
+    return (double)(s / nSlices)*TR + (double)((s % nSlices) / mb + 1)*groupTime;
+}
+
+struct WriteMode
+{
+    int kind; // 0 atomic, 1 direct, 2 chunked
+    size_t chunkBytes;
+    double chunkPause;
+};
+
+// temporary name in the folder above the series: same filesystem for the rename, and the
+// converter polling the series folder never lists a half written file under a name of its own
+static string stagingPath(const string &dir, const string &name)
+{
+    size_t end = dir.find_last_not_of('/');
+    size_t slash = (end == string::npos) ? string::npos : dir.rfind('/', end);
+    string parent = (slash == string::npos) ? string(".") : (slash == 0) ? string("/") : dir.substr(0, slash);
+    return parent + "/." + name + ".tmp";
+}
+
+static int writeSlice(const string &dir, const string &name, const string &bytes, WriteMode &mode)
+{
+    string path = dir + "/" + name;
+    string target = (mode.kind == 0) ? stagingPath(dir, name) : path;
+    int fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+       return 1;
+    int rc = 0;
+    if (mode.kind == 2)
+    {
+       // the converter sees the file growing, like a slow reconstruction write
+       for (size_t done = 0; (rc == 0) && (done < bytes.size()); done += mode.chunkBytes)
+       {
+          if (done > 0)
+             sleepUntil(monoNow() + mode.chunkPause);
+          rc = writeFully(fd, bytes.data()+done, min(mode.chunkBytes, bytes.size()-done));
+       }
+    }
+    else
+       rc = writeFully(fd, bytes.data(), bytes.size());
+    close(fd);
+    if ((rc == 0) && (mode.kind == 0))
+       rc = rename(target.c_str(), path.c_str());
+    return rc;
+}
+
+static int connectTo(const char *host, int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+       close(sock);
+       return -1;
+    }
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+static int pushSlice(int sock, const string &relative, const string &bytes)
+{
+    PushFrame frame;
+    frame.magic = pushMagic;
+    frame.nameBytes = relative.size();
+    frame.mtime = time(NULL);
+    frame.dataBytes = bytes.size();
+    string header((const char *)&frame, sizeof(frame));
+    header += relative;
+    if (writeFully(sock, header.data(), header.size()) != 0)
+       return 1;
+    return writeFully(sock, bytes.data(), bytes.size());
+}
+
+int main(int argc, char *argv[])
+{
+    double TR = 2.0, reconMs = 0, jitterMs = 0;
+    int nSlices = 40, mb = 1, burst = 1, maxVolumes = 0, pushPort = 0;
+    unsigned int seed = 1;
+    string jitterKind = "none", pushHost, logName;
+    WriteMode mode;
+    mode.kind = 0;
+    mode.chunkBytes = 16384;
+    mode.chunkPause = 0.005;
+    vector<string> positional;
+    for (int a = 1; a < argc; a++)
+    {
+       if ((!strcmp(argv[a], "-tr")) && (a+1 < argc))
+          TR = atof(argv[++a]);
+       else if ((!strcmp(argv[a], "-slices")) && (a+1 < argc))
+          nSlices = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-mb")) && (a+1 < argc))
+          mb = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-burst")) && (a+1 < argc))
+          burst = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-recon")) && (a+1 < argc))
+          reconMs = atof(argv[++a]);
+       else if ((!strcmp(argv[a], "-jitter")) && (a+1 < argc))
+       {
+          string spec = argv[++a];
+          size_t colon = spec.find(':');
+          jitterKind = spec.substr(0, colon);
+          jitterMs = (colon != string::npos) ? atof(spec.c_str()+colon+1) : 0;
+       }
+       else if ((!strcmp(argv[a], "-write")) && (a+1 < argc))
+       {
+          string spec = argv[++a];
+          if (spec == "direct")
+             mode.kind = 1;
+          else if (spec.compare(0, 7, "chunked") == 0)
+          {
+             mode.kind = 2;
+             unsigned long bytes = 0;
+             double pauseMs = 0;
+             int fields = sscanf(spec.c_str(), "chunked:%lu:%lf", &bytes, &pauseMs);
+             if ((fields >= 1) && (bytes > 0))
+                mode.chunkBytes = bytes;
+             if (fields == 2)
+                mode.chunkPause = pauseMs / 1000;
+          }
+          else mode.kind = 0;
+       }
+       else if ((!strcmp(argv[a], "-volumes")) && (a+1 < argc))
+          maxVolumes = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-push")) && (a+2 < argc))
+       {
+          pushHost = argv[++a];
+          pushPort = atoi(argv[++a]);
+       }
+       else if ((!strcmp(argv[a], "-seed")) && (a+1 < argc))
+          seed = atoi(argv[++a]);
+       else if ((!strcmp(argv[a], "-log")) && (a+1 < argc))
+          logName = argv[++a];
+       else positional.push_back(argv[a]);
+    }
+    if ((positional.size() < 2) || (nSlices < 1) || (mb < 1) || (burst < 1) || (nSlices % mb != 0) || (TR <= 0))
+    {
+       fprintf(stderr, "usage: %s [-tr s] [-slices n] [-mb n] [-burst n] [-recon ms] [-jitter none|uniform:ms|normal:ms|exp:ms]\n"
+                       "       [-write atomic|direct|chunked:bytes:ms] [-volumes n] [-push host port] [-seed n] [-log file]\n"
+                       "       recordedSeriesDir targetSeriesDir\n", argv[0]);
+       return 1;
+    }
+    string inputDir = positional[0], outputDir = positional[1];
+
+    vector<RecordedSlice> recorded;
+    DIR *dp = opendir(inputDir.c_str());
+    if (dp == NULL)
+    {
+       fprintf(stderr, "Error opening %s\n", inputDir.c_str());
+       return 2;
+    }
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL)
+    {
+       RecordedSlice slice;
+       if ((dirp->d_name[0] != '.') && (sliceKey(dirp->d_name, slice) == 0))
+          recorded.push_back(slice);
+    }
+    closedir(dp);
+    sort(recorded.begin(), recorded.end(), sliceOrder);
+    size_t total = recorded.size();
+    if ((maxVolumes > 0) && (total > (size_t)maxVolumes*nSlices))
+       total = (size_t)maxVolumes*nSlices;
+    if (total == 0)
+    {
+       fprintf(stderr, "No slices in %s\n", inputDir.c_str());
+       return 3;
+    }
+
+    int sock = -1;
+    if (pushPort > 0)
+    {
+       sock = connectTo(pushHost.c_str(), pushPort);
+       if (sock < 0)
+       {
+          fprintf(stderr, "Unable to connect to %s:%d\n", pushHost.c_str(), pushPort);
+          return 4;
+       }
+    }
+    else mkdir(outputDir.c_str(), 0777);
+
+    FILE *log = stdout;
+    if ((logName != "") && ((log = fopen(logName.c_str(), "w")) == NULL))
+    {
+       fprintf(stderr, "Error opening %s\n", logName.c_str());
+       return 5;
+    }
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> normal(0, 1);
+    std::exponential_distribution<double> exponential(1);
+
+    // slice s of the series is acquired with its multiband group and released with its burst
+    double start = monoNow() + 0.1;
+    fprintf(log, "index\tvolume\tslice\tname\tacquired_ms\tscheduled_ms\twritten_ms\tlate_ms\twall_ms\tmono_s\n");
+    for (size_t first = 0; first < total; )
+    {
+       // a burst never spans two volumes
+       size_t volumeEnd = (first / nSlices + 1) * nSlices;
+       size_t last = min(min(first + burst, volumeEnd), total) - 1;
+       double acquired = start + acquiredAt(last, nSlices, mb, TR);
+       double jitter = 0;
+       if (jitterKind == "uniform")
+          jitter = uniform(random) * jitterMs;
+       else if (jitterKind == "normal")
+          jitter = fabs(normal(random)) * jitterMs;
+       else if (jitterKind == "exp")
+          jitter = exponential(random) * jitterMs;
+       double scheduled = acquired + (reconMs + jitter) / 1000;
+       sleepUntil(scheduled);
+       for (size_t s = first; s <= last; s++)
+       {
+          string bytes;
+          if (readFile(inputDir + "/" + recorded[s].name, bytes) != 0)
+          {
+             fprintf(stderr, "Error reading %s\n", recorded[s].name.c_str());
+             continue;
+          }
+          char name[64];
+          snprintf(name, sizeof(name), "i%lld.MRDC.%lu", wallMs(), (unsigned long)(s+1));
+          int rc = (sock >= 0) ? pushSlice(sock, outputDir + "/" + name, bytes) : writeSlice(outputDir, name, bytes, mode);
+          if (rc != 0)
+          {
+             fprintf(stderr, "Error writing slice %lu\n", (unsigned long)(s+1));
+             return 6;
+          }
+          double written = monoNow();
+          fprintf(log, "%lu\t%lu\t%lu\t%s\t%.3f\t%.3f\t%.3f\t%.3f\t%lld\t%.6f\n", (unsigned long)(s+1), (unsigned long)(s/nSlices+1), (unsigned long)(s%nSlices+1), name,
+                  acquiredAt(s, nSlices, mb, TR)*1000,
+                  (scheduled-start)*1000, (written-start)*1000, (written-scheduled)*1000, wallMs(), written);
+       }
+       fflush(log);
+       first = last + 1;
+    }
+    if (sock >= 0)
+       close(sock);
+    if (log != stdout)
+       fclose(log);
+    return 0;
+}
@@ -0,0 +1,143 @@
+//
+//  seriesManager.cpp
+//
+//  Several series converted at the same time.
+//
+
+#include "seriesManager.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+void SeriesManager::run()
+{
+    running = true;
+    for (int i = 0; i < hub->seriesThreads; i++)
+       workers.push_back(std::thread(&SeriesManager::work, this));
+
+    while (running)
+    {
+       // every new series folder gets a pipeline, the latest one no longer replaces the others;
+       // each pipeline is given its folder and never looks for the newest one itself
+       string dir = hub->findSeriesDir();
+       if ((dir.size() > 0) && started.insert(dir).second)
+          waiting.push_back(dir);
+       reap();
+       while ((!waiting.empty()) && (active.size() < hub->maxSeries))
+       {
+          launch(waiting.front());
+          waiting.pop_front();
+       }
+       usleep(10000);
+    }
+}
+
+void SeriesManager::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    for (int i = 0; i < workers.size(); i++)
+       workers[i].join();
+    workers.clear();
+    for (int i = 0; i < active.size(); i++)
+       active[i]->finished = 1;
+    reap();
+}
+
+int SeriesManager::launch(string &seriesDir)
+{
+    char outputdir[256], logName[256];
+    numSeries++;
+    sprintf(outputdir, "%s/serie%.2d", outputRoot.c_str(), numSeries); // each dicom series will be written in a different folder
+    sprintf(logName, "%s/serie%.2d.txt", outputRoot.c_str(), numSeries);
+    mkdir(outputdir, 0777);
+
+    SeriesPipeline *pipeline = new SeriesPipeline;
+    pipeline->converter = new sFTPGE(NULL);
+    pipeline->converter->attachTo(hub);
+    pipeline->converter->logSeries.initializeLogFile(logName);
+    pipeline->converter->startSeries(seriesDir, numSeries);
+    if (pipeline->converter->asyncWriter)
+       pipeline->converter->writer.start();
+    if (pipeline->converter->slices.depth > 0)
+       pipeline->converter->startPipeline();
+    pipeline->outputDir = outputdir;
+    pipeline->busy = 0;
+    pipeline->finished = 0;
+
+    hub->logMain.writeLog(1, "Converting %s into %s (%d series active)\n", seriesDir.c_str(), outputdir, (int) active.size()+1);
+    hub->logMain.flushLog();
+    std::lock_guard<std::mutex> lock(activeMutex);
+    active.push_back(pipeline);
+    return 0;
+}
+
+// closes the pipelines whose series ended, on the main thread
+int SeriesManager::reap()
+{
+    vector<SeriesPipeline *> done;
+    {
+       std::lock_guard<std::mutex> lock(activeMutex);
+       for (int i = 0; i < active.size(); )
+       {
+          if ((active[i]->finished) && (!active[i]->busy))
+          {
+             done.push_back(active[i]);
+             active.erase(active.begin()+i);
+          }
+          else i++;
+       }
+    }
+    for (int i = 0; i < done.size(); i++)
+    {
+       sFTPGE *converter = done[i]->converter;
+       string report = converter->metricsReport();
+       converter->logSeries.writeLog(1, "%s", report.c_str());
+       converter->writeTrace();
+       converter->cleanUp(); // queued volumes and the 4D file
+       converter->slices.stop();
+       converter->writer.stop();
+       hub->logMain.writeLog(1, "Series %s finished\n", converter->seriesDir().c_str());
+       delete converter;
+       delete done[i];
+    }
+    if (done.size() > 0)
+       hub->logMain.flushLog();
+    return done.size();
+}
+
+// next pipeline due for a poll that no other worker holds
+SeriesPipeline *SeriesManager::next()
+{
+    std::lock_guard<std::mutex> lock(activeMutex);
+    for (size_t n = 0; n < active.size(); n++)
+    {
+       SeriesPipeline *pipeline = active[(cursor+n) % active.size()];
+       if ((!pipeline->busy) && (!pipeline->finished) && (pipeline->converter->isDue()))
+       {
+          cursor = (cursor+n+1) % active.size();
+          pipeline->busy = 1;
+          return pipeline;
+       }
+    }
+    return NULL;
+}
+
+void SeriesManager::work()
+{
+    tracer.nameThread("series");
+    while (running)
+    {
+       SeriesPipeline *pipeline = next();
+       if (pipeline == NULL)
+       {
+          usleep(1000);
+          continue;
+       }
+       int ended = pipeline->converter->copyStep(pipeline->outputDir);
+       std::lock_guard<std::mutex> lock(activeMutex);
+       if (ended)
+          pipeline->finished = 1;
+       pipeline->busy = 0;
+    }
+}
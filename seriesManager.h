@@ -0,0 +1,60 @@
+//
+//  seriesManager.h
+//
+//  Converts several series at the same time. The main thread keeps looking
+//  for new series folders and starts a pipeline for each one right away: an
+//  sFTPGE attached to the one holding the session, with its own slice list,
+//  volume being assembled and output folder. A small pool of threads runs
+//  copyStep on the pipelines that are due, so a new run is not held back by
+//  the previous one draining or timing out.
+//
+
+#ifndef seriesManager_h
+#define seriesManager_h
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include "sftp.h"
+
+using namespace std;
+
+struct SeriesPipeline
+{
+    sFTPGE *converter;
+    string outputDir;
+    int busy;     // a worker is in copyStep
+    int finished; // isTimeToEnd, waiting to be closed by the main thread
+};
+
+class SeriesManager
+{
+    sFTPGE *hub;
+    string outputRoot;
+    int &numSeries;
+    vector<SeriesPipeline *> active;
+    std::mutex activeMutex;
+    size_t cursor; // round robin over active
+    set<string> started;
+    deque<string> waiting; // found while maxSeries were running
+    vector<std::thread> workers;
+    std::atomic<bool> running;
+
+    void work();
+    SeriesPipeline *next();
+    int launch(string &seriesDir);
+    int reap();
+public:
+    // runs until the process ends, like the one-series loop in main
+    void run();
+    void stop();
+
+    SeriesManager(sFTPGE *source, const char *outputDir, int &seriesCount) : hub(source), outputRoot(outputDir), numSeries(seriesCount) { cursor = 0; running = false; };
+    ~SeriesManager() { stop(); };
+};
+
+#endif /* seriesManager_h */
@@ -12,6 +12,7 @@
 #include <fstream>
 #include <sstream>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include "dirent.h"
 
 void timeStamp(string &timestamp)
@@ -115,26 +116,40 @@ static void kbd_callback(const char *name, int name_len,
 
 void LogObject::resetLog()
 {
-    closeLogFile();
+    LogSync sync;
+    closeLocked();
     reset(buffer);
     fileName = "";
 }
 
 void LogObject::initializeLogFile(char *filename)
 {
+	LogSync sync;
 	fileName = filename;
 	outputStream.open(filename, fstream::out | fstream::trunc);
 	outputStream << buffer.str().c_str();
 }
 
-// closes the log file
-void LogObject::closeLogFile()
+void LogObject::closeLocked()
 {
 	if (fileName != "")
 		outputStream.close();
 }
 
+// closes the log file
+void LogObject::closeLogFile()
+{
+	LogSync sync;
+	closeLocked();
+}
+
+// the log writer writes and flushes the pending records, the hot path does not wait for the disk
 void LogObject::flushLog()
+{
+	asyncLog.flush();
+}
+
+void LogObject::flushOutput()
 {
 	if (fileName != "")
 		outputStream.flush();
@@ -142,29 +157,20 @@ void LogObject::flushLog()
 
 void LogObject::writeLog(int inScreen, const char * format, ...)
 {
-	char auxBuffer[3000];
-	char timestamp[100];
-
-
-	time_t time_now;
-	time(&time_now);
-	struct tm *timeinfo = localtime(&time_now);
-	strftime(timestamp, 100, "%Y-%m-%d %H:%M:%S : ", timeinfo);
-	va_list args, screen_args;
-
+	va_list args;
 	va_start(args, format);
-	vsprintf(auxBuffer, format, args);
+	asyncLog.record(this, inScreen, format, args);
 	va_end(args);
+}
 
+void LogObject::output(const char *timestamp, const string &text, int inScreen)
+{
 	if (fileName != "")
-		outputStream << timestamp << auxBuffer;
+		outputStream << timestamp << text;
 	else
-		buffer << timestamp << auxBuffer;
-
-	va_start(screen_args, format);
+		buffer << timestamp << text;
 	if (inScreen)
-		vfprintf(stderr, format, screen_args);
-	va_end(screen_args);
+		fputs(text.c_str(), stderr);
 }
 
 string sFTPGE::latestDirSFTP(string &basedir)
@@ -172,6 +178,14 @@ string sFTPGE::latestDirSFTP(string &basedir)
     unsigned long recentTime=0;
     int rc;
     string latestExamDir="";
+
+    // folders changed since the feed started are newer than anything readdir would find
+    if (feedChannel != NULL)
+    {
+       latestExamDir = feedTree.latestDir(basedir);
+       if (latestExamDir.size() > 0)
+          return latestExamDir;
+    }
     /* Request a dir listing via SFTP */
     LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_opendir(sftp_session, basedir.c_str());
 
@@ -259,7 +273,12 @@ string sFTPGE::latestDir(string &basedir)
     if (mode == 1)
        return _latestDir(basedir);
     else if (mode == 2)
-       return latestDirSFTP(basedir);
+    {
+       std::lock_guard<std::mutex> lock(hub->sourceMutex);
+       return hub->latestDirSFTP(basedir);
+    }
+    else
+       return hub->pushStore.latestDir(basedir);
 }
 
 string sFTPGE::latestSession(string &basedir)
@@ -286,6 +305,23 @@ int sFTPGE::getFilelistSFTP(string &basedir, vector<fileObject>&list)
 {
     int rc;
     fileSort sortFile;
+
+    // after one readdir of the series the feed has every new name, no round trip needed
+    if ((feedChannel != NULL) && (feedSynced.count(basedir)))
+    {
+       vector<string> names;
+       vector<time_t> times;
+       feedTree.listDir(basedir, names, times);
+       for (int i = 0; i < names.size(); i++)
+       {
+          fileObject fileObj((char *)names[i].c_str(), testMode);
+          fileObj.time = times[i];
+          if (fileObj.isDicomFile())
+             list.push_back(fileObj);
+       }
+       sort(list.begin(), list.end(), sortFile);
+       return 0;
+    }
  
     /* Request a dir listing via SFTP */
     LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_opendir(sftp_session, basedir.c_str());
@@ -308,14 +344,25 @@ int sFTPGE::getFilelistSFTP(string &basedir, vector<fileObject>&list)
         {
            fileObject fileObj(mem, testMode);
            fileObj.time = (time_t) attrs.mtime;
+           if (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)
+              fileObj.size = attrs.filesize;
            
            if (fileObj.isDicomFile())
+           {
               list.push_back(fileObj);
+              if (feedChannel != NULL)
+              {
+                 string none;
+                 feedTree.addFile(basedir, fileObj.filename, none, fileObj.time);
+              }
+           }
         }
         else break;
     }
     while (1);
     libssh2_sftp_closedir(sftp_handle);
+    if (feedChannel != NULL)
+       feedSynced.insert(basedir);
     sort(list.begin(), list.end(), sortFile);
     return 0;
 }
@@ -358,6 +405,8 @@ int sFTPGE::indexExists(string &basedir, int indexToCheck, vector<fileObject>&li
            //if (dirp->d_type == DT_REG)
            { 
               int idx = fileIndex(dirp->d_name);
+              if (idx < 1)
+                 continue; // not a slice (temporary files and the like)
               if (idx >= list.size())
               {
                  list.resize(idx);
@@ -369,7 +418,20 @@ int sFTPGE::indexExists(string &basedir, int indexToCheck, vector<fileObject>&li
                  stat(fname, &attrs);
                  list[idx-1].setFilename(dirp->d_name, testMode); 
                  list[idx-1].time = (time_t) attrs.st_mtime;
+                 list[idx-1].size = attrs.st_size;
               } 
+              else if (list[idx-1].complete != 1)
+              {
+                 // parked slice, the writer may have finished it since
+                 struct stat attrs;
+                 sprintf(fname, "%s/%s", basedir.c_str(), dirp->d_name);
+                 if (stat(fname, &attrs) == 0)
+                    list[idx-1].size = attrs.st_size;
+              }
+              if (closedFiles.count(list[idx-1].filename))
+                 list[idx-1].complete = 1;
+              else if (openFiles.count(list[idx-1].filename))
+                 list[idx-1].complete = -1;
            }
         }
     }
@@ -377,8 +439,33 @@ int sFTPGE::indexExists(string &basedir, int indexToCheck, vector<fileObject>&li
     return 0;
 }
 
+int sFTPGE::getFilelistStore(string &basedir, vector<fileObject>&list)
+{
+    // same bookkeeping as indexExists, slices are placed by index and holes stay empty
+    vector<string> names;
+    vector<time_t> times;
+    lastListSize = list.size();
+    hub->pushStore.listDir(basedir, names, times);
+    for (int i = 0; i < names.size(); i++)
+    {
+        int idx = fileIndex((char *)names[i].c_str());
+        if (idx < 1)
+           continue;
+        if (idx > list.size())
+           list.resize(idx);
+        if (list[idx-1].filename == "")
+        {
+           list[idx-1].setFilename((char *)names[i].c_str(), testMode);
+           list[idx-1].time = times[i];
+           list[idx-1].complete = 1; // only whole files are stored
+        }
+    }
+    return 0;
+}
+
 int sFTPGE::updateFilelist(string &basedir, vector<fileObject>&list)
 {
+    readSeriesEvents();
     int indexToCheck = list.size()+1;
     lastListSize = list.size();
     return indexExists(basedir, indexToCheck, list);
@@ -389,12 +476,18 @@ int sFTPGE::getFilelist(string &basedir, vector<fileObject>&list)
    if (mode == 1)
       return updateFilelist(basedir, list);
    else if (mode == 2)
-      return getFilelistSFTP(basedir, list);
+   {
+      std::lock_guard<std::mutex> lock(hub->sourceMutex);
+      return hub->getFilelistSFTP(basedir, list);
+   }
+   else
+      return getFilelistStore(basedir, list);
 }
 
 int sFTPGE::getFileSFTP(string &filepath, stringstream &filemem)
 {
     /* Request a file via SFTP */
+    TraceScope span("getFileSFTP");
     int rc;
     reset(filemem);
     LIBSSH2_SFTP_HANDLE *sftp_handle =
@@ -449,11 +542,40 @@ int sFTPGE::_getFile(string &filepath, stringstream &filemem)
 }
 
 int sFTPGE::getFile(string &filepath, stringstream &filemem)
+{
+   double start = MonoTime();
+   int rc = fetchFile(filepath, filemem);
+   metrics.record(metricFetch, MonoTime()-start);
+   if (rc == 0)
+   {
+      metrics.count(counterSlicesFetched);
+      long bytes = filemem.tellp();
+      if ((bytes > 0) && (mode >= 1) && (mode <= 4))
+         metrics.count((MetricCounter)(counterBytesDirectory+mode-1), bytes);
+   }
+   return rc;
+}
+
+int sFTPGE::fetchFile(string &filepath, stringstream &filemem)
 {
    if (mode == 1) 
       return _getFile(filepath, filemem);
+   else if (mode == 2)
+   {
+      std::lock_guard<std::mutex> lock(hub->sourceMutex);
+      return hub->getFileSFTP(filepath, filemem);
+   }
    else
-      return getFileSFTP(filepath, filemem);
+   {
+      reset(filemem);
+      return hub->pushStore.getFile(filepath, filemem);
+   }
+}
+
+int sFTPGE::setMode(int newMode)
+{
+   mode = newMode;
+   return 0;
 }
 
 int sFTPGE::saveFile(string &filepath, stringstream &filemem)
@@ -617,6 +739,30 @@ int sFTPGE::connectSession()
        initSock();
        initSSHSession();
        initsFTPSession();
+       if ((changeFeed) && (startChangeFeed() != 0))
+          logMain.writeLog(1, "Change feed not available, listing folders instead\n");
+    }
+    else if (mode == 3)
+    {
+       scp.store = &pushStore;
+       scp.root = sftppath;
+       if (scp.start() != 0)
+       {
+          logMain.writeLog(1, "Unable to start the DICOM receiver on port %d\n", scp.port);
+          return -1;
+       }
+       logMain.writeLog(1, "DICOM receiver listening on port %d as %s\n", scp.port, scp.aeTitle.c_str());
+    }
+    else if (mode == 4)
+    {
+       pushRx.store = &pushStore;
+       pushRx.root = sftppath;
+       if (pushRx.start() != 0)
+       {
+          logMain.writeLog(1, "Unable to listen for the push agent on port %d\n", pushRx.port);
+          return -1;
+       }
+       logMain.writeLog(1, "Waiting for the push agent on port %d\n", pushRx.port);
     }
     return 0;
 }
@@ -654,25 +800,225 @@ int sFTPGE::getLatestSeriesDir()
         previousSerieDir = latestSerieDir;
         latestSerieDir = seriesDir; 
         logMain.writeLog(1, "Most recent series path : %s\n", latestSerieDir.c_str());
+        if (mode == 1)
+           watchSeriesDir(latestSerieDir);
         return 1;
     }
     else return 0;
 }
 
+// Mode 1: close events of the series folder tell which slices the scanner finished writing.
+// Files written before the watch was added have no event and fall back to the size check.
+int sFTPGE::watchSeriesDir(string &dir)
+{
+    if (inotifyFd < 0)
+    {
+       inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+       if (inotifyFd < 0)
+          return -1;
+    }
+    if (seriesWatch >= 0)
+       inotify_rm_watch(inotifyFd, seriesWatch);
+    openFiles.clear();
+    closedFiles.clear();
+    seriesWatch = inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+    return (seriesWatch < 0) ? -1 : 0;
+}
+
+int sFTPGE::readSeriesEvents()
+{
+    if (inotifyFd < 0)
+       return 0;
+    char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int events = 0;
+    ssize_t n;
+    while ((n = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+    {
+       for (char *p = buffer; p < buffer+n; p += sizeof(struct inotify_event)+((struct inotify_event *)p)->len)
+       {
+          struct inotify_event *event = (struct inotify_event *)p;
+          if ((event->wd != seriesWatch) || (event->len == 0) || (event->mask & IN_ISDIR))
+             continue;
+          if (event->mask & IN_CREATE)
+             openFiles.insert(event->name);
+          else
+          {
+             openFiles.erase(event->name);
+             closedFiles.insert(event->name);
+          }
+          events++;
+       }
+    }
+    return events;
+}
+
+// Cheap test made before a slice is read and parsed. A closed file is complete, an open one is not;
+// otherwise the listed size must reach what the first slice of the series needed.
+int sFTPGE::sliceComplete(fileObject &file)
+{
+    if (file.complete != 0)
+       return (file.complete == 1);
+    if ((expectedFileBytes > 0) && (file.size > 0))
+    {
+       if (file.size+headerSlack < expectedFileBytes)
+          return 0;
+       file.complete = 1; // not stat'ed again by the next listings
+    }
+    return 1;
+}
+
+// Makes this object convert series for source: same input and outputs, its own series state.
+int sFTPGE::attachTo(sFTPGE *source)
+{
+    hub = source;
+    mode = source->mode;
+    testMode = source->testMode;
+    sftppath = source->sftppath;
+    slabSize = source->slabSize;
+    outputMode = source->outputMode;
+    expectedVolumes = source->expectedVolumes;
+    asyncWriter = source->asyncWriter;
+    timeBetweenReads = source->timeBetweenReads;
+    poller.minInterval = source->poller.minInterval;
+    poller.maxInterval = source->poller.maxInterval;
+    slices.depth = source->slices.depth;
+    slices.fetchThreads = source->slices.fetchThreads;
+    slices.parseThreads = source->slices.parseThreads;
+    slices.fetchCpu = source->slices.fetchCpu;
+    slices.parseCpu = source->slices.parseCpu;
+    traceLatency = source->traceLatency;
+    metrics.total = &source->totals;
+    deadline.fraction = source->deadline.fraction;
+    deadline.alertPath = source->deadline.alertPath;
+    writer.publisher = &source->publisher;
+    return 0;
+}
+
+int sFTPGE::startSeries(string &seriesDir, int number)
+{
+    cleanUp();
+    previousSerieDir = latestSerieDir;
+    latestSerieDir = seriesDir;
+    metricsReportSeen = metricsReportRequested; // signals sent before the series started are not for it
+    seriesActive(number);
+    if (mode == 1)
+       watchSeriesDir(latestSerieDir);
+    setStartTime();
+    return 0;
+}
+
+void sFTPGE::seriesActive(int number)
+{
+    seriesNumber = number;
+    metrics.gauge(gaugeSeriesActive, 1);
+    hub->totals.latestSeries = number;
+}
+
+string sFTPGE::metricsExposition()
+{
+    char line[512];
+    snprintf(line, sizeof(line), "# TYPE dicomftp_allocations_total counter\ndicomftp_allocations_total %lu\n"
+             "# TYPE dicomftp_log_stalls_total counter\ndicomftp_log_stalls_total %lu\n"
+             "# TYPE dicomftp_stream_subscribers gauge\ndicomftp_stream_subscribers %d\n",
+             heapAllocations.load(), asyncLog.stalls.load(), streamer.isEnabled() ? streamer.subscribers() : 0);
+    return totals.exposition("dicomftp_") + line;
+}
+
+string sFTPGE::metricsReport()
+{
+    char title[256];
+    snprintf(title, sizeof(title), "Latency per stage, series %d (%s)\n", seriesNumber, latestSerieDir.c_str());
+    return string(title) + metrics.report() + deadline.summary();
+}
+
+// ends trace.json with the spans of this series not moved into it yet
+int sFTPGE::writeTrace()
+{
+    if (tracePath == "")
+       return 0;
+    writer.flush(); // queued volumes are part of the series
+    int spans = tracer.close(seriesNumber);
+    if (spans < 0)
+       logSeries.writeLog(1, "Could not write the trace %s\n", tracePath.c_str());
+    else
+       logSeries.writeLog(1, "Trace with %d spans written to %s\n", spans, tracePath.c_str());
+    tracePath = "";
+    return (spans < 0);
+}
+
+int sFTPGE::startPipeline()
+{
+    slices.fetch = [this](string &path, stringstream &filemem) { return getFile(path, filemem); };
+    slices.metrics = &metrics;
+    return slices.start();
+}
+
+// keeps the fetch/parse stages depth slices ahead, in order, stopping at a slice still being written
+int sFTPGE::requestSlices(int from)
+{
+    int requested = 0;
+    for (int r = slices.nextIndex(from); (r < list.size()) && (r < from+slices.depth); r++)
+    {
+        if ((list[r].filename == "") || (!sliceComplete(list[r])))
+           break;
+        if (slices.request(r, latestSerieDir + "/" + list[r].filename) != 0)
+           break;
+        requested++;
+    }
+    return requested;
+}
+
+int sFTPGE::isDue()
+{
+    double now = GetWallTime();
+    if ((parkedFile.size() > 0) && (now-lastTime > poller.minInterval))
+       return 1;
+    return (now >= poller.nextPoll());
+}
+
 int sFTPGE::getFileList()
 {
+    TraceScope span("getFileList");
     double ini = GetWallTime();
+    double listStart = MonoTime();
     lastListSize = list.size();
+    vector<fileObject> previous;
     if (mode == 2) 
-       list.clear();
+       previous.swap(list); // rebuilt from scratch, keeps when each slice was first seen
     getFilelist(latestSerieDir, list);
+    double listEnd = MonoTime();
+    for (int i = 0; i < list.size(); i++)
+    {
+       if ((i < previous.size()) && (previous[i].filename == list[i].filename))
+          list[i].seen = previous[i].seen;
+       else if ((list[i].seen == 0) && (list[i].filename != ""))
+       {
+          list[i].seen = listEnd;
+          metrics.count(counterSlicesSeen);
+       }
+    }
+    metrics.record(metricList, listEnd-listStart);
+    metrics.count(counterListings);
     double end = GetWallTime();
     logSeries.writeLog(1, "Time to get list %f sec\n", end-ini);
     return 0;
 }
 
+// Newest series folder, for the SeriesManager. This object's series is left alone: with two
+// series alternating as the newest it would move back and forth, logging every move.
+string sFTPGE::findSeriesDir()
+{
+   if (feedChannel != NULL)
+      pollChangeFeed(timeBetweenReads); // new exam/series folders
+   if (!getLatestExamDir())
+      return "";
+   return latestSerie(latestExamDir);
+}
+
 int sFTPGE::findInputDir()
 {
+   if (feedChannel != NULL)
+      pollChangeFeed(timeBetweenReads); // new exam/series folders
    if (getLatestExamDir())
       return getLatestSeriesDir();
    else return 0;
@@ -685,6 +1031,7 @@ void sFTPGE::setStartTime()
 
 int sFTPGE::saveNifti(char * niiFilename, struct nifti_1_header hdr, unsigned char* im, struct TDCMopts opts) 
 {
+    TraceScope span("saveNifti");
     hdr.vox_offset = 352;
     size_t imgsz = nii_ImgBytes(hdr);
     if (imgsz < 1) {
@@ -693,12 +1040,14 @@ int sFTPGE::saveNifti(char * niiFilename, struct nifti_1_header hdr, unsigned ch
     }
 
     char fname[2048] = {""};
+    char tmpname[2048];
     strcpy (fname,niiFilename);
     strcat (fname,".nii");
-    FILE *fp = fopen(fname, "wb");
+    tempName(fname, tmpname, sizeof(tmpname));
+    FILE *fp = fopen(tmpname, "wb");
     if (!fp) 
     {
-       logSeries.writeLog(1, "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!    Error opening the file %s for writing !!!\n", fname);
+       logSeries.writeLog(1, "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!    Error opening the file %s for writing !!!\n", tmpname);
        return 2;
     } 
     fwrite(&hdr, sizeof(hdr), 1, fp);
@@ -706,16 +1055,189 @@ int sFTPGE::saveNifti(char * niiFilename, struct nifti_1_header hdr, unsigned ch
     fwrite(&pad, sizeof( pad), 1, fp);
     fwrite(&im[0], imgsz, 1, fp);
     fclose(fp);
+    // consumers only ever see the complete file
+    if (hub->publisher.commit(tmpname, fname) != 0)
+    {
+       logSeries.writeLog(1, "Error renaming %s to %s\n", tmpname, fname);
+       return 3;
+    }
     return 0;
 }
 
+int sFTPGE::allocateVolume(size_t bytes)
+{
+    if (asyncWriter)
+    {
+       // buffers cycle between the assembler and the writer thread
+       if (currentJob)
+          writer.recycle(currentJob);
+       currentJob = writer.getJob(bytes);
+       volumeBuffer = currentJob->buffer;
+       return 0;
+    }
+    if (volumeBuffer)
+       free(volumeBuffer);
+    volumeBuffer = (unsigned char *)malloc(bytes);
+    return (volumeBuffer == NULL);
+}
+
+int sFTPGE::freeVolume()
+{
+    if (currentJob)
+    {
+       writer.recycle(currentJob);
+       currentJob = NULL;
+    }
+    else if (volumeBuffer)
+       free(volumeBuffer);
+    volumeBuffer = NULL;
+    volumeData = NULL;
+    volumeSliceBytes = 0;
+    slicesAssembled = 0;
+    slabStartSlice = 0;
+    return 0;
+}
+
+int sFTPGE::placeVolume(string &outputdir, int volumeIndex)
+{
+    if (!isMapped())
+    {
+       volumeData = volumeBuffer;
+       return 0;
+    }
+    char outputname[1024];
+    sprintf(outputname, "%s/series4D", outputdir.c_str());
+    if ((series4D.isOpen()) || (series4D.openMapped(outputname, volumeHdr, (expectedVolumes > 0) ? expectedVolumes : seriesVolumes) == 0))
+    {
+       volumeData = series4D.volumeData(volumeIndex);
+       if (volumeData != NULL)
+          return 0;
+    }
+    // no room reserved on the disk, the volumes already in the 4D file stay there
+    logSeries.writeLog(1, "Error reserving the 4D file %s.nii for volume %d (%s), writing one file per volume\n", outputname, volumeIndex, strerror(errno));
+    mappedFailed = 1;
+    if (allocateVolume(volumeSliceBytes*(uint64_t)nSlices) != 0)
+    {
+       volumeData = NULL;
+       return 1;
+    }
+    volumeData = volumeBuffer;
+    return 0;
+}
+
+int sFTPGE::writeNifti(char *niiFilename, struct nifti_1_header &hdr, unsigned char *im, size_t bytes, int volumeIndex, NiftiSeries *series, struct TDCMopts opts)
+{
+    if (asyncWriter)
+    {
+       VolumeJob *job;
+       if ((currentJob != NULL) && (im == currentJob->buffer))
+       {
+          // the whole volume: its buffer travels with the job
+          job = currentJob;
+          currentJob = NULL;
+          volumeBuffer = NULL;
+          volumeData = NULL;
+       }
+       else if (currentJob != NULL)
+          job = writer.getSlabJob(currentJob); // slab, points into a volume that is queued after it
+       else job = writer.getJob(0);
+       strcpy(job->filename, niiFilename);
+       job->hdr = hdr;
+       job->data = im;
+       job->bytes = bytes;
+       job->volumeIndex = volumeIndex;
+       job->series = series;
+       return writer.submit(job);
+    }
+
+    int rc;
+    if (series == NULL)
+       rc = saveNifti(niiFilename, hdr, im, opts);
+    else
+    {
+       if (!series->isOpen())
+       {
+          if (series->openSeries(niiFilename, hdr) != 0)
+          {
+             logSeries.writeLog(1, "Error opening the 4D file %s.nii for writing\n", niiFilename);
+             return 2;
+          }
+       }
+       rc = series->appendVolume(im, volumeIndex);
+    }
+    if (rc == 0)
+    {
+       string fname = string(niiFilename) + ".nii";
+       hub->publisher.published(fname.c_str(), volumeIndex);
+    }
+    return rc;
+}
+
+int sFTPGE::saveVolume(string &outputdir, int volumeIndex, char *outputname, struct TDCMopts opts)
+{
+    // consumers of the shared memory ring get the volume before it reaches the disk
+    if (hub->ring.isEnabled())
+    {
+       std::lock_guard<std::mutex> lock(hub->outputMutex);
+       if (hub->ring.publish(volumeHdr, volumeData, volumeSliceBytes*nSlices, volumeIndex, seriesNumber, volumeAcqTime) != 0)
+          logSeries.writeLog(1, "Error publishing volume %d in shared memory %s\n", volumeIndex, hub->ring.name.c_str());
+    }
+    if (hub->streamer.isEnabled())
+       hub->streamer.broadcast(streamVolume, seriesNumber, volumeIndex, volumeHdr, volumeData, volumeSliceBytes, 0, nSlices-1, volumeAcqTime);
+    if (isMapped())
+    {
+       strcpy(outputname, series4D.name());
+       int rc = series4D.publishVolume(volumeIndex);
+       if (rc == 0)
+          hub->publisher.published(outputname, volumeIndex);
+       return rc;
+    }
+    if (outputMode == 1)
+    {
+       sprintf(outputname, "%s/series4D", outputdir.c_str());
+       return writeNifti(outputname, volumeHdr, volumeData, volumeSliceBytes*nSlices, volumeIndex, &series4D, opts);
+    }
+    sprintf(outputname, "%s/vol_%.5d", outputdir.c_str(), volumeIndex);
+    return writeNifti(outputname, volumeHdr, volumeData, volumeSliceBytes*nSlices, volumeIndex, NULL, opts);
+}
+
+int sFTPGE::publishSlab(string &outputdir, int volumeIndex, int firstSlice, int lastSlice, struct TDCMopts opts)
+{
+    // acquisition slice i is stored at z = nSlices-1-i, so a run of slices is contiguous in the volume buffer
+    int zStart = nSlices-1-lastSlice;
+    struct nifti_1_header hdr = volumeHdr;
+    hdr.dim[3] = lastSlice-firstSlice+1;
+    hdr.srow_x[3] += hdr.srow_x[2]*zStart;
+    hdr.srow_y[3] += hdr.srow_y[2]*zStart;
+    hdr.srow_z[3] += hdr.srow_z[2]*zStart;
+    hdr.qoffset_x += hdr.srow_x[2]*zStart;
+    hdr.qoffset_y += hdr.srow_y[2]*zStart;
+    hdr.qoffset_z += hdr.srow_z[2]*zStart;
+    snprintf(hdr.descrip, sizeof(hdr.descrip), "slab %d-%d/%d acq=%.3f", firstSlice+1, lastSlice+1, nSlices, slabAcqTime);
+    if (hub->streamer.isEnabled())
+       hub->streamer.broadcast(streamSlab, seriesNumber, volumeIndex, volumeHdr, &volumeData[(uint64_t)zStart*volumeSliceBytes], volumeSliceBytes, zStart, zStart+hdr.dim[3]-1, slabAcqTime);
+
+    char outputname[1024];
+    sprintf(outputname, "%s/vol_%.5d_slab_%.3d_%.3d", outputdir.c_str(), volumeIndex, firstSlice+1, lastSlice+1);
+    int rc;
+    if (isMapped()) // the mapping may move before a queued slab is written
+    {
+       rc = saveNifti(outputname, hdr, &volumeData[(uint64_t)zStart*volumeSliceBytes], opts);
+       if (rc == 0)
+       {
+          string fname = string(outputname) + ".nii";
+          hub->publisher.published(fname.c_str(), volumeIndex);
+       }
+    }
+    else
+       rc = writeNifti(outputname, hdr, &volumeData[(uint64_t)zStart*volumeSliceBytes], volumeSliceBytes*hdr.dim[3], volumeIndex, NULL, opts);
+    logSeries.writeLog(1, "Slab with slices %d-%d of volume %d written. Acquisition time = %.3f TimeStamp = %2.3f ms\n", firstSlice+1, lastSlice+1, volumeIndex, slabAcqTime, (GetMTime()-startTime));
+    return rc;
+}
+
 int sFTPGE::downloadFileList(string &outputdir)
 {
     double ini = GetWallTime();
-    struct nifti_1_header hdr;
-    unsigned char * imgM=NULL, *img=NULL;
-    size_t imgsz=0;
-    int nslices=0;
     int sliceDir = 0;
     struct TDCMopts opts;
     struct TDICOMdata firstHeader;
@@ -730,100 +1252,252 @@ int sFTPGE::downloadFileList(string &outputdir)
     opts.filename[0] = 0;
     opts.isGz = false;
 
-    for (int t=actualFileIndex; t<list.size(); t++)
+    // slices already in volumeData were assembled in a previous call (streaming mode)
+    int taken = -1; // slice taken from the pipeline and not assembled yet
+    for (int t=actualFileIndex+slicesAssembled; t<list.size(); t++)
     {
+        double sliceStart = MonoTime();
         if (list[t].filename == "")
         {
            logSeries.writeLog(1, "Slice file with index %d not found\n", t+1); 
+           metrics.count(counterSlicesRetried);
+           break;
+        }
+        if (!sliceComplete(list[t]))
+        {
+           if (parkedFile != list[t].filename)
+           {
+              logSeries.writeLog(1, "Slice file %s still being written (%llu bytes), parked\n", list[t].filename.c_str(), list[t].size);
+              metrics.count(counterSlicesParked);
+           }
+           parkedFile = list[t].filename;
            break;
         }
-        stringstream filemem;
+        // fetched and parsed ahead by the pipeline threads, or here when it is off
+        SliceTask *task = NULL;
+        if (slices.isRunning())
+        {
+           requestSlices(t);
+           task = slices.take(t);
+        }
+        std::unique_ptr<SliceTask> taskOwner(task);
+        stringstream ownmem;
+        stringstream &filemem = (task != NULL) ? task->filemem : ownmem;
         string fname = latestSerieDir + "/" + list[t].filename;
-        if (getFile(fname, filemem)==0)
+        if (task != NULL)
+           taken = t;
+        int fetchRc;
+        if (task != NULL)
+           fetchRc = task->fetchRc;
+        else
         {
-            TDTI4D unused;
-            struct TDICOMdata d = readDICOMv(filemem, 0, 0, &unused);
+           TraceScope span("getFile", t+1);
+           fetchRc = getFile(fname, filemem);
+        }
+        if (fetchRc==0)
+        {
+            struct TAcqCounts counts;
+            memset(&counts, 0, sizeof(counts));
+            struct TDICOMdata d;
+            double fetchedAt, parsedAt;
+            if (task != NULL)
+            {
+               d = task->d;
+               counts = task->counts;
+               fetchedAt = task->fetched;
+               parsedAt = task->parsed;
+            }
+            else
+            {
+               TDTI4D unused;
+               fetchedAt = MonoTime();
+               d = readDICOMv(filemem, 0, 0, &unused, &counts);
+               parsedAt = MonoTime();
+               metrics.record(metricParse, parsedAt-fetchedAt);
+               metrics.count(counterSlicesParsed);
+               tracer.span("readDICOMv", fetchedAt, parsedAt, t+1);
+            }
+            filemem.clear();
+            filemem.seekg(0, filemem.end);
+            size_t fileBytes = filemem.tellg();
+            if (parkedFile == list[t].filename)
+               parkedFile = "";
+            if ((t==actualFileIndex) && (d.imageStart > 0))
+            {
+                // a truncated first slice must not set the volume geometry
+                struct nifti_1_header sliceHdr;
+                if ((headerDcm2Nii(d, &sliceHdr, false) != EXIT_FAILURE) && (d.imageStart+nii_ImgBytes(sliceHdr) > fileBytes))
+                {
+                    if (parkedFile != list[t].filename)
+                    {
+                       logSeries.writeLog(1, "Slice file %s is incomplete (%ld bytes), parked\n", fname.c_str(), (long) fileBytes);
+                       metrics.count(counterSlicesParked);
+                    }
+                    list[t].complete = 0;
+                    parkedFile = list[t].filename;
+                    break;
+                }
+            }
             if (t==actualFileIndex)
             {
-                if (headerDcm2Nii(d, &hdr, true) != EXIT_FAILURE)
+                if (headerDcm2Nii(d, &volumeHdr, true) != EXIT_FAILURE)
                 {
-                    imgsz = nii_ImgBytes(hdr);
+                    size_t imgsz = nii_ImgBytes(volumeHdr);
                     filemem.seekg(0, filemem.end);
                     int fileLen=filemem.tellg();
                     logSeries.writeLog(1, "filename = %s, file size = %d, slice size=%ld numslices = %d\n", fname.c_str(), fileLen, imgsz, d.locationsInAcquisition); 
 
-                    hdr.dim[3] = d.locationsInAcquisition;
-                    for (int i = 4; i < 8; i++) hdr.dim[i] = 0;
-                    imgM = (unsigned char *)malloc(imgsz* (uint64_t)d.locationsInAcquisition);
-                    img = (unsigned char *)malloc(imgsz);
+                    volumeHdr.dim[3] = d.locationsInAcquisition;
+                    for (int i = 4; i < 8; i++) volumeHdr.dim[i] = 0;
+                    if ((!isMapped()) && ((volumeBuffer == NULL) || (imgsz != volumeSliceBytes) || (d.locationsInAcquisition != nSlices)))
+                       allocateVolume(imgsz* (uint64_t)d.locationsInAcquisition);
+                    volumeSliceBytes = imgsz;
                     if (d.locationsInAcquisition > 0) 
                        nSlices = d.locationsInAcquisition;
+                    if ((actualFileIndex == 0) && d.isValid)
+                       seriesLength(d, counts); // only a fully parsed first slice gives the length
+                    if (nSlices > 0)
+                       placeVolume(outputdir, (int)(t / nSlices) + 1);
                 }
             }
+            size_t imgsz = volumeSliceBytes;
             
-            if ((imgsz > 0) && (nSlices > 0))
+            if ((imgsz > 0) && (nSlices > 0) && (volumeData != NULL))
             {
                 time_t creationTime = list[t].time;    
                 time_t actualTime;
                 time(&actualTime); 
                 if (t > lastIndexChecked) 
                 {
-                   logSeries.writeLog(1, "file read = %s \nTimestamp (Creation) = %sTimeStamp (Viewing from beging sequence aquisition) = %2.3f ms\n", fname.c_str(), ctime(&creationTime), (GetMTime()-startTime));
+                   logSeries.writeLog(1, "file read = %s \nTimestamp (Creation) = %sTimeStamp (Viewing from beging sequence aquisition) = %2.3f ms\n", fname.c_str(), logCtime(creationTime), (GetMTime()-startTime));
                 }
                 int i = t % d.locationsInAcquisition;
+                int volumeIndex = ((int)(t / d.locationsInAcquisition) + 1);
                 if (d.imageStart == 0)
                 {
                     filemem.seekg(0, filemem.end);
                     int fileLen=filemem.tellg(); //Get file length
                     d.imageStart = fileLen-imgsz;
                 }
+                if ((d.imageStart+imgsz > fileBytes) ||
+                    ((expectedFileBytes > 0) && (fileBytes+headerSlack < expectedFileBytes)))
+                {
+                    // caught mid-write, read again once the listing shows it complete
+                    if (parkedFile != list[t].filename)
+                    {
+                       logSeries.writeLog(1, "Slice file %s is incomplete (%ld bytes), parked\n", fname.c_str(), (long) fileBytes);
+                       metrics.count(counterSlicesParked);
+                    }
+                    list[t].complete = 0;
+                    parkedFile = list[t].filename;
+                    break;
+                }
+                if (expectedFileBytes == 0)
+                   expectedFileBytes = d.imageStart+imgsz;
 
                 //fprintf(stderr, "Reading %ld bytes from %d\n", imgsz, d.imageStart); 
+                // pixels go straight to their place in the volume (or in the mapped series file)
+                double copyStart = MonoTime();
                 filemem.seekg(d.imageStart);
-                filemem.read((char *)img, imgsz);
-                if (filemem)
+                filemem.read((char *)&volumeData[(uint64_t)(d.locationsInAcquisition-1-i)*imgsz], imgsz);
+                metrics.record(metricCopy, MonoTime()-copyStart);
+                if (!filemem)
                 {
-                    memcpy(&imgM[(uint64_t)(d.locationsInAcquisition-1-i)*imgsz], &img[0], imgsz);
-                    if (t > lastIndexChecked)
-                    { 
-                       logSeries.writeLog(1, "Writing (in memory) slice %d of volume %d TimeStamp = %2.3f ms\n\n", (i+1), ((int)(t / d.locationsInAcquisition) + 1), (GetMTime()-startTime));
-                       lastIndexChecked = t;
-                    }
-                    nslices++;
+                    // slice is retried on the next poll, keeping the volume aligned
+                    logSeries.writeLog(1, "Slice file %s could not be read\n", fname.c_str());
+                    metrics.count(counterSlicesRetried);
+                    break;
+                }
+                if (t > lastIndexChecked)
+                { 
+                   logSeries.writeLog(1, "Writing (in memory) slice %d of volume %d TimeStamp = %2.3f ms\n\n", (i+1), volumeIndex, (GetMTime()-startTime));
+                   lastIndexChecked = t;
+                }
+                if (slicesAssembled == 0)
+                   volumeAcqTime = d.acquisitionTime;
+                if (slicesAssembled == slabStartSlice)
+                   slabAcqTime = d.acquisitionTime;
+                slicesAssembled++;
+                taken = -1;
+                if (mode > 2)
+                   hub->pushStore.release(fname);
+                double assembledAt = MonoTime();
+                metrics.record(metricAssemble, assembledAt-sliceStart);
+                tracer.span("assemble", sliceStart, assembledAt, t+1, volumeIndex);
+                if (traceLatency)
+                {
+                   if (!latency.isOpen() && (latency.start((outputdir + "/latency.tsv").c_str()) != 0))
+                   {
+                      logSeries.writeLog(1, "Could not write the latency trace in %s\n", outputdir.c_str());
+                      traceLatency = 0;
+                   }
+                   latency.slice(t, volumeIndex, i, d, list[t].time, list[t].seen, fetchedAt, parsedAt);
+                }
+
+                if ((slabSize > 0) && (slicesAssembled < nSlices) && (slicesAssembled-slabStartSlice >= slabSize))
+                {
+                    publishSlab(outputdir, volumeIndex, slabStartSlice, slicesAssembled-1, opts);
+                    slabStartSlice = slicesAssembled;
                 }
                 
-                if (nslices == d.locationsInAcquisition)
+                if (slicesAssembled == d.locationsInAcquisition)
                 {
                     char outputname[1024];
                     
-                    int volumeIndex = ((int)(t / d.locationsInAcquisition) + 1);
-                    sprintf(outputname, "%s/vol_%.5d", outputdir.c_str(), volumeIndex);
-                    saveNifti(outputname, hdr, imgM, opts);
-                    nslices=0;
+                    if ((slabSize > 0) && (slabStartSlice > 0))
+                       publishSlab(outputdir, volumeIndex, slabStartSlice, slicesAssembled-1, opts);
+                    double writeStart = MonoTime();
+                    saveVolume(outputdir, volumeIndex, outputname, opts);
+                    double published = MonoTime();
+                    metrics.record(metricWrite, published-writeStart);
+                    metrics.count(counterVolumesPublished);
+                    tracer.span("saveVolume", writeStart, published, t+1, volumeIndex);
+                    if (tracePath != "")
+                    {
+                       tracer.flush();
+                       traceFlushed = published;
+                    }
+                    if (list[t].seen > 0)
+                       metrics.record(metricSliceToVolume, published-list[t].seen);
+                    if (list[t+1-slicesAssembled].seen > 0)
+                       metrics.record(metricFirstToVolume, published-list[t+1-slicesAssembled].seen);
+                    slicesAssembled=0;
+                    slabStartSlice=0;
                     actualFileIndex=t+1;
-                    if (actualFileIndex+nSlices > list.size())
-                       break;
          
                     time_t actualTime;
                     time(&actualTime); 
                     logSeries.writeLog(1, "Volume %d written. File name = %s\n", volumeIndex, outputname);
-                    logSeries.writeLog(1, "Timestamp (Volume creation) = %s", ctime(&actualTime));
+                    logSeries.writeLog(1, "Timestamp (Volume creation) = %s", logCtime(actualTime));
                     logSeries.writeLog(1, "Timestamp (millisecs from sequence start) = %2.3f\n\n", (GetMTime()-startTime));
+                    logSeries.writeLog(1, "Listings = %lu, slice arrival interval = %2.3f ms\n\n", poller.polls, poller.interval()*1000);
+                    if (latency.isOpen())
+                       logSeries.writeLog(1, "%s\n", latency.volume(volumeIndex, published).c_str());
+                    unsigned long misses = deadline.misses;
+                    string alert = deadline.volume(seriesNumber, volumeIndex, list[t].seen, fetchedAt, parsedAt, assembledAt, writeStart, published);
+                    if (alert != "")
+                       logSeries.writeLog(1, "%s", alert.c_str());
+                    metrics.count(counterDeadlineMisses, deadline.misses-misses);
+                    if (asyncWriter)
+                       logSeries.writeLog(1, "Writer backlog = %u volumes, latency last = %2.3f ms mean = %2.3f ms max = %2.3f ms, failures = %ld, stalls = %lu\n\n", writer.backlog(), writer.lastLatencyMs(), writer.meanLatencyMs(), writer.maxLatencyMs(), writer.writeFailures(), writer.submitStalls());
                     logSeries.flushLog();
+
+                    // in streaming mode a partial next volume is assembled right away
+                    if ((slabSize == 0) && (actualFileIndex+nSlices > list.size()))
+                       break;
                 }
             }
         }
         else 
         {
             logSeries.writeLog(1, "Slice file %s has invalid filesize\n", fname.c_str());
+            metrics.count(counterSlicesRetried);
             break;
         }
     }
-    if (img)
-       free(img);
-
-    if (imgM)
-       free(imgM);
+    // the slice that stopped the pass is read again, what was fetched after it is kept
+    if (taken >= 0)
+       slices.retry(taken);
     logSeries.writeLog(1, "Time to get files %f sec\n\n\n", GetWallTime()-ini);
     return 0;
 }
@@ -840,6 +1514,20 @@ int sFTPGE::resetTries()
 int sFTPGE::cleanUp()
 {
    resetTries();
+   writer.flush(); // queued volumes of the previous series, before its 4D file is closed
+   freeVolume();
+   series4D.closeSeries();
+   mappedFailed = 0;
+   expectedFileBytes = 0;
+   parkedFile = "";
+   seriesVolumes = 0;
+   seriesTR = 0;
+   poller.reset(timeBetweenReads);
+   slices.cancel();
+   metrics.reset();
+   latency.stop();
+   deadline.reset();
+   tracePath = "";
    nSlices = 0;
    actualFileIndex = 0;
    lastIndexChecked = -1;
@@ -848,14 +1536,44 @@ int sFTPGE::cleanUp()
    return 0;
 }
 
+// Number of volumes in the acquisition: NumberOfTemporalPositions, or all images over the
+// slices per volume when ImagesInAcquisition counts the whole run.
+int sFTPGE::seriesLength(struct TDICOMdata &d, struct TAcqCounts &counts)
+{
+   int locations = (counts.locationsGE > 0) ? counts.locationsGE : d.locationsInAcquisition;
+   seriesVolumes = 0;
+   if (counts.temporalPositions > 0)
+      seriesVolumes = counts.temporalPositions;
+   else if ((locations > 0) && (counts.imagesInAcquisition > locations) && ((counts.imagesInAcquisition % locations) == 0))
+      seriesVolumes = counts.imagesInAcquisition / locations;
+   seriesTR = (d.TR > 0) ? d.TR / 1000.0 : 0;
+   poller.setAcquisition(seriesTR, d.locationsInAcquisition);
+   logSeries.writeLog(1, "Expected volumes = %d, TR = %2.3f s\n", seriesVolumes, seriesTR);
+   deadline.start(seriesTR);
+   if (deadline.budgetMs() > 0)
+      logSeries.writeLog(1, "Deadline = %2.3f ms from the last slice of a volume to its publication\n", deadline.budgetMs());
+   return seriesVolumes;
+}
+
 int sFTPGE::isTimeToEnd()
 {
+   // the last volume is written, no need to wait for the idle timeout
+   if ((seriesVolumes > 0) && (nSlices > 0) && (actualFileIndex >= seriesVolumes*nSlices))
+   {
+      if (numberOfTries <= maximumTries)
+         logSeries.writeLog(1, "All %d volumes received, series finished\n", seriesVolumes);
+      numberOfTries = maximumTries+1;
+      return 1;
+   }
+
+   // fallback when the length is unknown (or the run was stopped): a few TRs without new slices
+   double checkInterval = (seriesTR > 0) ? seriesTR : timeBetweenChecks;
    if (!hasNewFiles())
    {
       if (lastCheck == 0)
          lastCheck = GetWallTime();
 
-      if (GetWallTime()-lastCheck > timeBetweenChecks)
+      if (GetWallTime()-lastCheck > checkInterval)
       {
          lastCheck = GetWallTime();
          numberOfTries++;   
@@ -871,25 +1589,241 @@ int sFTPGE::isTimeToEnd()
 
 int sFTPGE::copyStep(string &outputdir)
 {
-   if ((GetWallTime()-lastTime) > timeBetweenReads)
+   TraceSeries traceSeries(seriesNumber);
+   if (tracer.enabled && (tracePath == ""))
+   {
+      tracePath = outputdir + "/trace.json";
+      tracer.open(seriesNumber, tracePath.c_str()); // a failure is reported by writeTrace
+      traceFlushed = MonoTime();
+   }
+   if (metricsReportSeen != metricsReportRequested)
+   {
+      metricsReportSeen = metricsReportRequested;
+      string report = metricsReport();
+      logSeries.writeLog(1, "%s", report.c_str());
+   }
+   if (asyncWriter)
+      writer.drainOverflow();
+   int changed = 0;
+   if (feedChannel != NULL)
+   {
+      // sleeps on the socket instead of spinning, wakes up as soon as the console reports a file
+      double wait = poller.nextPoll()-GetWallTime();
+      changed = pollChangeFeed((wait > 0) ? wait : 0);
+   }
+   if ((changed) || (isDue()))
    {
       getFileList();
       lastTime = GetWallTime();
-      if (actualFileIndex+nSlices <= list.size())
+      poller.observed(hasNewFiles(), lastTime);
+      if ((actualFileIndex+nSlices <= list.size()) ||
+          ((slabSize > 0) && (actualFileIndex+slicesAssembled < list.size())))
       {
          downloadFileList(outputdir);
       }
+      long pending = (long)list.size()-actualFileIndex-slicesAssembled;
+      metrics.gauge(gaugeSlicesPending, (pending > 0) ? pending : 0);
+      metrics.gauge(gaugePipelineQueue, slices.isRunning() ? slices.nextIndex(actualFileIndex+slicesAssembled)-(actualFileIndex+slicesAssembled) : 0);
+      metrics.gauge(gaugeWriterBacklog, asyncWriter ? writer.backlog() : 0);
+   }
+   else
+   {
+      // nothing to do before the next expected slice, short naps keep the writer drained
+      double wait = poller.nextPoll()-GetWallTime();
+      if (wait > 0.02)
+         wait = 0.02;
+      if (wait > 0)
+         usleep((useconds_t)(wait*1e6));
+   }
+   // volumes may be far apart, the rings must not fill meanwhile
+   if ((tracePath != "") && (MonoTime()-traceFlushed >= 1.0))
+   {
+      tracer.flush();
+      traceFlushed = MonoTime();
    }
-   return isTimeToEnd();
+   int finished = isTimeToEnd();
+   metrics.gauge(gaugeIdlePolls, numberOfTries);
+   return finished;
 }
 
 int sFTPGE::closeSession()
 {
     if (mode == 2)
     {
+       stopChangeFeed();
        closeSSH();
        closeSock();
     }
+    else if (mode == 3)
+       scp.stop();
+    else if (mode == 4)
+       pushRx.stop();
+    return 0;
+}
+
+// Runs inotifywait on the console, or a find -newer loop where it is not installed,
+// printing one "EVENTS|time|path" line per change on an exec channel of the SFTP session.
+// The time is the console's: the file mtime from find, the moment of the event from inotifywait.
+int sFTPGE::startChangeFeed()
+{
+    string root = "'";
+    for (int i = 0; i < sftppath.size(); i++)
+    {
+       if (sftppath[i] == '\'')
+          root += "'\\''";
+       else
+          root += sftppath[i];
+    }
+    root += "'";
+
+    char command[2048];
+    snprintf(command, sizeof(command),
+             "R=%s; "
+             "if command -v inotifywait >/dev/null 2>&1; then "
+             "exec inotifywait -m -r -q -e close_write,moved_to,create --timefmt '%%s' --format '%%e|%%T|%%w%%f' \"$R\"; "
+             "else S=/tmp/.scannerConverter.$$; touch \"$S\"; trap 'rm -f \"$S\" \"$S.n\"' EXIT; "
+             "while sleep %.3f; do touch \"$S.n\"; "
+             "find \"$R\" -newer \"$S\" ! -newer \"$S.n\" -printf '%%y|%%T@|%%p\\n' || exit; "
+             "mv \"$S.n\" \"$S\"; done; fi",
+             root.c_str(), feedInterval);
+
+    feedChannel = libssh2_channel_open_session(session);
+    if (!feedChannel)
+    {
+       logMain.writeLog(1, "Unable to open the change feed channel\n");
+       return -1;
+    }
+    if (libssh2_channel_exec(feedChannel, command))
+    {
+       logMain.writeLog(1, "Unable to start the change feed\n");
+       libssh2_channel_free(feedChannel);
+       feedChannel = NULL;
+       return -1;
+    }
+    feedPending = "";
+    feedSynced.clear();
+    logMain.writeLog(1, "Following changes in %s\n", sftppath.c_str());
+    return 0;
+}
+
+// One line of the feed. Folders move the latest exam/series, finished files extend the slice list.
+int sFTPGE::feedEvent(string &line)
+{
+    size_t bar = line.find('|');
+    size_t timeBar = (bar == string::npos) ? bar : line.find('|', bar+1);
+    if (timeBar == string::npos)
+       return 0;
+    string events = line.substr(0, bar);
+    time_t mtime = (time_t) atof(line.substr(bar+1, timeBar-bar-1).c_str());
+    string path = line.substr(timeBar+1);
+    size_t slash = path.rfind('/');
+    if ((slash == string::npos) || (slash == 0) || (slash+1 == path.size()))
+       return 0;
+
+    int isDir = (events == "d") || (events.find("ISDIR") != string::npos);
+    if (isDir)
+    {
+       feedTree.addDir(path);
+       return 1;
+    }
+    // CREATE on a file only means the scanner started writing it
+    if ((events != "f") && (events.find("CLOSE_WRITE") == string::npos) && (events.find("MOVED_TO") == string::npos))
+       return 0;
+
+    string dir = path.substr(0, slash);
+    string name = path.substr(slash+1);
+    fileObject fileObj((char *)name.c_str(), testMode);
+    if ((name[0] == '.') || (!fileObj.isDicomFile()))
+       return 0;
+    string none;
+    feedTree.addFile(dir, name, none, mtime);
+    return 1;
+}
+
+// Reads whatever the feed has sent, waiting up to wait seconds for a whole line.
+// Returns the number of changes seen; a closed feed falls back to folder listing.
+int sFTPGE::pollChangeFeed(double wait)
+{
+    if (feedChannel == NULL)
+       return 0;
+
+    int changes = 0;
+    double deadline = GetWallTime()+wait;
+    char buffer[16384];
+    while (1)
+    {
+       // the session is shared with the fetch and series threads, only the reads hold it
+       int done = 0;
+       {
+          std::lock_guard<std::mutex> lock(sourceMutex);
+          libssh2_session_set_blocking(session, 0);
+          while (1)
+          {
+             ssize_t n = libssh2_channel_read(feedChannel, buffer, sizeof(buffer));
+             if (n > 0)
+             {
+                feedPending.append(buffer, n);
+                continue;
+             }
+             // stderr shares the channel window, an unread message would stall the feed
+             ssize_t e = libssh2_channel_read_stderr(feedChannel, buffer, sizeof(buffer)-1);
+             if (e > 0)
+             {
+                buffer[e] = 0;
+                logMain.writeLog(0, "Change feed: %s", buffer);
+                continue;
+             }
+             if ((n == 0) && (libssh2_channel_eof(feedChannel)))
+             {
+                logMain.writeLog(1, "Change feed closed, listing folders instead\n");
+                libssh2_channel_free(feedChannel);
+                feedChannel = NULL;
+                done = 1;
+             }
+             else if ((n < 0) && (n != LIBSSH2_ERROR_EAGAIN))
+             {
+                logMain.writeLog(1, "Change feed read error %d\n", (int) n);
+                done = 1;
+             }
+             break;
+          }
+          libssh2_session_set_blocking(session, 1);
+       }
+       double left = deadline-GetWallTime();
+       if ((done) || (left <= 0) || (feedPending.find('\n') != string::npos))
+          break;
+
+       // short waits: another thread reading the session may take the feed's packets off the socket
+       if (left > feedWaitStep)
+          left = feedWaitStep;
+       fd_set readSet;
+       struct timeval timeout;
+       FD_ZERO(&readSet);
+       FD_SET(sock, &readSet);
+       timeout.tv_sec = (long) left;
+       timeout.tv_usec = (long) ((left-timeout.tv_sec)*1e6);
+       select(sock+1, &readSet, NULL, NULL, &timeout);
+    }
+
+    size_t start = 0, end;
+    while ((end = feedPending.find('\n', start)) != string::npos)
+    {
+       string line = feedPending.substr(start, end-start);
+       changes += feedEvent(line);
+       start = end+1;
+    }
+    feedPending.erase(0, start);
+    return changes;
+}
+
+int sFTPGE::stopChangeFeed()
+{
+    if (feedChannel == NULL)
+       return 0;
+    // closing the channel hangs up inotifywait/find on the console
+    libssh2_channel_close(feedChannel);
+    libssh2_channel_free(feedChannel);
+    feedChannel = NULL;
     return 0;
 }
 
@@ -7,6 +7,9 @@
  * "sftp 192.168.0.1 user password /tmp/secrets -p|-i|-k"
  */
 
+#ifndef sftp_h
+#define sftp_h
+
 #include <stdlib.h>
 #include "libssh2_config.h"
 #include "libssh2.h"
@@ -30,6 +33,9 @@
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
 
 #include <sys/types.h>
 #include <fcntl.h>
@@ -38,12 +44,30 @@
 #include <ctype.h>
 #include <string>
 #include <vector>
+#include <set>
+#include <mutex>
+#include <memory>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
 #include <time.h>
 #include "memoryDCM.hpp"
+#include "niftiSeries.h"
+#include "niftiWriter.h"
+#include "volumePublisher.h"
+#include "volumeRing.h"
+#include "streamServer.h"
+#include "storeSCP.h"
+#include "pushReceiver.h"
+#include "pollScheduler.h"
+#include "slicePipeline.h"
+#include "metrics.h"
+#include "latencyTrace.h"
+#include "traceEvents.h"
+#include "asyncLog.h"
+#include "deadlineMonitor.h"
+#include "metricsServer.h"
 
 using namespace std;
 
@@ -51,6 +75,8 @@ using namespace std;
 #define timeBetweenChecks 1
 #define maximumTries 2
 #define numDigits 4 // to get before the point in test mode
+#define feedWaitStep 0.02 // seconds between two looks at the change feed while waiting for it
+#define headerSlack 512 // GE slice headers differ by a few bytes (string lengths) within a series
 
 class fileObject
 {
@@ -59,6 +85,9 @@ public:
    int fileIndex;
    time_t time;
    int testMode;
+   unsigned long long size; // listed size, 0 if unknown
+   int complete; // 1 closed by the writer, -1 still open, 0 unknown
+   double seen; // MonoTime of the listing that found it
    
     int isDicomFile()
     {
@@ -118,12 +147,18 @@ public:
     fileObject()
     {
        fileIndex = -1;
+       size = 0;
+       complete = 0;
+       seen = 0;
     }
 
     
     fileObject(char *file, int InTestMode)
     {
        setFilename(file, InTestMode);
+       size = 0;
+       complete = 0;
+       seen = 0;
     }
 };
 
@@ -138,6 +173,7 @@ class LogObject
 	stringstream buffer;
 	fstream outputStream;
 	string fileName;
+	void closeLocked();
 public:
 	// create log file
 	void initializeLogFile(char *filename);
@@ -145,8 +181,11 @@ public:
 	// closes the log file
 	void closeLogFile();
 
-	// writes the message in the log file
+	// queues the message for the log file, format must be a string literal
 	void writeLog(int inScreen, const char * format, ...);
+	// the formatted message, from the log writer
+	void output(const char *timestamp, const string &text, int inScreen);
+	void flushOutput();
         void flushLog();
         void resetLog();
 	LogObject() { fileName = ""; };
@@ -175,6 +214,36 @@ class sFTPGE
     int lastSliceListed;
     int mode;
 
+    // volume being assembled, kept between polls so a partial volume is not read twice
+    struct nifti_1_header volumeHdr;
+    unsigned char *volumeBuffer;
+    unsigned char *volumeData; // where slices are placed: volumeBuffer or the mapped series file
+    size_t volumeSliceBytes;
+    int slicesAssembled;
+    int slabStartSlice;
+    double slabAcqTime;
+    double volumeAcqTime;
+    NiftiSeries series4D;
+    int mappedFailed; // the mapped 4D file could not be reserved, the series goes on one file per volume
+    int isMapped() { return (outputMode == 2) && !mappedFailed; };
+    VolumeJob *currentJob; // owner of volumeBuffer when the writer thread is used
+
+    // remote change feed (mode 2), names reported by inotifywait/find on the console
+    LIBSSH2_CHANNEL *feedChannel;
+    string feedPending; // partial line
+    SliceStore feedTree;
+    set<string> feedSynced; // series folders listed once with readdir
+
+    // slices still being written are parked until the next listing shows them complete
+    size_t expectedFileBytes; // imageStart + slice bytes of the first slice of the series
+    int inotifyFd, seriesWatch; // mode 1
+    set<string> openFiles, closedFiles;
+    string parkedFile;
+
+    // length of the acquisition, learned from the first slice of the series
+    int seriesVolumes; // 0 if the header does not tell
+    double seriesTR;   // seconds, 0 if unknown
+
 public:
     char keyfile1[255];
     char keyfile2[255];
@@ -182,6 +251,36 @@ public:
     string password;
     string sftppath;
     int testMode;
+    int slabSize; // slices per streamed slab, 0 publishes whole volumes only
+    int outputMode; // 0 = one vol_XXXXX.nii per volume, 1 = one 4D file per series, 2 = mapped 4D file
+    int expectedVolumes; // volumes preallocated in the mapped 4D file, 0 if unknown
+    int asyncWriter; // write volumes on the writer thread instead of inline
+    NiftiWriter writer;
+    VolumePublisher publisher;
+    VolumeRing ring; // shared memory copy of the last volumes, enabled by giving it a name
+    StreamServer streamer; // UNIX socket subscribers, enabled by giving it a path
+    SliceStore pushStore;  // slices pushed to the converter (modes 3 and 4)
+    StoreSCP scp;
+    PushReceiver pushRx;
+    int seriesNumber;
+    sFTPGE *hub; // owner of the session, slice store and shared outputs; this object unless it converts one series for a SeriesManager
+    std::mutex sourceMutex; // the SFTP session is used by every series being converted
+    std::mutex outputMutex; // the shared memory ring has a single writer
+    int maxSeries;     // series converted at the same time, 1 keeps the one-series loop
+    int seriesThreads; // worker threads of the SeriesManager
+    PollScheduler poller; // when to list the series folder, follows TR and the slice arrivals
+    SlicePipeline slices; // fetch and parse threads ahead of downloadFileList, off while depth is 0
+    MetricsRegistry totals;  // since the start of the process, what the metrics endpoint serves
+    MetricsRegistry metrics; // latency per stage for the current series, added to the totals of the hub
+    int metricsReportSeen;   // SIGUSR1 count at the last report of this series
+    MetricsServer metricsServer; // Prometheus text over HTTP, enabled by giving it an address
+    LatencyTrace latency; // acquisition to publish of every slice, in latency.tsv of the series output
+    int traceLatency;
+    DeadlineMonitor deadline; // listing of the last slice to publish of every volume against a fraction of the TR
+    string tracePath; // trace.json of the series being converted, while -trace is on
+    double traceFlushed; // MonoTime of the last move of the spans into it
+    int changeFeed; // follow the console through an SSH exec channel instead of listing it (mode 2)
+    double feedInterval; // seconds between find passes when inotifywait is missing
 
     unsigned long hostaddr;
     int port;
@@ -197,6 +296,7 @@ public:
     int getFilelist(string &basedir, vector<fileObject>&list);
     int updateFilelist(string &basedir, vector<fileObject>&list);
     int getFilelistSFTP(string &basedir, vector<fileObject>&list);
+    int getFilelistStore(string &basedir, vector<fileObject>&list);
 
     int saveFile(string &filepath, stringstream &filemem);
 
@@ -208,8 +308,30 @@ public:
 
     int connectSession();
     int getFile(string &filepath, stringstream &filemem);
+    int fetchFile(string &filepath, stringstream &filemem);
     int _getFile(string &filepath, stringstream &filemem);
     int getFileSFTP(string &filepath, stringstream &filemem);
+    int setMode(int newMode);
+    int startChangeFeed();
+    int pollChangeFeed(double wait);
+    int feedEvent(string &line);
+    int stopChangeFeed();
+    int watchSeriesDir(string &dir);
+    int readSeriesEvents();
+    int sliceComplete(fileObject &file);
+    int seriesLength(struct TDICOMdata &d, struct TAcqCounts &counts);
+    int attachTo(sFTPGE *source);
+    int startSeries(string &seriesDir, int number);
+    // series number, and the series counted as active in the metrics
+    void seriesActive(int number);
+    int isDue();
+    int startPipeline();
+    int requestSlices(int from);
+    string metricsReport();
+    // process totals in the Prometheus text format, for the metrics endpoint
+    string metricsExposition();
+    int writeTrace();
+    string seriesDir() { return latestSerieDir; };
     int downloadFileList(string &outputdir);
     int getFileList();
     int closeSock();
@@ -221,11 +343,18 @@ public:
     int getLatestExamDir();
     int getLatestSeriesDir();
     int findInputDir();
+    string findSeriesDir();
     int resetTries();
     int hasNewSeriesDir();
     int cleanUp();
     void setStartTime();
     int saveNifti(char * niiFilename, struct nifti_1_header hdr, unsigned char* im, struct TDCMopts opts);
+    int allocateVolume(size_t bytes);
+    int writeNifti(char *niiFilename, struct nifti_1_header &hdr, unsigned char *im, size_t bytes, int volumeIndex, NiftiSeries *series, struct TDCMopts opts);
+    int placeVolume(string &outputdir, int volumeIndex);
+    int saveVolume(string &outputdir, int volumeIndex, char *outputname, struct TDCMopts opts);
+    int publishSlab(string &outputdir, int volumeIndex, int firstSlice, int lastSlice, struct TDCMopts opts);
+    int freeVolume();
     int indexExists(string &basedir, int indexToCheck, vector<fileObject>&list);
 
     sFTPGE(char *inputpath)
@@ -236,7 +365,7 @@ public:
         
         username = "sdc";
         password = "adw2.0";
-        mode = 1; // directory search
+        mode = 1; // directory search, 2 = SFTP, 3 = DICOM C-STORE receiver, 4 = pushAgent receiver
         if (testMode) 
         {
            hostaddr = htonl(0x7F000001);
@@ -265,10 +394,47 @@ public:
         latestSerieDir   = "";
         previousSerieDir = "";
         lastTime = 0;
-        timeBetweenReads = 0.1;  // 50 ms
+        timeBetweenReads = 0.1;  // until the series TR is known
+        poller.reset(timeBetweenReads);
         lastIndexChecked = -1;
         lastListSize = 0;
         lastSliceListed = 0;
+        slabSize = 0;
+        outputMode = 0;
+        mappedFailed = 0;
+        volumeBuffer = NULL;
+        volumeData = NULL;
+        expectedVolumes = 0;
+        asyncWriter = 0;
+        currentJob = NULL;
+        writer.publisher = &publisher;
+        writer.metrics = &metrics;
+        volumeSliceBytes = 0;
+        slicesAssembled = 0;
+        slabStartSlice = 0;
+        slabAcqTime = 0;
+        volumeAcqTime = 0;
+        seriesNumber = 0;
+        metricsReportSeen = 0;
+        changeFeed = 0;
+        traceLatency = 0;
+        traceFlushed = 0;
+        feedInterval = 0.2;
+        feedChannel = NULL;
+        expectedFileBytes = 0;
+        inotifyFd = -1;
+        seriesWatch = -1;
+        seriesVolumes = 0;
+        seriesTR = 0;
+        hub = this;
+        metrics.total = &totals;
+        maxSeries = 1;
+        seriesThreads = 2;
+    }
+    ~sFTPGE()
+    {
+        if (inotifyFd >= 0)
+           close(inotifyFd);
     }
 };
 
@@ -277,4 +443,4 @@ double GetMTime();
 void reset(stringstream& stream);
 void timeStamp(string &timestamp);
 
-
+#endif /* sftp_h */
@@ -0,0 +1,273 @@
+//
+//  slicePipeline.cpp
+//
+//  Fetch and parse stages running ahead of the assembler.
+//
+
+#include "slicePipeline.h"
+#include <pthread.h>
+#include <sched.h>
+
+TaskQueue::TaskQueue()
+{
+    for (size_t i = 0; i < sliceRingSize; i++)
+       cells[i].sequence.store(i, std::memory_order_relaxed);
+    tail = 0;
+    head = 0;
+}
+
+int TaskQueue::push(SliceTask *task)
+{
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (1)
+    {
+       Cell *cell = &cells[pos & (sliceRingSize-1)];
+       size_t seq = cell->sequence.load(std::memory_order_acquire);
+       intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+       if (diff == 0)
+       {
+          if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+          {
+             cell->task = task;
+             cell->sequence.store(pos+1, std::memory_order_release);
+             return 0;
+          }
+       }
+       else if (diff < 0)
+          return 1; // full
+       else
+          pos = tail.load(std::memory_order_relaxed);
+    }
+}
+
+SliceTask *TaskQueue::pop()
+{
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (1)
+    {
+       Cell *cell = &cells[pos & (sliceRingSize-1)];
+       size_t seq = cell->sequence.load(std::memory_order_acquire);
+       intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+       if (diff == 0)
+       {
+          if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+          {
+             SliceTask *task = cell->task;
+             cell->sequence.store(pos+sliceRingSize, std::memory_order_release);
+             return task;
+          }
+       }
+       else if (diff < 0)
+          return NULL; // empty
+       else
+          pos = head.load(std::memory_order_relaxed);
+    }
+}
+
+SlicePipeline::SlicePipeline()
+{
+    running = false;
+    generation = 0;
+    nextRequest = 0;
+    retryIndex = -1;
+    depth = 0;
+    fetchThreads = 2;
+    parseThreads = 2;
+    fetchCpu = -1;
+    parseCpu = -1;
+    metrics = NULL;
+    for (int i = 0; i < sliceRingSize; i++)
+       ready[i] = NULL;
+}
+
+static void pinThread(std::thread &thread, int cpu)
+{
+    if (cpu < 0)
+       return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+int SlicePipeline::start()
+{
+    if (running || (depth <= 0) || (!fetch))
+       return 1;
+    if (depth >= sliceRingSize)
+       depth = sliceRingSize-1;
+    running = true;
+    for (int i = 0; i < fetchThreads; i++)
+    {
+       int cpu = (fetchCpu < 0) ? -1 : fetchCpu+i;
+       workers.push_back(std::thread(&SlicePipeline::fetchLoop, this, cpu));
+       pinThread(workers.back(), cpu);
+    }
+    for (int i = 0; i < parseThreads; i++)
+    {
+       int cpu = (parseCpu < 0) ? -1 : parseCpu+i;
+       workers.push_back(std::thread(&SlicePipeline::parseLoop, this, cpu));
+       pinThread(workers.back(), cpu);
+    }
+    return 0;
+}
+
+void SlicePipeline::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    notify(wake);
+    for (int i = 0; i < workers.size(); i++)
+       workers[i].join();
+    workers.clear();
+    SliceTask *task;
+    while ((task = toFetch.pop()) != NULL)
+       delete task;
+    while ((task = toParse.pop()) != NULL)
+       delete task;
+    for (int i = 0; i < sliceRingSize; i++)
+       delete ready[i].exchange(NULL);
+    nextRequest = 0;
+    retryIndex = -1;
+}
+
+void SlicePipeline::notify(std::condition_variable &cv)
+{
+    {
+       std::lock_guard<std::mutex> lock(wakeMutex);
+    }
+    cv.notify_all();
+}
+
+int SlicePipeline::request(int index, const string &path)
+{
+    if ((!running) || (index != nextIndex(index)))
+       return 1;
+    SliceTask *task = new SliceTask;
+    task->index = index;
+    task->generation = generation;
+    task->path = path;
+    task->fetchRc = -1;
+    task->traceSeries = tracer.series();
+    memset(&task->counts, 0, sizeof(task->counts));
+    if (toFetch.push(task) != 0)
+    {
+       delete task;
+       return 1;
+    }
+    nextRequest = index+1;
+    notify(wake);
+    return 0;
+}
+
+SliceTask *SlicePipeline::take(int index)
+{
+    if ((!running) || (index >= nextRequest) || (index == retryIndex))
+       return NULL;
+    if (index > retryIndex)
+       retryIndex = -1; // assembled, slices are taken in order
+    std::atomic<SliceTask *> &slot = ready[index & (sliceRingSize-1)];
+    while (running)
+    {
+       // a task is only looked at by whoever swapped it out of the slot
+       SliceTask *task = slot.exchange(NULL);
+       if (task != NULL)
+       {
+          if ((task->index == index) && (task->generation == generation))
+             return task;
+          delete task; // left over from a cancelled request
+       }
+       std::unique_lock<std::mutex> lock(wakeMutex);
+       if (slot.load(std::memory_order_acquire) == NULL)
+          parsed.wait_for(lock, std::chrono::milliseconds(5));
+    }
+    return NULL;
+}
+
+void SlicePipeline::cancel()
+{
+    generation++;
+    nextRequest = 0;
+    retryIndex = -1;
+    for (int i = 0; i < sliceRingSize; i++)
+       delete ready[i].exchange(NULL);
+}
+
+void SlicePipeline::fetchLoop(int cpu)
+{
+    tracer.nameThread("fetch");
+    while (running)
+    {
+       SliceTask *task = toFetch.pop();
+       if (task == NULL)
+       {
+          std::unique_lock<std::mutex> lock(wakeMutex);
+          wake.wait_for(lock, std::chrono::milliseconds(10));
+          continue;
+       }
+       if (task->generation != generation)
+       {
+          delete task;
+          continue;
+       }
+       tracer.setSeries(task->traceSeries);
+       double start = MonoTime();
+       task->fetchRc = fetch(task->path, task->filemem);
+       task->fetched = MonoTime();
+       tracer.span("getFile", start, task->fetched, task->index+1);
+       // in flight slices never exceed depth, there is always room
+       while ((toParse.push(task) != 0) && running)
+          std::this_thread::yield();
+       notify(wake);
+    }
+}
+
+void SlicePipeline::parseLoop(int cpu)
+{
+    tracer.nameThread("parse");
+    while (running)
+    {
+       SliceTask *task = toParse.pop();
+       if (task == NULL)
+       {
+          std::unique_lock<std::mutex> lock(wakeMutex);
+          wake.wait_for(lock, std::chrono::milliseconds(10));
+          continue;
+       }
+       if (task->generation != generation)
+       {
+          delete task;
+          continue;
+       }
+       if (task->fetchRc == 0)
+       {
+          tracer.setSeries(task->traceSeries);
+          TDTI4D unused;
+          double start = MonoTime();
+          task->d = readDICOMv(task->filemem, 0, 0, &unused, &task->counts);
+          task->parsed = MonoTime();
+          tracer.span("readDICOMv", start, task->parsed, task->index+1);
+          if (metrics != NULL)
+          {
+             metrics->record(metricParse, task->parsed-start);
+             metrics->count(counterSlicesParsed);
+          }
+       }
+       if (task->generation != generation)
+       {
+          delete task;
+          continue;
+       }
+       std::atomic<SliceTask *> &slot = ready[task->index & (sliceRingSize-1)];
+       SliceTask *old = slot.exchange(task);
+       if ((old != NULL) && (old->generation == generation))
+       {
+          // cancelled while parsing, the request made since then keeps the slot
+          delete slot.exchange(old);
+       }
+       else
+          delete old;
+       notify(parsed);
+    }
+}
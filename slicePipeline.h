@@ -0,0 +1,107 @@
+//
+//  slicePipeline.h
+//
+//  Fetch and parse stages running ahead of the assembler. The polling loop
+//  lists the series and requests the next slices in order; a pool of fetch
+//  threads reads them (local file, SFTP or slice store), a pool of parse
+//  threads runs readDICOMv, and downloadFileList takes the parsed slices back
+//  in acquisition order. Volumes then go to the NiftiWriter thread, so slice
+//  N+1 is fetched while slice N is parsed and volume V-1 is written.
+//
+//     list (caller) -> toFetch -> fetch pool -> toParse -> parse pool -> ready[index] -> assembler (caller) -> writer
+//
+
+#ifndef slicePipeline_h
+#define slicePipeline_h
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <string>
+#include <sstream>
+#include "memoryDCM.hpp"
+#include "metrics.h"
+#include "traceEvents.h"
+
+using namespace std;
+
+#define sliceRingSize 256 // power of two, more than the slices in flight
+
+struct SliceTask
+{
+    int index;               // position in the series list
+    unsigned int generation; // requests made before the last cancel are dropped
+    string path;
+    stringstream filemem;
+    int fetchRc;             // getFile result
+    double fetched, parsed;  // MonoTime, for the latency trace
+    int traceSeries;         // series of the requesting thread, for the spans of the pool
+    struct TDICOMdata d;
+    struct TAcqCounts counts;
+};
+
+// bounded multi producer / multi consumer ring of task pointers, one sequence number per cell
+class TaskQueue
+{
+    struct Cell
+    {
+       std::atomic<size_t> sequence;
+       SliceTask *task;
+    };
+    Cell cells[sliceRingSize];
+    std::atomic<size_t> tail; // next cell to push
+    std::atomic<size_t> head; // next cell to pop
+public:
+    int push(SliceTask *task);
+    SliceTask *pop();
+    TaskQueue();
+};
+
+class SlicePipeline
+{
+    vector<std::thread> workers;
+    std::atomic<bool> running;
+    TaskQueue toFetch, toParse;
+    std::atomic<SliceTask *> ready[sliceRingSize]; // parsed slices by index % sliceRingSize
+    std::atomic<unsigned int> generation;
+    std::mutex wakeMutex;
+    std::condition_variable wake;   // work for the pools
+    std::condition_variable parsed; // a slice for the assembler
+    int nextRequest;                // caller thread only
+    int retryIndex;                 // slice handed back by retry, read by the caller; -1 if none
+
+    void fetchLoop(int cpu);
+    void parseLoop(int cpu);
+    void notify(std::condition_variable &cv);
+public:
+    int depth;        // slices requested ahead of the assembler, 0 disables the pipeline
+    int fetchThreads;
+    int parseThreads;
+    int fetchCpu;     // first CPU of the fetch pool, -1 leaves placement to the scheduler
+    int parseCpu;
+    std::function<int(string &, stringstream &)> fetch;
+    MetricsRegistry *metrics; // parse times, may be NULL
+
+    int start();
+    void stop();
+    int isRunning() { return running; };
+
+    // caller (assembler) side, slices must be requested in order
+    int nextIndex(int from) { return (nextRequest > from) ? nextRequest : from; };
+    int request(int index, const string &path);
+    // the parsed slice, waiting for it if it was requested; NULL if it was not
+    SliceTask *take(int index);
+    // the slice taken at index stopped the pass (parked or unreadable): the caller reads it
+    // again itself, the slices fetched after it are kept for the next pass
+    void retry(int index) { retryIndex = index; };
+    // drops everything in flight, the next request restarts from its index
+    void cancel();
+
+    SlicePipeline();
+    ~SlicePipeline() { stop(); };
+};
+
+#endif /* slicePipeline_h */
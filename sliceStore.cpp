@@ -0,0 +1,103 @@
+//
+//  sliceStore.cpp
+//
+//  In-memory folder tree for slices that are pushed to the converter.
+//
+
+#include "sliceStore.h"
+
+void SliceStore::addFile(const string &dir, const string &name, string &bytes, time_t mtime)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    string path = dir + "/" + name;
+    map<string, StoredFile>::iterator it = files.find(path);
+    if ((it != files.end()) && (it->second.consumed))
+       return; // sent twice (catch-up and event), already assembled
+    if (it == files.end())
+       dirFiles[dir].push_back(name);
+    StoredFile &file = files[path];
+    file.bytes.swap(bytes);
+    file.time = mtime;
+    file.consumed = 0;
+    bytesReceived += file.bytes.size();
+
+    touchParents(dir);
+}
+
+void SliceStore::addDir(const string &dir)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    touchParents(dir);
+}
+
+void SliceStore::touchParents(const string &dir)
+{
+    // every folder up to the root changes, like a new file showing up on the scanner
+    stamp++;
+    string child = dir;
+    size_t slash = child.rfind('/');
+    dirStamp[child] = stamp;
+    while ((slash != string::npos) && (slash > 0))
+    {
+       string parent = child.substr(0, slash);
+       childDirs[parent].insert(child);
+       dirStamp[parent] = stamp;
+       child = parent;
+       slash = child.rfind('/');
+    }
+}
+
+string SliceStore::latestDir(const string &basedir)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    string latest = "";
+    unsigned long recent = 0;
+    map<string, set<string> >::iterator it = childDirs.find(basedir);
+    if (it == childDirs.end())
+       return latest;
+    for (set<string>::iterator c = it->second.begin(); c != it->second.end(); c++)
+    {
+       if (dirStamp[*c] > recent)
+       {
+          recent = dirStamp[*c];
+          latest = *c;
+       }
+    }
+    return latest;
+}
+
+int SliceStore::listDir(const string &dir, vector<string> &names, vector<time_t> &times)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    map<string, vector<string> >::iterator it = dirFiles.find(dir);
+    if (it == dirFiles.end())
+       return 1;
+    for (int i = 0; i < it->second.size(); i++)
+    {
+       names.push_back(it->second[i]);
+       times.push_back(files[dir + "/" + it->second[i]].time);
+    }
+    return 0;
+}
+
+int SliceStore::getFile(const string &path, stringstream &filemem)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    map<string, StoredFile>::iterator it = files.find(path);
+    if ((it == files.end()) || (it->second.consumed))
+       return -1;
+    // kept until release, a parked or cancelled slice is read again
+    filemem.write(it->second.bytes.data(), it->second.bytes.size());
+    return 0;
+}
+
+void SliceStore::release(const string &path)
+{
+    std::lock_guard<std::mutex> lock(storeMutex);
+    map<string, StoredFile>::iterator it = files.find(path);
+    if (it == files.end())
+       return;
+    // a slice is assembled once, keeping it would grow with the session
+    string().swap(it->second.bytes);
+    it->second.consumed = 1;
+}
@@ -0,0 +1,64 @@
+//
+//  sliceStore.h
+//
+//  In-memory folder tree for slices that are pushed to the converter
+//  instead of being polled from the scanner. Receivers add files under
+//  root/patient/study/series, and sFTPGE lists and reads them exactly like
+//  the scanner's image folders, so the volume assembly is unchanged.
+//
+
+#ifndef sliceStore_h
+#define sliceStore_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <sstream>
+#include <time.h>
+
+using namespace std;
+
+struct StoredFile
+{
+    string bytes;       // released once the slice is in its volume
+    time_t time;        // reception time, used as the file mtime
+    int consumed;
+};
+
+class SliceStore
+{
+    std::mutex storeMutex;
+    map<string, StoredFile> files;        // full path -> contents
+    map<string, vector<string> > dirFiles; // folder -> names in arrival order
+    map<string, set<string> > childDirs;  // folder -> subfolders
+    map<string, unsigned long> dirStamp;  // folder -> last change, newest wins
+    unsigned long stamp;
+    unsigned long long bytesReceived;
+    void touchParents(const string &dir);
+public:
+    // takes the contents of bytes
+    void addFile(const string &dir, const string &name, string &bytes, time_t mtime);
+
+    // a new folder, possibly still empty
+    void addDir(const string &dir);
+
+    // most recently changed subfolder of basedir (full path), empty if none
+    string latestDir(const string &basedir);
+
+    // names and times of the files in dir
+    int listDir(const string &dir, vector<string> &names, vector<time_t> &times);
+
+    // copies the file into filemem, -1 if unknown or already released
+    int getFile(const string &path, stringstream &filemem);
+
+    // frees the file once its slice is in its volume, a copy sent again is ignored
+    void release(const string &path);
+
+    unsigned long long received() { return bytesReceived; };
+
+    SliceStore() { stamp = 0; bytesReceived = 0; };
+};
+
+#endif /* sliceStore_h */
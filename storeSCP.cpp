@@ -0,0 +1,358 @@
+//
+//  storeSCP.cpp
+//
+//  DICOM Storage SCP (C-STORE and C-ECHO, implicit and explicit little
+//  endian) feeding a SliceStore.
+//
+
+#include "storeSCP.h"
+#include "dicomNet.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define scpReadTimeout 5 // seconds a peer may stall in the middle of a PDU
+
+StoreSCP::StoreSCP()
+{
+    listenFd = -1;
+    running = false;
+    store = NULL;
+    aeTitle = "DICOMFTP";
+    port = 0;
+    threads = scpDefaultThreads;
+    associations = 0;
+    slicesReceived = 0;
+    slicesFailed = 0;
+}
+
+int StoreSCP::start()
+{
+    if (running || (store == NULL) || (port <= 0))
+       return 1;
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+       return 2;
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listenFd, 16) != 0))
+    {
+       close(listenFd);
+       listenFd = -1;
+       return 3;
+    }
+    running = true;
+    if (threads < 1)
+       threads = 1;
+    for (int i = 0; i < threads; i++)
+       workers.push_back(std::thread(&StoreSCP::workerLoop, this));
+    acceptor = std::thread(&StoreSCP::acceptLoop, this);
+    return 0;
+}
+
+void StoreSCP::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    queueReady.notify_all();
+    acceptor.join();
+    for (int i = 0; i < workers.size(); i++)
+       workers[i].join();
+    workers.clear();
+    close(listenFd);
+    listenFd = -1;
+}
+
+void StoreSCP::acceptLoop()
+{
+    while (running)
+    {
+       struct pollfd p;
+       p.fd = listenFd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 200) <= 0)
+          continue;
+       int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+       if (fd < 0)
+          continue;
+       int on = 1;
+       setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+       struct timeval timeout;
+       timeout.tv_sec = scpReadTimeout;
+       timeout.tv_usec = 0;
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+       {
+          std::lock_guard<std::mutex> lock(queueMutex);
+          connections.push_back(fd);
+       }
+       queueReady.notify_one();
+    }
+}
+
+void StoreSCP::workerLoop()
+{
+    while (1)
+    {
+       int fd;
+       {
+          std::unique_lock<std::mutex> lock(queueMutex);
+          while (running && (connections.size() == 0))
+             queueReady.wait(lock);
+          if (connections.size() == 0)
+             return;
+          fd = connections.front();
+          connections.pop_front();
+       }
+       associations++;
+       handleAssociation(fd);
+       close(fd);
+    }
+}
+
+// A-ASSOCIATE-RQ -> A-ASSOCIATE-AC, contexts maps accepted presentation context ids to explicit VR,
+// a request with an item or sub-item running past its parent gets an A-ASSOCIATE-RJ and 1
+int StoreSCP::negotiate(int fd, string &rq, map<int, bool> &contexts)
+{
+    if (rq.size() < 68)
+       return 1;
+    const unsigned char *p = (const unsigned char *)rq.data();
+    string ac;
+    putBE16(ac, 1);          // protocol version
+    putBE16(ac, 0);
+    ac.append(rq, 4, 32);    // called and calling AE titles, echoed back
+    ac.append(32, '\0');
+
+    string item;
+    ac += (char)0x10;
+    ac += (char)0;
+    putBE16(ac, strlen(applicationContextUID));
+    ac += applicationContextUID;
+
+    size_t pos = 68;
+    bool malformed = false;
+    while ((pos + 4 <= rq.size()) && !malformed)
+    {
+       unsigned char itemType = p[pos];
+       uint16_t itemLen = getBE16(&p[pos+2]);
+       if (pos + 4 + itemLen > rq.size())
+       {
+          malformed = true;
+          break;
+       }
+       if ((itemType == 0x20) && (itemLen >= 4))
+       {
+          int contextID = p[pos+4];
+          bool hasImplicit = false, hasExplicit = false;
+          size_t sub = pos + 8;
+          while (sub + 4 <= pos + 4 + itemLen)
+          {
+             unsigned char subType = p[sub];
+             uint16_t subLen = getBE16(&p[sub+2]);
+             if (sub + 4 + subLen > pos + 4 + itemLen)
+             {
+                malformed = true;
+                break;
+             }
+             if (subType == 0x40)
+             {
+                string ts((const char *)&p[sub+4], subLen);
+                while ((ts.size() > 0) && (ts[ts.size()-1] == '\0')) ts.erase(ts.size()-1);
+                if (ts == explicitLittleUID) hasExplicit = true;
+                if (ts == implicitLittleUID) hasImplicit = true;
+             }
+             sub += 4 + subLen;
+          }
+          // every storage class is accepted, only the transfer syntax decides
+          string result;
+          result += (char)contextID;
+          result += (char)0;
+          result += (char)((hasExplicit || hasImplicit) ? 0 : 4);
+          result += (char)0;
+          const char *ts = hasExplicit ? explicitLittleUID : implicitLittleUID;
+          result += (char)0x40;
+          result += (char)0;
+          putBE16(result, strlen(ts));
+          result += ts;
+          ac += (char)0x21;
+          ac += (char)0;
+          putBE16(ac, result.size());
+          ac += result;
+          if (hasExplicit || hasImplicit)
+             contexts[contextID] = hasExplicit;
+       }
+       pos += 4 + itemLen;
+    }
+    if (malformed)
+    {
+       // permanent, rejected by the service user, no reason given
+       string rj;
+       rj += (char)0;
+       rj += (char)1;
+       rj += (char)1;
+       rj += (char)1;
+       writePDU(fd, pduAssociateRJ, rj);
+       return 1;
+    }
+
+    string user;
+    user += (char)0x51;
+    user += (char)0;
+    putBE16(user, 4);
+    putBE32(user, maxPDULength);
+    user += (char)0x52;
+    user += (char)0;
+    putBE16(user, strlen(implementationUID));
+    user += implementationUID;
+    ac += (char)0x50;
+    ac += (char)0;
+    putBE16(ac, user.size());
+    ac += user;
+    return writePDU(fd, pduAssociateAC, ac);
+}
+
+int StoreSCP::storeDataSet(const string &sopClass, const string &sopInstance, bool explicitVR, string &dataset)
+{
+    const unsigned char *data = (const unsigned char *)dataset.data();
+    string patient, study, series, instance;
+    findElement(data, dataset.size(), explicitVR, dcmTag(0x0010, 0x0020), patient);
+    findElement(data, dataset.size(), explicitVR, dcmTag(0x0020, 0x000D), study);
+    findElement(data, dataset.size(), explicitVR, dcmTag(0x0020, 0x000E), series);
+    findElement(data, dataset.size(), explicitVR, dcmTag(0x0020, 0x0013), instance);
+    if ((series.size() == 0) || (atoi(instance.c_str()) < 1))
+       return 1;
+    if (patient.size() == 0) patient = "anonymous";
+    if (study.size() == 0) study = "study";
+    for (int i = 0; i < patient.size(); i++)
+       if (patient[i] == '/') patient[i] = '_';
+
+    // same naming as the scanner, the number after the last point is the slice index
+    char name[64];
+    snprintf(name, sizeof(name), "i.MRDC.%d", atoi(instance.c_str()));
+    string file;
+    buildPart10(sopClass, sopInstance, explicitVR ? explicitLittleUID : implicitLittleUID, dataset, file);
+    store->addFile(root + "/" + patient + "/" + study + "/" + series, name, file, time(NULL));
+    return 0;
+}
+
+// waits for the next PDU of an idle association, 0 once stop() was called
+int StoreSCP::waitPDU(int fd)
+{
+    while (running)
+    {
+       struct pollfd p;
+       p.fd = fd;
+       p.events = POLLIN;
+       if (poll(&p, 1, 200) > 0)
+          return 1;
+    }
+    return 0;
+}
+
+int StoreSCP::handleAssociation(int fd)
+{
+    unsigned char type;
+    string body;
+    if (!waitPDU(fd) || (readPDU(fd, type, body, maxPDULength) != 0) || (type != pduAssociateRQ))
+       return 1;
+    map<int, bool> contexts;
+    if (negotiate(fd, body, contexts) != 0)
+       return 2;
+
+    string command, dataset;
+    int contextID = 0;
+    while (waitPDU(fd))
+    {
+       int rc = readPDU(fd, type, body, maxPDULength + 64);
+       if (rc != 0)
+          return 3;
+       if (type == pduReleaseRQ)
+       {
+          writePDU(fd, pduReleaseRP, string(4, '\0'));
+          return 0;
+       }
+       if (type == pduAbort)
+          return 4;
+       if (type != pduData)
+          continue;
+
+       const unsigned char *p = (const unsigned char *)body.data();
+       size_t pos = 0;
+       while (pos + 6 <= body.size())
+       {
+          uint32_t pdvLen = getBE32(&p[pos]);
+          if ((pdvLen < 2) || (pos + 4 + pdvLen > body.size()))
+             return 5;
+          contextID = p[pos+4];
+          unsigned char control = p[pos+5];
+          const char *value = (const char *)&p[pos+6];
+          pos += 4 + pdvLen;
+          if (control & 1)
+             command.append(value, pdvLen-2);
+          else
+             dataset.append(value, pdvLen-2);
+
+          if (!(control & 2))
+             continue; // more fragments
+
+          // the command set is always implicit VR little endian
+          const unsigned char *cmd = (const unsigned char *)command.data();
+          uint16_t commandField = 0, messageID = 0, dataSetType = noDataSet;
+          findElementUS(cmd, command.size(), false, dcmTag(0x0000, 0x0100), commandField);
+          findElementUS(cmd, command.size(), false, dcmTag(0x0000, 0x0110), messageID);
+          findElementUS(cmd, command.size(), false, dcmTag(0x0000, 0x0800), dataSetType);
+          if ((control & 1) && (dataSetType != noDataSet))
+             continue; // wait for the data set
+
+          string sopClass, sopInstance;
+          findElement(cmd, command.size(), false, dcmTag(0x0000, 0x0002), sopClass);
+          findElement(cmd, command.size(), false, dcmTag(0x0000, 0x1000), sopInstance);
+
+          uint16_t status = 0;
+          uint16_t response = cEchoRSP;
+          if (commandField == cStoreRQ)
+          {
+             response = cStoreRSP;
+             map<int, bool>::iterator ctx = contexts.find(contextID);
+             if ((ctx == contexts.end()) || (storeDataSet(sopClass, sopInstance, ctx->second, dataset) != 0))
+             {
+                status = 0xC000; // cannot understand
+                slicesFailed++;
+             }
+             else slicesReceived++;
+          }
+          else if (commandField != cEchoRQ)
+             return 6;
+
+          string rsp, group;
+          putElement(group, dcmTag(0x0000, 0x0002), "UI", sopClass, false);
+          putElementUS(group, dcmTag(0x0000, 0x0100), response, false);
+          putElementUS(group, dcmTag(0x0000, 0x0120), messageID, false);
+          putElementUS(group, dcmTag(0x0000, 0x0800), noDataSet, false);
+          putElementUS(group, dcmTag(0x0000, 0x0900), status, false);
+          if (sopInstance.size() > 0)
+             putElement(group, dcmTag(0x0000, 0x1000), "UI", sopInstance, false);
+          putElementUL(rsp, dcmTag(0x0000, 0x0000), group.size(), false);
+          rsp += group;
+
+          string pdu;
+          putPDV(pdu, contextID, true, true, rsp.data(), rsp.size());
+          if (writePDU(fd, pduData, pdu) != 0)
+             return 7;
+          command.clear();
+          dataset.clear();
+       }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+//
+//  storeSCP.h
+//
+//  DICOM Storage SCP (C-STORE and C-ECHO, implicit and explicit little
+//  endian). Received slices go to a SliceStore under
+//  root/PatientID/StudyInstanceUID/SeriesInstanceUID/i.MRDC.<InstanceNumber>
+//  and never touch the disk.
+//
+
+#ifndef storeSCP_h
+#define storeSCP_h
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <string>
+#include "sliceStore.h"
+
+using namespace std;
+
+#define scpDefaultThreads 4
+
+class StoreSCP
+{
+    int listenFd;
+    std::thread acceptor;
+    vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    deque<int> connections;
+    std::atomic<bool> running;
+
+    void acceptLoop();
+    void workerLoop();
+    int waitPDU(int fd);
+    int handleAssociation(int fd);
+    int negotiate(int fd, string &rq, map<int, bool> &contexts);
+    int storeDataSet(const string &sopClass, const string &sopInstance, bool explicitVR, string &dataset);
+public:
+    SliceStore *store;
+    string root;      // folder the series are stored under, sFTPGE's sftppath
+    string aeTitle;
+    int port;
+    int threads;      // associations served at the same time
+
+    std::atomic<unsigned long> associations, slicesReceived, slicesFailed;
+
+    int start();
+    void stop();
+
+    StoreSCP();
+    ~StoreSCP() { stop(); };
+};
+
+#endif /* storeSCP_h */
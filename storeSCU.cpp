@@ -0,0 +1,223 @@
+//
+//  storeSCU.cpp
+//
+//  Minimal C-STORE sender replaying a recorded series into the converter's
+//  receiver, the push counterpart of copySlices.py.
+//
+//  storeSCU host port seriesDir [msBetweenSlices] [calledAE]
+//
+
+#include "dicomNet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct SliceFile
+{
+    string path;
+    int index;
+    string sopClass, sopInstance, transferSyntax;
+    size_t datasetStart;
+};
+
+static bool sliceOrder(const SliceFile &a, const SliceFile &b)
+{
+    return a.index < b.index;
+}
+
+static int readFile(const string &path, string &bytes)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
+       return 1;
+    stringstream s;
+    s << file.rdbuf();
+    bytes = s.str();
+    return 0;
+}
+
+static void putItem(string &out, unsigned char type, const string &value)
+{
+    out += (char)type;
+    out += (char)0;
+    putBE16(out, value.size());
+    out += value;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+       fprintf(stderr, "usage: %s host port seriesDir [msBetweenSlices] [calledAE]\n", argv[0]);
+       return 1;
+    }
+    double delayMs = (argc > 4) ? atof(argv[4]) : 0;
+    string calledAE = (argc > 5) ? argv[5] : "DICOMFTP";
+
+    // slices in acquisition order, by the number after the last point like the converter
+    vector<SliceFile> slices;
+    DIR *dp = opendir(argv[3]);
+    if (dp == NULL)
+    {
+       fprintf(stderr, "Error opening %s\n", argv[3]);
+       return 2;
+    }
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL)
+    {
+       if (dirp->d_name[0] == '.')
+          continue;
+       SliceFile slice;
+       slice.path = string(argv[3]) + "/" + dirp->d_name;
+       const char *point = strrchr(dirp->d_name, '.');
+       slice.index = (point != NULL) ? atoi(point+1) : 0;
+       string bytes;
+       if ((readFile(slice.path, bytes) != 0) || (splitPart10(bytes, slice.sopClass, slice.sopInstance, slice.transferSyntax, slice.datasetStart) != 0))
+          continue;
+       if ((slice.transferSyntax != implicitLittleUID) && (slice.transferSyntax != explicitLittleUID))
+       {
+          fprintf(stderr, "Skipping %s, transfer syntax %s\n", slice.path.c_str(), slice.transferSyntax.c_str());
+          continue;
+       }
+       slices.push_back(slice);
+    }
+    closedir(dp);
+    sort(slices.begin(), slices.end(), sliceOrder);
+    if (slices.size() == 0)
+    {
+       fprintf(stderr, "No DICOM files in %s\n", argv[3]);
+       return 3;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    addr.sin_addr.s_addr = inet_addr(argv[1]);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+       fprintf(stderr, "Unable to connect to %s:%s\n", argv[1], argv[2]);
+       return 4;
+    }
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    // one presentation context per SOP class / transfer syntax pair
+    map<string, int> contextOf;
+    string rq;
+    putBE16(rq, 1);
+    putBE16(rq, 0);
+    string called = calledAE, calling = "STORESCU";
+    called.resize(16, ' ');
+    calling.resize(16, ' ');
+    rq += called;
+    rq += calling;
+    rq.append(32, '\0');
+    putItem(rq, 0x10, applicationContextUID);
+    int nextID = 1;
+    for (int i = 0; i < slices.size(); i++)
+    {
+       string key = slices[i].sopClass + "|" + slices[i].transferSyntax;
+       if (contextOf.find(key) != contextOf.end())
+          continue;
+       contextOf[key] = nextID;
+       string pc;
+       pc += (char)nextID;
+       pc.append(3, '\0');
+       putItem(pc, 0x30, slices[i].sopClass);
+       putItem(pc, 0x40, slices[i].transferSyntax);
+       putItem(rq, 0x20, pc);
+       nextID += 2;
+    }
+    string user, maxLen;
+    putBE32(maxLen, maxPDULength);
+    putItem(user, 0x51, maxLen);
+    putItem(user, 0x52, implementationUID);
+    putItem(rq, 0x50, user);
+    writePDU(sock, pduAssociateRQ, rq);
+
+    unsigned char type;
+    string body;
+    if ((readPDU(sock, type, body, maxPDULength) != 0) || (type != pduAssociateAC))
+    {
+       fprintf(stderr, "Association rejected\n");
+       return 5;
+    }
+    // receiver's maximum PDU
+    size_t maxPDU = 16384;
+    for (size_t pos = 68; pos + 4 <= body.size(); )
+    {
+       const unsigned char *p = (const unsigned char *)body.data();
+       uint16_t len = getBE16(&p[pos+2]);
+       if (p[pos] == 0x50)
+       {
+          for (size_t sub = pos+4; sub + 4 <= pos+4+len; sub += 4 + getBE16(&p[sub+2]))
+             if ((p[sub] == 0x51) && (getBE32(&p[sub+4]) > 0))
+                maxPDU = getBE32(&p[sub+4]);
+       }
+       pos += 4 + len;
+    }
+
+    int sent = 0;
+    for (int i = 0; i < slices.size(); i++)
+    {
+       string bytes;
+       if (readFile(slices[i].path, bytes) != 0)
+          continue;
+       int contextID = contextOf[slices[i].sopClass + "|" + slices[i].transferSyntax];
+
+       string cmd, group;
+       putElement(group, dcmTag(0x0000, 0x0002), "UI", slices[i].sopClass, false);
+       putElementUS(group, dcmTag(0x0000, 0x0100), cStoreRQ, false);
+       putElementUS(group, dcmTag(0x0000, 0x0110), (uint16_t)(i+1), false);
+       putElementUS(group, dcmTag(0x0000, 0x0700), 0, false);
+       putElementUS(group, dcmTag(0x0000, 0x0800), 0, false);
+       putElement(group, dcmTag(0x0000, 0x1000), "UI", slices[i].sopInstance, false);
+       putElementUL(cmd, dcmTag(0x0000, 0x0000), group.size(), false);
+       cmd += group;
+       string pdu;
+       putPDV(pdu, contextID, true, true, cmd.data(), cmd.size());
+       writePDU(sock, pduData, pdu);
+
+       size_t fragment = maxPDU - 6;
+       for (size_t pos = slices[i].datasetStart; pos < bytes.size(); pos += fragment)
+       {
+          size_t len = min(fragment, bytes.size() - pos);
+          pdu.clear();
+          putPDV(pdu, contextID, false, pos + len >= bytes.size(), &bytes[pos], len);
+          writePDU(sock, pduData, pdu);
+       }
+
+       if ((readPDU(sock, type, body, maxPDULength) != 0) || (type != pduData))
+       {
+          fprintf(stderr, "No response for %s\n", slices[i].path.c_str());
+          break;
+       }
+       uint16_t status = 0xFFFF;
+       if (body.size() > 6)
+          findElementUS((const unsigned char *)&body[6], body.size()-6, false, dcmTag(0x0000, 0x0900), status);
+       if (status != 0)
+          fprintf(stderr, "Slice %s status %04X\n", slices[i].path.c_str(), status);
+       else sent++;
+       if (delayMs > 0)
+          usleep((useconds_t)(delayMs * 1000));
+    }
+
+    writePDU(sock, pduReleaseRQ, string(4, '\0'));
+    readPDU(sock, type, body, maxPDULength);
+    close(sock);
+    fprintf(stderr, "%d of %d slices stored\n", sent, (int)slices.size());
+    return (sent == (int)slices.size()) ? 0 : 6;
+}
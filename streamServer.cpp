@@ -0,0 +1,275 @@
+//
+//  streamServer.cpp
+//
+//  Local streaming of converted volumes over a UNIX socket.
+//
+
+#include "streamServer.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+double GetMTime();
+
+int StreamServer::start()
+{
+    if (running || !isEnabled())
+       return 0;
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+       return 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if ((bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listenFd, 8) != 0))
+    {
+       close(listenFd);
+       listenFd = -1;
+       return 2;
+    }
+    running = true;
+    worker = std::thread(&StreamServer::run, this);
+    return 0;
+}
+
+void StreamServer::stop()
+{
+    if (!running)
+       return;
+    running = false;
+    worker.join();
+    close(listenFd);
+    listenFd = -1;
+    unlink(path.c_str());
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    while (clients.size() > 0)
+       dropClient(clients.size()-1);
+}
+
+int StreamServer::subscribers()
+{
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    return clients.size();
+}
+
+void StreamServer::dropClient(int i)
+{
+    close(clients[i]->fd);
+    delete clients[i];
+    clients.erase(clients.begin()+i);
+}
+
+void StreamServer::parseFilter(StreamClient *client, char *line)
+{
+    if (strncmp(line, "SUB", 3) != 0)
+       return;
+    char *token = strtok(line+3, " \t\r\n");
+    while (token != NULL)
+    {
+       if (!strncmp(token, "series=", 7))
+          client->seriesFilter = (token[7] == '*') ? -1 : atoi(token+7);
+       else if (!strncmp(token, "slices=", 7))
+          sscanf(token+7, "%d-%d", &client->firstSlice, &client->lastSlice);
+       else if (!strncmp(token, "type=", 5))
+       {
+          client->wantVolumes = (!strcmp(token+5, "volume")) || (!strcmp(token+5, "all"));
+          client->wantSlabs = (!strcmp(token+5, "slab")) || (!strcmp(token+5, "all"));
+       }
+       token = strtok(NULL, " \t\r\n");
+    }
+}
+
+void StreamServer::run()
+{
+    while (running)
+    {
+       // frames go out from broadcast, this thread handles connections, filters, hangups and
+       // the tails slow subscribers did not take, which would otherwise wait for the next frame
+       vector<struct pollfd> fds;
+       struct pollfd p;
+       p.fd = listenFd;
+       p.events = POLLIN;
+       fds.push_back(p);
+       {
+          std::lock_guard<std::mutex> lock(clientsMutex);
+          for (int i = 0; i < clients.size(); i++)
+          {
+             p.fd = clients[i]->fd;
+             p.events = POLLIN | ((clients[i]->pending.size() > 0) ? POLLOUT : 0);
+             fds.push_back(p);
+          }
+       }
+       if (poll(&fds[0], fds.size(), 200) <= 0)
+          continue;
+
+       if (fds[0].revents & POLLIN)
+       {
+          int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd >= 0)
+          {
+             int sndbuf = 8*1024*1024;
+             setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+             StreamClient *client = new StreamClient;
+             client->fd = fd;
+             client->seriesFilter = -1;
+             client->firstSlice = -1;
+             client->lastSlice = -1;
+             client->wantVolumes = 1;
+             client->wantSlabs = 0;
+             client->lastSeries = -1;
+             std::lock_guard<std::mutex> lock(clientsMutex);
+             clients.push_back(client);
+          }
+       }
+
+       std::lock_guard<std::mutex> lock(clientsMutex);
+       for (int k = 1; k < fds.size(); k++)
+       {
+          if (!(fds[k].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+             continue;
+          for (int i = 0; i < clients.size(); i++)
+          {
+             if (clients[i]->fd != fds[k].fd)
+                continue;
+             if ((fds[k].revents & POLLOUT) && (sendPending(clients[i]) != 0))
+             {
+                dropClient(i);
+                break;
+             }
+             if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                break;
+             char line[256];
+             ssize_t n = recv(fds[k].fd, line, sizeof(line)-1, MSG_DONTWAIT);
+             if (n > 0)
+             {
+                line[n] = 0;
+                parseFilter(clients[i], line);
+             }
+             else if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+                dropClient(i);
+             break;
+          }
+       }
+    }
+}
+
+// whatever the socket takes of the unsent tail, 1 if the subscriber is gone
+int StreamServer::sendPending(StreamClient *client)
+{
+    if (client->pending.size() == 0)
+       return 0;
+    ssize_t n = send(client->fd, client->pending.data(), client->pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if ((n < 0) && (errno != EAGAIN) && (errno != EINTR))
+       return 1;
+    if (n > 0)
+       client->pending.erase(0, n);
+    return 0;
+}
+
+int StreamServer::sendFrame(StreamClient *client, StreamFrame &frame, const void *payload, size_t bytes)
+{
+    // finish the previous frame first, frames are never interleaved
+    if (client->pending.size() > 0)
+    {
+       if (sendPending(client) != 0)
+          return 1;
+       if (client->pending.size() + sizeof(frame) + bytes > streamMaxPending)
+          return 1;
+       if (client->pending.size() > 0)
+       {
+          client->pending.append((char *)&frame, sizeof(frame));
+          client->pending.append((const char *)payload, bytes);
+          return 0;
+       }
+    }
+
+    // header and voxels straight from the volume buffer, no staging copy
+    struct iovec iov[2];
+    iov[0].iov_base = &frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = bytes;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+    {
+       if (errno != EAGAIN)
+          return 1;
+       n = 0;
+    }
+    size_t total = sizeof(frame) + bytes;
+    if (n < (ssize_t)total)
+    {
+       if (total - n > streamMaxPending)
+          return 1;
+       // only the part the socket did not take is copied
+       if (n < (ssize_t)sizeof(frame))
+       {
+          client->pending.append((char *)&frame + n, sizeof(frame) - n);
+          client->pending.append((const char *)payload, bytes);
+       }
+       else client->pending.append((const char *)payload + (n - sizeof(frame)), total - n);
+    }
+    return 0;
+}
+
+void StreamServer::broadcast(int type, int seriesNumber, int volumeIndex, struct nifti_1_header &hdr, unsigned char *im, size_t sliceBytes, int firstSlice, int lastSlice, double acquisitionTime)
+{
+    if (!running)
+       return;
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    for (int i = clients.size()-1; i >= 0; i--)
+    {
+       StreamClient *client = clients[i];
+       if ((client->seriesFilter >= 0) && (client->seriesFilter != seriesNumber))
+          continue;
+       if (((type == streamVolume) && !client->wantVolumes) || ((type == streamSlab) && !client->wantSlabs))
+          continue;
+
+       // intersection of the frame's slices with the subscriber's ROI
+       int first = firstSlice, last = lastSlice;
+       if (client->firstSlice >= 0)
+       {
+          if (client->firstSlice > first) first = client->firstSlice;
+          if (client->lastSlice < last) last = client->lastSlice;
+       }
+       if (first > last)
+          continue;
+
+       StreamFrame frame;
+       memset(&frame, 0, sizeof(frame));
+       frame.magic = streamMagic;
+       frame.seriesNumber = seriesNumber;
+       frame.volumeIndex = volumeIndex;
+       frame.acquisitionTime = acquisitionTime;
+       frame.publishTime = GetMTime();
+       int rc = 0;
+       if (client->lastSeries != seriesNumber)
+       {
+          frame.type = streamSeriesHeader;
+          frame.firstSlice = 0;
+          frame.lastSlice = hdr.dim[3]-1;
+          frame.payloadBytes = sizeof(hdr);
+          rc = sendFrame(client, frame, &hdr, sizeof(hdr));
+          client->lastSeries = seriesNumber;
+       }
+       frame.type = type;
+       frame.firstSlice = first;
+       frame.lastSlice = last;
+       frame.payloadBytes = (uint64_t)(last-first+1) * sliceBytes;
+       if (rc == 0)
+          rc = sendFrame(client, frame, im + (size_t)(first-firstSlice) * sliceBytes, frame.payloadBytes);
+       if (rc != 0)
+          dropClient(i);
+    }
+}
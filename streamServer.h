@@ -0,0 +1,84 @@
+//
+//  streamServer.h
+//
+//  Local streaming of converted volumes over a UNIX socket. A subscriber
+//  connects, may send one filter line
+//
+//     SUB series=<n|*> slices=<first>-<last> type=<volume|slab|all>
+//
+//  and then receives frames: a StreamFrame with type streamSeriesHeader and
+//  the NIfTI header once per series, then one frame per volume (or slab)
+//  followed by its voxels.
+//
+
+#ifndef streamServer_h
+#define streamServer_h
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "memoryDCM.hpp"
+
+using namespace std;
+
+#define streamMagic 0x4649494E // "NIIF" little-endian
+#define streamSeriesHeader 1
+#define streamVolume 2
+#define streamSlab 3
+#define streamMaxPending (64*1024*1024) // a subscriber this far behind is dropped
+
+struct StreamFrame
+{
+    uint32_t magic;
+    uint32_t type;
+    int32_t seriesNumber;
+    int32_t volumeIndex;
+    int32_t firstSlice;   // z range of the voxels in this frame, inclusive
+    int32_t lastSlice;
+    double acquisitionTime;
+    double publishTime;
+    uint64_t payloadBytes;
+};
+
+struct StreamClient
+{
+    int fd;
+    int seriesFilter;   // -1 = any
+    int firstSlice, lastSlice; // -1 = whole volume
+    int wantVolumes, wantSlabs;
+    int lastSeries;     // series whose header was already sent
+    string pending;     // tail of a frame the socket did not take
+};
+
+class StreamServer
+{
+    int listenFd;
+    std::thread worker;
+    std::atomic<bool> running;
+    std::mutex clientsMutex;
+    vector<StreamClient *> clients;
+
+    void run();
+    void parseFilter(StreamClient *client, char *line);
+    int sendPending(StreamClient *client);
+    int sendFrame(StreamClient *client, StreamFrame &frame, const void *payload, size_t bytes);
+    void dropClient(int i);
+public:
+    string path;
+
+    int start();
+    void stop();
+    int isEnabled() { return path.size() > 0; };
+    int subscribers();
+
+    // sends one frame per matching subscriber, never blocks on a slow one
+    void broadcast(int type, int seriesNumber, int volumeIndex, struct nifti_1_header &hdr, unsigned char *im, size_t sliceBytes, int firstSlice, int lastSlice, double acquisitionTime);
+
+    StreamServer() { listenFd = -1; running = false; };
+    ~StreamServer() { stop(); };
+};
+
+#endif /* streamServer_h */
@@ -0,0 +1,202 @@
+//
+//  traceEvents.cpp
+//
+//  Timeline of the conversion in Chrome trace-event JSON.
+//
+
+#include "traceEvents.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+Tracer tracer;
+
+// gives the buffer back when the thread ends (pipeline threads come and go with the series)
+struct ThreadBuffer
+{
+    TraceBuffer *buffer;
+    ThreadBuffer() : buffer(NULL) {};
+    ~ThreadBuffer() { if (buffer != NULL) tracer.release(buffer); };
+};
+
+static thread_local ThreadBuffer threadBuffer;
+static thread_local int threadSeries = 0;
+
+TraceBuffer::TraceBuffer() : head(0), tail(0), dropped(0), owned(1)
+{
+    tid = syscall(SYS_gettid);
+    name[0] = 0;
+}
+
+int TraceBuffer::push(const TraceSpan &span)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= traceBufferSpans)
+    {
+       dropped++;
+       return 1;
+    }
+    spans[h & (traceBufferSpans-1)] = span;
+    head.store(h+1, std::memory_order_release);
+    return 0;
+}
+
+TraceBuffer *Tracer::local()
+{
+    if (threadBuffer.buffer != NULL)
+       return threadBuffer.buffer;
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    for (int b = 0; b < buffers.size(); b++)
+    {
+       TraceBuffer *buffer = buffers[b];
+       if ((!buffer->owned) && (buffer->head == buffer->tail))
+       {
+          buffer->owned = 1;
+          buffer->tid = syscall(SYS_gettid);
+          buffer->name[0] = 0;
+          threadBuffer.buffer = buffer;
+          return buffer;
+       }
+    }
+    threadBuffer.buffer = new TraceBuffer();
+    buffers.push_back(threadBuffer.buffer);
+    return threadBuffer.buffer;
+}
+
+void Tracer::span(const char *name, double begin, double end, int slice, int volume)
+{
+    if (!enabled)
+       return;
+    TraceSpan span;
+    span.name = name;
+    span.begin = begin;
+    span.end = end;
+    span.slice = slice;
+    span.volume = volume;
+    span.series = threadSeries;
+    local()->push(span);
+}
+
+void Tracer::nameThread(const char *name)
+{
+    if (!enabled)
+       return;
+    TraceBuffer *buffer = local();
+    strncpy(buffer->name, name, sizeof(buffer->name)-1);
+    buffer->name[sizeof(buffer->name)-1] = 0;
+}
+
+int Tracer::series()
+{
+    return threadSeries;
+}
+
+void Tracer::setSeries(int series)
+{
+    threadSeries = series;
+}
+
+int Tracer::open(int series, const char *path)
+{
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    map<int, TraceFile>::iterator f = files.find(series);
+    if (f != files.end())
+    {
+       finish(f->second);
+       files.erase(f);
+    }
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+       return -1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    TraceFile &file = files[series];
+    file.fp = fp;
+    file.separator = "";
+    file.spans = 0;
+    return 0;
+}
+
+// buffersMutex held, the only reader of the rings; spans of a series without an open trace are dropped
+void Tracer::collect()
+{
+    int pid = getpid();
+    for (int b = 0; b < buffers.size(); b++)
+    {
+       TraceBuffer *buffer = buffers[b];
+       size_t h = buffer->head.load(std::memory_order_acquire);
+       for (size_t i = buffer->tail.load(std::memory_order_relaxed); i < h; i++)
+       {
+          TraceSpan &span = buffer->spans[i & (traceBufferSpans-1)];
+          map<int, TraceFile>::iterator f = files.find(span.series);
+          if (f == files.end())
+             continue;
+          TraceFile &file = f->second;
+          if ((buffer->name[0] != 0) && file.named.insert(buffer->tid).second)
+          {
+             fprintf(file.fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}", file.separator, pid, buffer->tid, buffer->name);
+             file.separator = ",\n";
+          }
+          fprintf(file.fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{", file.separator,
+                  span.name, span.begin*1e6, (span.end-span.begin)*1e6, pid, buffer->tid);
+          const char *arg = "";
+          if (span.slice > 0)
+          {
+             fprintf(file.fp, "\"slice\":%d", span.slice);
+             arg = ",";
+          }
+          if (span.volume > 0)
+             fprintf(file.fp, "%s\"volume\":%d", arg, span.volume);
+          fprintf(file.fp, "}}");
+          file.separator = ",\n";
+          file.spans++;
+       }
+       buffer->tail.store(h, std::memory_order_release);
+       // the lost spans could belong to any series, every open trace shows the gap
+       unsigned long dropped = buffer->dropped.exchange(0);
+       for (map<int, TraceFile>::iterator f = files.begin(); (dropped > 0) && (f != files.end()); f++)
+       {
+          fprintf(f->second.fp, "%s{\"name\":\"dropped %lu spans\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld}", f->second.separator, dropped, MonoTime()*1e6, pid, buffer->tid);
+          f->second.separator = ",\n";
+       }
+    }
+}
+
+int Tracer::finish(TraceFile &file)
+{
+    fprintf(file.fp, "\n]}\n");
+    return (fclose(file.fp) == 0) ? file.spans : -1;
+}
+
+void Tracer::flush()
+{
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    collect();
+}
+
+int Tracer::close(int series)
+{
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    map<int, TraceFile>::iterator f = files.find(series);
+    if (f == files.end())
+       return -1;
+    collect();
+    int spans = finish(f->second);
+    files.erase(f);
+    return spans;
+}
+
+TraceScope::TraceScope(const char *spanName, int sliceIndex, int volumeIndex)
+{
+    name = spanName;
+    slice = sliceIndex;
+    volume = volumeIndex;
+    begin = tracer.enabled ? MonoTime() : 0;
+}
+
+TraceScope::~TraceScope()
+{
+    if (tracer.enabled)
+       tracer.span(name, begin, MonoTime(), slice, volume);
+}
@@ -0,0 +1,106 @@
+//
+//  traceEvents.h
+//
+//  Timeline of the conversion in Chrome trace-event JSON (chrome://tracing,
+//  ui.perfetto.dev). Every thread records its spans (listing, fetch, parse,
+//  assembly, writes) into its own buffer, a single producer ring that needs
+//  no lock. Spans carry the series their thread works for; the buffers are
+//  drained into the open trace.json of each series as volumes are published,
+//  and the file is ended when the series ends, so series converted at the
+//  same time keep separate timelines. Off unless -trace is given, then a
+//  span costs two clock reads and a store.
+//
+
+#ifndef traceEvents_h
+#define traceEvents_h
+
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <set>
+
+using namespace std;
+
+#define traceBufferSpans 16384 // per thread, power of two, spans beyond it before a flush are dropped
+
+struct TraceSpan
+{
+    const char *name; // string literal
+    double begin, end; // MonoTime
+    int slice, volume; // 1 based, 0 if not known
+    int series;        // series number, 0 outside any series (not kept)
+};
+
+class TraceBuffer
+{
+public:
+    TraceSpan spans[traceBufferSpans];
+    std::atomic<size_t> head;  // next span, owner thread only
+    std::atomic<size_t> tail;  // first span not written yet, trace writer only
+    std::atomic<unsigned long> dropped;
+    std::atomic<int> owned;  // its thread is still running
+    long tid;
+    char name[32];
+    int push(const TraceSpan &span);
+    TraceBuffer();
+};
+
+// trace.json of a series, open until the series ends
+struct TraceFile
+{
+    FILE *fp;
+    const char *separator;
+    int spans;
+    set<long> named; // threads whose name is already in the file
+};
+
+class Tracer
+{
+    std::mutex buffersMutex; // buffers live until exit, reused once their thread ended and they were written
+    vector<TraceBuffer *> buffers;
+    map<int, TraceFile> files; // by series number, under buffersMutex
+    TraceBuffer *local();
+    void collect();
+    int finish(TraceFile &file);
+public:
+    void release(TraceBuffer *buffer) { buffer->owned = 0; };
+    int enabled;
+    void span(const char *name, double begin, double end, int slice = 0, int volume = 0);
+    void nameThread(const char *name);
+    // series the spans of the calling thread belong to
+    int series();
+    void setSeries(int series);
+    // starts the trace of a series, 0 or -1
+    int open(int series, const char *path);
+    // moves the spans recorded so far into the traces of their series
+    void flush();
+    // flushes and ends the trace of a series, returns its number of spans or -1
+    int close(int series);
+    Tracer() : enabled(0) {};
+};
+
+extern Tracer tracer;
+
+// spans of this thread belong to a series until the end of the scope
+class TraceSeries
+{
+    int previous;
+public:
+    TraceSeries(int series) { previous = tracer.series(); tracer.setSeries(series); };
+    ~TraceSeries() { tracer.setSeries(previous); };
+};
+
+// span from construction to the end of the scope
+class TraceScope
+{
+    const char *name;
+    double begin;
+    int slice, volume;
+public:
+    TraceScope(const char *spanName, int sliceIndex = 0, int volumeIndex = 0);
+    ~TraceScope();
+};
+
+#endif /* traceEvents_h */
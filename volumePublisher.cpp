@@ -0,0 +1,72 @@
+//
+//  volumePublisher.cpp
+//
+//  Tells consumers that an output file is complete: a manifest in the series
+//  folder replaced atomically, and an optional datagram on a UNIX socket.
+//
+
+#include "volumePublisher.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+double GetMTime();
+
+void tempName(const char *finalName, char *tmp, size_t len)
+{
+    const char *slash = strrchr(finalName, '/');
+    if (slash == NULL)
+       snprintf(tmp, len, ".%s.tmp", finalName);
+    else
+       snprintf(tmp, len, "%.*s/.%s.tmp", (int)(slash-finalName), finalName, slash+1);
+}
+
+VolumePublisher::~VolumePublisher()
+{
+    if (sock >= 0)
+       close(sock);
+}
+
+int VolumePublisher::commit(const char *tmpName, const char *finalName)
+{
+    return rename(tmpName, finalName);
+}
+
+int VolumePublisher::published(const char *fileName, int volumeIndex)
+{
+    // the manifest always holds the highest sequence, and its temporary file has a single writer
+    std::lock_guard<std::mutex> lock(publishMutex);
+    unsigned long seq = ++sequence;
+    char line[2200];
+    const char *slash = strrchr(fileName, '/');
+    snprintf(line, sizeof(line), "%lu %d %s %.3f\n", seq, volumeIndex, (slash != NULL) ? slash+1 : fileName, GetMTime());
+
+    // manifest: whole file replaced by rename so readers never see a partial line
+    string dir = (slash != NULL) ? string(fileName, slash-fileName) : string(".");
+    string manifest = dir + "/" + manifestName;
+    char tmp[2048];
+    tempName(manifest.c_str(), tmp, sizeof(tmp));
+    FILE *fp = fopen(tmp, "w");
+    if (fp)
+    {
+       fputs(line, fp);
+       fclose(fp);
+       rename(tmp, manifest.c_str());
+    }
+
+    if (notifyPath.size() > 0)
+    {
+       if (sock < 0)
+          sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+       struct sockaddr_un addr;
+       memset(&addr, 0, sizeof(addr));
+       addr.sun_family = AF_UNIX;
+       strncpy(addr.sun_path, notifyPath.c_str(), sizeof(addr.sun_path)-1);
+       // nobody listening is not an error, the manifest is still there
+       sendto(sock, line, strlen(line), MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    return 0;
+}
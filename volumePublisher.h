@@ -0,0 +1,42 @@
+//
+//  volumePublisher.h
+//
+//  Tells consumers that an output file is complete: a manifest in the series
+//  folder replaced atomically, and an optional datagram on a UNIX socket.
+//
+
+#ifndef volumePublisher_h
+#define volumePublisher_h
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+#define manifestName "manifest.txt"
+
+class VolumePublisher
+{
+    std::atomic<unsigned long> sequence;
+    std::mutex publishMutex; // the ingest and writer threads publish, one manifest and socket
+    int sock;
+public:
+    string notifyPath; // UNIX datagram socket of the consumer, empty to disable
+
+    // renames tmpName to finalName, the complete file appears in a single step
+    int commit(const char *tmpName, const char *finalName);
+
+    // updates the manifest next to fileName and pings the consumer, from any thread
+    int published(const char *fileName, int volumeIndex);
+
+    unsigned long lastSequence() { return sequence; };
+
+    VolumePublisher() { sequence = 0; sock = -1; };
+    ~VolumePublisher();
+};
+
+// temporary name used while writing, hidden so vol_*.nii never matches it
+void tempName(const char *finalName, char *tmp, size_t len);
+
+#endif /* volumePublisher_h */
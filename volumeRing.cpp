@@ -0,0 +1,198 @@
+//
+//  volumeRing.cpp
+//
+//  POSIX shared memory ring with the last N converted volumes, so local
+//  consumers can map it read-only instead of re-reading the .nii files.
+//
+
+#include "volumeRing.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+double GetMTime();
+
+static long futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    // shared futex (no FUTEX_PRIVATE_FLAG), waiters live in other processes
+    return syscall(SYS_futex, (uint32_t *)addr, op, val, timeout, NULL, 0);
+}
+
+static size_t alignUp(size_t v, size_t a)
+{
+    return (v + a - 1) & ~(a - 1);
+}
+
+int VolumeRing::create(size_t volumeBytes)
+{
+    closeRing();
+    if (slots < 1)
+       slots = ringDefaultSlots;
+    size_t headerBytes = alignUp(sizeof(RingHeader), 64);
+    size_t stride = alignUp(sizeof(SlotHeader), 64) + alignUp(volumeBytes, 64);
+    mapBytes = headerBytes + stride * slots;
+
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+       return 1;
+    if (ftruncate(fd, mapBytes) != 0)
+    {
+       closeRing();
+       return 2;
+    }
+    void *mem = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+       mapBytes = 0;
+       closeRing();
+       return 3;
+    }
+    base = (unsigned char *)mem;
+    header = (RingHeader *)base;
+    header->slots = slots;
+    header->headerBytes = headerBytes;
+    header->slotStride = stride;
+    header->slotDataBytes = alignUp(volumeBytes, 64);
+    header->futexWord.store(0);
+    header->published.store(0);
+    count = 0;
+    // magic last, readers ignore a ring that is not initialized yet
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, ringMagic, 8);
+    return 0;
+}
+
+void VolumeRing::closeRing()
+{
+    if (base)
+       munmap(base, mapBytes);
+    base = NULL;
+    header = NULL;
+    mapBytes = 0;
+    if (fd >= 0)
+       close(fd);
+    fd = -1;
+}
+
+int VolumeRing::publish(struct nifti_1_header &hdr, unsigned char *im, size_t bytes, int volumeIndex, int seriesNumber, double acquisitionTime)
+{
+    if (!isEnabled())
+       return 0;
+    // a larger volume (new series) gets a new ring, consumers see a new magic/inode
+    if ((header == NULL) || (bytes > header->slotDataBytes))
+    {
+       if (create(bytes) != 0)
+          return 1;
+    }
+
+    uint64_t seq = ++count;
+    SlotHeader *slot = (SlotHeader *)(base + header->headerBytes + ((seq-1) % header->slots) * header->slotStride);
+    unsigned char *data = (unsigned char *)slot + alignUp(sizeof(SlotHeader), 64);
+
+    slot->sequence.store(2*seq-1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->volumeIndex = volumeIndex;
+    slot->seriesNumber = seriesNumber;
+    slot->acquisitionTime = acquisitionTime;
+    slot->bytes = bytes;
+    slot->hdr = hdr;
+    memcpy(data, im, bytes);
+    slot->publishTime = GetMTime();
+    slot->sequence.store(2*seq, std::memory_order_release);
+
+    header->published.store(seq, std::memory_order_release);
+    header->futexWord.fetch_add(1, std::memory_order_release);
+    futex(&header->futexWord, FUTEX_WAKE, INT_MAX, NULL);
+    return 0;
+}
+
+int VolumeRingReader::openRing(const char *name)
+{
+    closeRing();
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+       return 1;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(RingHeader)))
+    {
+       closeRing();
+       return 2;
+    }
+    mapBytes = st.st_size;
+    void *mem = mmap(NULL, mapBytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+       mapBytes = 0;
+       closeRing();
+       return 3;
+    }
+    base = (unsigned char *)mem;
+    header = (RingHeader *)base;
+    if (memcmp(header->magic, ringMagic, 8) != 0)
+    {
+       closeRing();
+       return 4;
+    }
+    return 0;
+}
+
+void VolumeRingReader::closeRing()
+{
+    if (base)
+       munmap(base, mapBytes);
+    base = NULL;
+    header = NULL;
+    mapBytes = 0;
+    if (fd >= 0)
+       close(fd);
+    fd = -1;
+}
+
+uint64_t VolumeRingReader::waitNext(uint64_t lastSeen, int timeoutMs)
+{
+    if (header == NULL)
+       return 0;
+    double deadline = GetMTime() + timeoutMs;
+    while (1)
+    {
+       uint32_t word = header->futexWord.load(std::memory_order_acquire);
+       uint64_t seq = header->published.load(std::memory_order_acquire);
+       if (seq > lastSeen)
+          return seq;
+       double left = deadline - GetMTime();
+       if (left <= 0)
+          return 0;
+       struct timespec ts;
+       ts.tv_sec = (time_t)(left / 1000);
+       ts.tv_nsec = (long)((left - ts.tv_sec * 1000.0) * 1000000);
+       futex(&header->futexWord, FUTEX_WAIT, word, &ts);
+    }
+}
+
+int VolumeRingReader::readVolume(uint64_t seq, SlotHeader *slot, unsigned char *data, size_t dataBytes)
+{
+    if ((header == NULL) || (seq == 0))
+       return 1;
+    SlotHeader *src = (SlotHeader *)(base + header->headerBytes + ((seq-1) % header->slots) * header->slotStride);
+    unsigned char *srcData = (unsigned char *)src + alignUp(sizeof(SlotHeader), 64);
+
+    if (src->sequence.load(std::memory_order_acquire) != 2*seq)
+       return 1;
+    slot->volumeIndex = src->volumeIndex;
+    slot->seriesNumber = src->seriesNumber;
+    slot->acquisitionTime = src->acquisitionTime;
+    slot->publishTime = src->publishTime;
+    slot->bytes = src->bytes;
+    slot->hdr = src->hdr;
+    if ((data != NULL) && (src->bytes <= dataBytes))
+       memcpy(data, srcData, src->bytes);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // the producer may have lapped us while copying
+    return (src->sequence.load(std::memory_order_relaxed) != 2*seq);
+}
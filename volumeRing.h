@@ -0,0 +1,92 @@
+//
+//  volumeRing.h
+//
+//  POSIX shared memory ring with the last N converted volumes, so local
+//  consumers can map it read-only instead of re-reading the .nii files.
+//
+//  Layout: RingHeader, then `slots` slots of slotStride bytes, each a
+//  SlotHeader followed by the voxels. A slot's sequence is odd while it is
+//  being written and 2*n once volume n is complete (seqlock). Publishing
+//  bumps futexWord and wakes every waiter.
+//
+
+#ifndef volumeRing_h
+#define volumeRing_h
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include "memoryDCM.hpp"
+
+using namespace std;
+
+#define ringMagic "NIIRING1"
+#define ringDefaultSlots 8
+
+struct RingHeader
+{
+    char magic[8];
+    uint32_t slots;
+    uint32_t headerBytes;           // offset of the first slot
+    uint64_t slotStride;            // bytes from one slot to the next
+    uint64_t slotDataBytes;         // room for voxels in each slot
+    std::atomic<uint32_t> futexWord;
+    uint32_t pad;
+    std::atomic<uint64_t> published; // number of the last complete volume
+};
+
+struct SlotHeader
+{
+    std::atomic<uint64_t> sequence;
+    int32_t volumeIndex;
+    int32_t seriesNumber;
+    double acquisitionTime;         // DICOM acquisition time of the first slice
+    double publishTime;             // GetMTime() when the slot was completed
+    uint64_t bytes;
+    struct nifti_1_header hdr;
+};
+
+class VolumeRing
+{
+    int fd;
+    unsigned char *base;
+    size_t mapBytes;
+    RingHeader *header;
+    uint64_t count;
+    int create(size_t volumeBytes);
+public:
+    string name;   // shm object name, e.g. /dicomFTP_volumes
+    int slots;
+
+    // copies the volume into the next slot and wakes the consumers
+    int publish(struct nifti_1_header &hdr, unsigned char *im, size_t bytes, int volumeIndex, int seriesNumber, double acquisitionTime);
+
+    int isEnabled() { return name.size() > 0; };
+    void closeRing();
+
+    VolumeRing() { fd = -1; base = NULL; mapBytes = 0; header = NULL; count = 0; slots = ringDefaultSlots; };
+    ~VolumeRing() { closeRing(); };
+};
+
+// consumer side, maps the ring read-only
+class VolumeRingReader
+{
+    int fd;
+    unsigned char *base;
+    size_t mapBytes;
+    RingHeader *header;
+public:
+    int openRing(const char *name);
+
+    // blocks until a volume newer than lastSeen is published, returns its number or 0 on timeout
+    uint64_t waitNext(uint64_t lastSeen, int timeoutMs);
+
+    // copies volume seq into slot/data, 0 when the copy is consistent, 1 if it was overwritten
+    int readVolume(uint64_t seq, SlotHeader *slot, unsigned char *data, size_t dataBytes);
+
+    void closeRing();
+    VolumeRingReader() { fd = -1; base = NULL; mapBytes = 0; header = NULL; };
+    ~VolumeRingReader() { closeRing(); };
+};
+
+#endif /* volumeRing_h */